@@ -11,6 +11,8 @@
 #include "fileop.h"
 #include "keymanager.h"
 #include "fileenc.h"
+#include "keyring.h"
+#include "benchmark.h"
 
 void setup() {
   digitalWrite(PB8, HIGH); // Put CS lines for card HIGH right away to avoid confusion
@@ -26,16 +28,21 @@ void setup() {
 const char mainmenu[] =
   "\r\n\r\nM - Mount Drives\r\n\
 K - Key manager\r\n\
+L - Public Keyring\r\n\
 R - Randomness Test\r\n\
 T - Text Editor\r\n\
 N - Text Edit New File\r\n\
 V - View File\r\n\
 E - Encrypt File\r\n\
+S - Encrypt for Several Recipients\r\n\
 D - Decrypt File\r\n\
+C - Check Encrypted File\r\n\
+W - View Encrypted File\r\n\
+F - Batch Encrypt/Decrypt Folder\r\n\
 X - Delete File\r\n\
 \r\n\r\nOption: ";
 
-const char mainmenuoptions[] = "MKRTNVEDZX";
+const char mainmenuoptions[] = "MKLRTNVESDCWFZXB";
 
 void loop()
 {
@@ -71,6 +78,8 @@ void loop()
       break;
     case 'K': keymanager();
       break;
+    case 'L': keyring();
+      break;
     case 'X': file_delete();
       break;
     case 'N': file_new();
@@ -83,10 +92,20 @@ void loop()
       break;
     case 'E': fileenc_encrypt();
       break;
+    case 'S': fileenc_encrypt_recipients();
+      break;
     case 'D': fileenc_decrypt();
       break;
+    case 'C': fileenc_verify();
+      break;
+    case 'W': fileenc_view();
+      break;
+    case 'F': fileenc_batch();
+      break;
     case 'Z': randomness_show();
       break;
+    case 'B': benchmark();
+      break;
 
   }
 }
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "Arduino.h"
+#include <ff.h>
+#include <AES.h>
+#include <GCM.h>
+#include "consoleio.h"
+#include "fileop.h"
+#include "cryptotool.h"
+#include "checksum.h"
+#include "benchmark.h"
+#include "cyclecount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif  
+
+#define BENCHMARK_BUFSIZE 480
+#define BENCHMARK_ITERATIONS 32
+
+#ifdef __arm__
+#define BENCHMARK_TICKS_PER_SEC F_CPU
+#else
+#define BENCHMARK_TICKS_PER_SEC 1000000u
+#endif
+
+#define BENCHMARK_IO_FILE "1:/BENCH.TMP"
+#define BENCHMARK_IO_SIZE 16384
+
+typedef struct _benchmark_buffers
+{
+  FIL      fil;
+  file_readahead read_ahead;
+  uint8_t  data[BENCHMARK_BUFSIZE];
+  char     text[BASE64_ENCODED_LEN(BENCHMARK_BUFSIZE)];
+  uint16_t read_curpos;
+  uint16_t read_total;
+  uint16_t write_curpos;
+} benchmark_buffers;
+
+void benchmark_report(const char *name, uint32_t bytes, uint32_t us)
+{
+  console_puts(name);
+  console_puts(": ");
+  if (us == 0) us = 1;
+  console_printuint((uint32_t)((((uint64_t)bytes)*1000000u)/us));
+  console_puts(" B/s\r\n");
+}
+
+void benchmark_report_ms(const char *name, uint32_t bytes, uint32_t ms)
+{
+  console_puts(name);
+  console_puts(": ");
+  console_printuint(bytes);
+  console_puts(" B, ");
+  if (ms == 0) ms = 1;
+  console_printuint((uint32_t)((((uint64_t)bytes)*1000u)/ms));
+  console_puts(" B/s\r\n");
+}
+
+uint32_t benchmark_ticks(void)
+{
+#ifdef __arm__
+  return CPU_CYCLES;
+#else
+  return micros();
+#endif
+}
+
+void benchmark_stages_init(benchmark_stages *bs)
+{
+#ifdef __arm__
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CTRL |= CYCCNTENA;
+#endif
+  memset((void *)bs, '\000', sizeof(*bs));
+}
+
+void benchmark_stage_add(benchmark_stages *bs, int stage, uint32_t start, uint32_t bytes)
+{
+  bs->ticks[stage] += (uint32_t)(benchmark_ticks() - start);
+  bs->bytes[stage] += bytes;
+}
+
+static const char * const benchmark_stage_names[BENCHMARK_STAGES] =
+  { "read", "compress", "cipher", "armor", "write" };
+
+void benchmark_stages_report(const benchmark_stages *bs)
+{
+  console_puts("\r\nStage timing:\r\n");
+  for (int i=0;i<BENCHMARK_STAGES;i++)
+  {
+    uint64_t ticks = bs->ticks[i];
+    if ((ticks == 0) && (bs->bytes[i] == 0)) continue;
+    console_puts(benchmark_stage_names[i]);
+    console_puts(": ");
+    console_printuint(bs->bytes[i]);
+    console_puts(" B, ");
+    console_printuint((uint32_t)((ticks*1000u)/BENCHMARK_TICKS_PER_SEC));
+    console_puts(" ms, ");
+    if (ticks == 0) ticks = 1;
+    console_printuint((uint32_t)((((uint64_t)bs->bytes[i])*BENCHMARK_TICKS_PER_SEC)/ticks));
+    console_puts(" B/s\r\n");
+  }
+}
+
+static int benchmark_encode_readdata(void *v)
+{
+  benchmark_buffers *bb = (benchmark_buffers *)v;
+  if (bb->read_curpos >= bb->read_total) return -1;
+  return bb->data[bb->read_curpos++];
+}
+
+static int benchmark_encode_writedata(int c, void *v)
+{
+  benchmark_buffers *bb = (benchmark_buffers *)v;
+  bb->text[bb->write_curpos++] = c;
+  return 0;
+}
+
+static int benchmark_decode_readdata(void *v)
+{
+  benchmark_buffers *bb = (benchmark_buffers *)v;
+  if (bb->read_curpos >= bb->read_total) return -1;
+  return bb->text[bb->read_curpos++];
+}
+
+static int benchmark_decode_writedata(int c, void *v)
+{
+  benchmark_buffers *bb = (benchmark_buffers *)v;
+  bb->data[bb->write_curpos++] = c;
+  return 0;
+}
+
+void benchmark_base64(benchmark_buffers *bb)
+{
+  base64_state bs;
+  uint32_t start;
+  int i;
+
+  for (i=0;i<BENCHMARK_BUFSIZE;i++) bb->data[i] = i*7;
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+  {
+    bb->read_curpos = bb->write_curpos = 0;
+    bb->read_total = BENCHMARK_BUFSIZE;
+    base64_encode(benchmark_encode_readdata, (void *)bb, benchmark_encode_writedata, (void *)bb);
+  }
+  benchmark_report("b64 enc callback", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+  {
+    base64_state_init(&bs);
+    size_t n = base64_encode_span(&bs, bb->data, BENCHMARK_BUFSIZE, bb->text);
+    base64_encode_final(&bs, &bb->text[n]);
+  }
+  benchmark_report("b64 enc span", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+  {
+    bb->read_curpos = bb->write_curpos = 0;
+    bb->read_total = sizeof(bb->text);
+    base64_decode(benchmark_decode_readdata, (void *)bb, benchmark_decode_writedata, (void *)bb);
+  }
+  benchmark_report("b64 dec callback", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+  {
+    base64_state_init(&bs);
+    size_t n = base64_decode_span(&bs, bb->text, sizeof(bb->text), bb->data);
+    base64_decode_final(&bs, &bb->data[n]);
+  }
+  benchmark_report("b64 dec span", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+}
+
+/* Reads and encrypts a file with the card latency simulated, first with each
+   read waited for before encrypting and then with the next read overlapping
+   the encryption of the last */
+void benchmark_readahead(benchmark_buffers *bb)
+{
+  UINT br;
+  int i;
+
+  if (!fs1_mounted) 
+  {
+    console_puts("Mount plaintext card for I/O benchmark\r\n");
+    return;
+  }
+  if (f_open(&bb->fil, BENCHMARK_IO_FILE, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) return;
+  for (i=0;i<BENCHMARK_BUFSIZE;i++) bb->data[i] = i*7;
+  for (i=0;i<BENCHMARK_IO_SIZE;i+=BENCHMARK_BUFSIZE)
+    f_write(&bb->fil, bb->data, BENCHMARK_BUFSIZE, &br);
+  f_close(&bb->fil);
+  for (uint8_t overlap=0;overlap<2;overlap++)
+  {
+    GCM<AES256> cipher;
+    uint32_t start, total = 0;
+    if (f_open(&bb->fil, BENCHMARK_IO_FILE, FA_READ) != FR_OK) break;
+    memset(bb->data, '\000', AES_KEYLEN);
+    cipher.setKey(bb->data, cipher.keySize());
+    cipher.setIV(bb->data, cipher.ivSize());
+    file_readahead_init(&bb->read_ahead, &bb->fil, overlap);
+    bb->read_ahead.backend = &file_read_backend_latency;
+    start = micros();
+    while ((file_readahead_read(&bb->read_ahead, bb->data, BENCHMARK_BUFSIZE, &br) == FR_OK) && (br > 0))
+    {
+      cipher.encrypt(bb->data, bb->data, br);
+      total += br;
+    }
+    file_readahead_close(&bb->read_ahead);
+    benchmark_report(overlap ? "read+gcm overlapped" : "read+gcm serial", total, micros()-start);
+    f_close(&bb->fil);
+  }
+  f_unlink(BENCHMARK_IO_FILE);
+}
+
+#define BENCHMARK_CHECKSUM_LINE 27
+
+/* Checksums the buffer whole and a line of armor at a time */
+void benchmark_checksum(benchmark_buffers *bb)
+{
+  uint32_t start, crc = CHECKSUM_CRC32_INIT;
+  uint16_t crc16 = CHECKSUM_CRC16_INIT;
+  int i, j;
+
+  for (i=0;i<BENCHMARK_BUFSIZE;i++) bb->data[i] = i*7;
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+    crc16 = checksum_crc16(crc16, bb->data, BENCHMARK_BUFSIZE);
+  benchmark_report("crc16", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+    crc = checksum_crc32(crc, bb->data, BENCHMARK_BUFSIZE);
+  benchmark_report("crc32", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+  {
+    for (j=0;j<BENCHMARK_BUFSIZE;j+=BENCHMARK_CHECKSUM_LINE)
+    {
+      int n = BENCHMARK_BUFSIZE - j;
+      if (n > BENCHMARK_CHECKSUM_LINE) n = BENCHMARK_CHECKSUM_LINE;
+      crc = checksum_crc32(CHECKSUM_CRC32_INIT, &bb->data[j], n);
+    }
+  }
+  benchmark_report("crc32 per line", BENCHMARK_BUFSIZE*BENCHMARK_ITERATIONS, micros()-start);
+}
+
+#define BENCHMARK_RECORD_LEN 64
+
+/* Seals small records with a key set up for each one and with one context
+   kept for the key */
+void benchmark_gcm_records(benchmark_buffers *bb)
+{
+  aes256_gcm_context gc;
+  uint8_t *key = bb->data, *iv = &bb->data[AES_KEYLEN], *tag = &bb->data[AES_KEYLEN+AES_BLOCKLEN];
+  uint8_t *record = &bb->data[AES_KEYLEN+AES_BLOCKLEN+AES_GCM_TAG_LENGTH];
+  uint32_t start;
+  int i, j;
+
+  memset(bb->data, '\000', BENCHMARK_BUFSIZE);
+  start = micros();
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+    for (j=0;j<BENCHMARK_RECORD_LEN;j++)
+      aes256_gcm_memcrypt(1, key, iv, tag, record, BENCHMARK_RECORD_LEN);
+  benchmark_report("gcm records, new key", BENCHMARK_RECORD_LEN*BENCHMARK_RECORD_LEN*BENCHMARK_ITERATIONS, micros()-start);
+  start = micros();
+  aes256_gcm_init(&gc, key);
+  for (i=0;i<BENCHMARK_ITERATIONS;i++)
+    for (j=0;j<BENCHMARK_RECORD_LEN;j++)
+      aes256_gcm_seal(&gc, iv, tag, record, BENCHMARK_RECORD_LEN);
+  aes256_gcm_clear(&gc);
+  benchmark_report("gcm records, context", BENCHMARK_RECORD_LEN*BENCHMARK_RECORD_LEN*BENCHMARK_ITERATIONS, micros()-start);
+}
+
+#define BENCHMARK_KDF_HASHES 1000
+
+/* Times the original key derivation function against the one that restores
+   its keyed state for each iteration */
+void benchmark_kdf(benchmark_buffers *bb)
+{
+  memset(bb->data, '\000', KEYMANAGER_HASHLEN*2);
+  for (uint8_t v2=0;v2<2;v2++)
+  {
+    uint32_t start = micros(), us;
+    if (v2)
+      key_derivation_function_v2(bb->data, bb->data, KEYMANAGER_HASHLEN, bb->data+KEYMANAGER_HASHLEN, KEYMANAGER_HASHLEN, BENCHMARK_KDF_HASHES);
+    else
+      key_derivation_function_iterations(bb->data, bb->data, KEYMANAGER_HASHLEN, bb->data+KEYMANAGER_HASHLEN, KEYMANAGER_HASHLEN, BENCHMARK_KDF_HASHES);
+    us = micros() - start;
+    if (us == 0) us = 1;
+    console_puts(v2 ? "kdf v2: " : "kdf: ");
+    console_printuint(us/1000);
+    console_puts(" ms, ");
+    console_printuint((uint32_t)((((uint64_t)BENCHMARK_KDF_HASHES)*1000000u)/us));
+    console_puts(" hashes/s\r\n");
+  }
+}
+
+void benchmark(void)
+{
+  benchmark_buffers *bb = (benchmark_buffers *)malloc(sizeof(benchmark_buffers));
+  if (bb == NULL) return;
+  console_clrscr();
+  console_puts("Benchmarks:\r\n\r\n");
+  benchmark_base64(bb);
+  benchmark_checksum(bb);
+  benchmark_kdf(bb);
+  benchmark_gcm_records(bb);
+  benchmark_readahead(bb);
+  free(bb);
+  console_press_space();
+}
+
+#ifdef __cplusplus
+}
+#endif  
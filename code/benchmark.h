@@ -0,0 +1,55 @@
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif  
+
+/* Time spent in each stage of the file encryption pipeline, counted in CPU
+   cycles on the device and in microseconds elsewhere */
+#define BENCHMARK_STAGE_READ     0
+#define BENCHMARK_STAGE_COMPRESS 1
+#define BENCHMARK_STAGE_CIPHER   2
+#define BENCHMARK_STAGE_ARMOR    3
+#define BENCHMARK_STAGE_WRITE    4
+#define BENCHMARK_STAGES         5
+
+typedef struct _benchmark_stages
+{
+  uint64_t ticks[BENCHMARK_STAGES];
+  uint32_t bytes[BENCHMARK_STAGES];
+} benchmark_stages;
+
+void benchmark(void);
+uint32_t benchmark_ticks(void);
+void benchmark_stages_init(benchmark_stages *bs);
+void benchmark_stage_add(benchmark_stages *bs, int stage, uint32_t start, uint32_t bytes);
+void benchmark_stages_report(const benchmark_stages *bs);
+void benchmark_report(const char *name, uint32_t bytes, uint32_t us);
+void benchmark_report_ms(const char *name, uint32_t bytes, uint32_t ms);
+
+#ifdef __cplusplus
+}
+#endif  
+
+#endif  /* _BENCHMARK_H */
@@ -0,0 +1,47 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CRC16 is CRC-16/XMODEM (polynomial 0x1021, starting from zero), the
+   checksum of exported public keys.  CRC32 is CRC-32/MPEG-2 (polynomial
+   0x04C11DB7, not reflected, starting from all ones and not inverted at the
+   end), which is what the CRC unit of the STM32 computes.  Both take the
+   running checksum so that data can be checksummed in pieces. */
+
+#define CHECKSUM_CRC16_INIT 0x0000
+#define CHECKSUM_CRC32_INIT 0xFFFFFFFFu
+
+uint16_t checksum_crc16(uint16_t crc, const void *data, size_t len);
+uint32_t checksum_crc32(uint32_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _CHECKSUM_H */
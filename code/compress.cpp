@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <string.h>
+#include "compress.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LZSS_NIL 0xFFFF
+
+/* The encoder buffer holds up to a window of history before pos and the
+   input not yet encoded after it.  When the buffer is full the oldest
+   window is dropped and the hash chains are moved down with it. */
+
+void lzss_encode_init(lzss_encoder *le)
+{
+  memset((void *)le->head, 0xFF, sizeof(le->head));
+  memset((void *)le->prev, 0xFF, sizeof(le->prev));
+  le->pos = le->filled = 0;
+  le->group[0] = 0;
+  le->group_len = 1;
+  le->group_items = 0;
+}
+
+static uint8_t lzss_hash(const uint8_t *p)
+{
+  return ((p[0] << 5) ^ (p[1] << 2) ^ p[2]) & (LZSS_HASH_SIZE-1);
+}
+
+static void lzss_encode_slide(lzss_encoder *le)
+{
+  memmove(le->buf, &le->buf[LZSS_WINDOW], le->filled - LZSS_WINDOW);
+  le->pos -= LZSS_WINDOW;
+  le->filled -= LZSS_WINDOW;
+  for (int i=0;i<LZSS_HASH_SIZE;i++)
+    le->head[i] = ((le->head[i] == LZSS_NIL) || (le->head[i] < LZSS_WINDOW)) ? LZSS_NIL : le->head[i] - LZSS_WINDOW;
+  for (int i=0;i<LZSS_WINDOW;i++)
+    le->prev[i] = ((le->prev[i] == LZSS_NIL) || (le->prev[i] < LZSS_WINDOW)) ? LZSS_NIL : le->prev[i] - LZSS_WINDOW;
+}
+
+uint8_t *lzss_encode_space(lzss_encoder *le, size_t *len)
+{
+  if ((le->filled == sizeof(le->buf)) && (le->pos >= LZSS_WINDOW))
+    lzss_encode_slide(le);
+  *len = sizeof(le->buf) - le->filled;
+  return &le->buf[le->filled];
+}
+
+void lzss_encode_added(lzss_encoder *le, size_t len)
+{
+  le->filled += len;
+}
+
+static void lzss_insert(lzss_encoder *le, uint16_t p)
+{
+  if ((p+2) >= le->filled) return;
+  uint8_t h = lzss_hash(&le->buf[p]);
+  le->prev[p & (LZSS_WINDOW-1)] = le->head[h];
+  le->head[h] = p;
+}
+
+static void lzss_encode_item(lzss_encoder *le)
+{
+  uint16_t avail = le->filled - le->pos;
+  uint16_t best_len = 0, best_dist = 0;
+  if (avail > LZSS_MAX_MATCH) avail = LZSS_MAX_MATCH;
+  if (avail >= LZSS_MIN_MATCH)
+  {
+    const uint8_t *p = &le->buf[le->pos];
+    uint16_t cand = le->head[lzss_hash(p)];
+    for (int chain=0;(chain<LZSS_CHAIN_LIMIT) && (cand != LZSS_NIL) && (cand < le->pos) && ((le->pos - cand) <= LZSS_WINDOW);chain++)
+    {
+      const uint8_t *c = &le->buf[cand];
+      if ((c[best_len] == p[best_len]) && (c[0] == p[0]))
+      {
+        uint16_t l = 1;
+        while ((l < avail) && (c[l] == p[l])) l++;
+        if (l > best_len)
+        {
+          best_len = l;
+          best_dist = le->pos - cand;
+          if (l == avail) break;
+        }
+      }
+      uint16_t next = le->prev[cand & (LZSS_WINDOW-1)];
+      if ((next != LZSS_NIL) && (next >= cand)) break;
+      cand = next;
+    }
+  }
+  if (best_len >= LZSS_MIN_MATCH)
+  {
+    le->group[0] |= (1 << le->group_items);
+    le->group[le->group_len++] = (best_dist - 1) & 0xFF;
+    le->group[le->group_len++] = ((best_dist - 1) >> 8) | ((best_len - LZSS_MIN_MATCH) << 1);
+  } else
+  {
+    best_len = 1;
+    le->group[le->group_len++] = le->buf[le->pos];
+  }
+  le->group_items++;
+  while (best_len-- > 0)
+    lzss_insert(le, le->pos++);
+}
+
+size_t lzss_encode_output(lzss_encoder *le, uint8_t *out, size_t outlen, int final)
+{
+  size_t o = 0;
+  for (;;)
+  {
+    int more = (le->filled - le->pos) >= (final ? 1 : LZSS_MAX_MATCH);
+    if ((le->group_items == 8) || ((!more) && (final) && (le->group_items > 0)))
+    {
+      if ((outlen - o) < le->group_len) break;
+      memcpy(&out[o], le->group, le->group_len);
+      o += le->group_len;
+      le->group[0] = 0;
+      le->group_len = 1;
+      le->group_items = 0;
+      continue;
+    }
+    if (!more) break;
+    lzss_encode_item(le);
+  }
+  return o;
+}
+
+void lzss_decode_init(lzss_decoder *ld)
+{
+  memset((void *)ld, '\000', sizeof(*ld));
+}
+
+size_t lzss_decode(lzss_decoder *ld, const uint8_t *in, size_t inlen, size_t *consumed, uint8_t *out, size_t outlen)
+{
+  size_t i = 0, o = 0;
+  while (o < outlen)
+  {
+    if (ld->copy_len > 0)
+    {
+      uint8_t c = ld->window[(ld->wpos - ld->copy_dist) & (LZSS_WINDOW-1)];
+      ld->window[(ld->wpos++) & (LZSS_WINDOW-1)] = c;
+      out[o++] = c;
+      ld->copy_len--;
+      continue;
+    }
+    if (i >= inlen) break;
+    uint8_t b = in[i++];
+    if (ld->flag_count == 0)
+    {
+      ld->flags = b;
+      ld->flag_count = 8;
+      continue;
+    }
+    if (ld->flags & 1)
+    {
+      if (!ld->have_low)
+      {
+        ld->low = b;
+        ld->have_low = 1;
+        continue;
+      }
+      ld->have_low = 0;
+      ld->copy_dist = (ld->low | ((b & 1) << 8)) + 1;
+      ld->copy_len = (b >> 1) + LZSS_MIN_MATCH;
+    } else
+    {
+      ld->window[(ld->wpos++) & (LZSS_WINDOW-1)] = b;
+      out[o++] = b;
+    }
+    ld->flags >>= 1;
+    ld->flag_count--;
+  }
+  *consumed = i;
+  return o;
+}
+
+#ifdef __cplusplus
+}
+#endif
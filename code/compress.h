@@ -0,0 +1,80 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LZSS compression.  The compressed stream is a sequence of groups, each a
+   flag byte followed by up to eight items.  A clear flag bit (taken from the
+   least significant bit first) is a literal byte, a set bit is a two byte
+   match: the low 8 bits of the distance less one, then the ninth bit of the
+   distance less one and the match length less LZSS_MIN_MATCH shifted up by
+   one. */
+
+#define LZSS_WINDOW 512
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH (LZSS_MIN_MATCH+127)
+#define LZSS_HASH_SIZE 256
+#define LZSS_CHAIN_LIMIT 16
+#define LZSS_GROUP_LEN (1+8*2)
+
+typedef struct _lzss_encoder
+{
+  uint8_t  buf[LZSS_WINDOW*2];
+  uint16_t head[LZSS_HASH_SIZE];
+  uint16_t prev[LZSS_WINDOW];
+  uint16_t pos;
+  uint16_t filled;
+  uint8_t  group[LZSS_GROUP_LEN];
+  uint8_t  group_len;
+  uint8_t  group_items;
+} lzss_encoder;
+
+typedef struct _lzss_decoder
+{
+  uint8_t  window[LZSS_WINDOW];
+  uint16_t wpos;
+  uint16_t copy_dist;
+  uint8_t  copy_len;
+  uint8_t  flags;
+  uint8_t  flag_count;
+  uint8_t  have_low;
+  uint8_t  low;
+} lzss_decoder;
+
+void lzss_encode_init(lzss_encoder *le);
+uint8_t *lzss_encode_space(lzss_encoder *le, size_t *len);
+void lzss_encode_added(lzss_encoder *le, size_t len);
+size_t lzss_encode_output(lzss_encoder *le, uint8_t *out, size_t outlen, int final);
+void lzss_decode_init(lzss_decoder *ld);
+size_t lzss_decode(lzss_decoder *ld, const uint8_t *in, size_t inlen, size_t *consumed, uint8_t *out, size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _COMPRESS_H */
@@ -30,6 +30,9 @@ Stream *externalSerial = NULL;
 
 PS2Keyboard kbd;
 
+static console_idle_function console_idle = NULL;
+static unsigned long console_last_key = 0;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -41,10 +44,24 @@ int console_inchar(void)
   return -1;
 }
 
+void console_set_idle(console_idle_function idle)
+{
+  console_idle = idle;
+}
+
+unsigned long console_idle_time(void)
+{
+  return millis() - console_last_key;
+}
+
 int console_getch(void)
 {
   int ch;
-  while ((ch=kbd.getkey()) < 0);
+  while ((ch=kbd.getkey()) < 0)
+  {
+    if (console_idle != NULL) console_idle();
+  }
+  console_last_key = millis();
   return ch;
 }
 
@@ -26,8 +26,14 @@ freely, subject to the following restrictions:
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+/* Called repeatedly while console_getch waits for a key */
+typedef void (*console_idle_function)(void);
+
 int console_inchar(void);
 int console_getch(void);
+void console_set_idle(console_idle_function idle);
+unsigned long console_idle_time(void);
 void console_putch(char c);
 void console_puts(const char *c);
 void console_init(void);
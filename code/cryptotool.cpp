@@ -1,7 +1,9 @@
 /* BASE 64 encoding */
 
+#include "Arduino.h"
 #include <stdlib.h>
 #include <string.h>
+#include <Crypto.h>
 #include <BLAKE2s.h>
 #include <AES.h>
 #include <CTR.h>
@@ -111,6 +113,148 @@ int base64_decode(base64_readdata rd, void *vrd, base64_writedata wd, void *vwd)
 			return 1;
 }
 
+void base64_state_init(base64_state *bs)
+{
+  bs->bits = 0;
+  bs->count = 0;
+}
+
+static inline char *base64_put_quad(char *out, uint32_t triple)
+{
+  out[0] = encoding_table[(triple >> 3 * 6) & 0x3F];
+  out[1] = encoding_table[(triple >> 2 * 6) & 0x3F];
+  out[2] = encoding_table[(triple >> 1 * 6) & 0x3F];
+  out[3] = encoding_table[(triple >> 0 * 6) & 0x3F];
+  return out+4;
+}
+
+/* Encodes inlen bytes, writing at most BASE64_ENCODED_LEN(inlen+2) characters.
+   Up to two trailing bytes are held in the state for the next call. */
+size_t base64_encode_span(base64_state *bs, const uint8_t *in, size_t inlen, char *out)
+{
+  char *o = out;
+  while ((bs->count > 0) && (inlen > 0))
+  {
+    bs->bits = (bs->bits << 8) | *in++;
+    inlen--;
+    if ((++bs->count) == 3)
+    {
+      o = base64_put_quad(o, bs->bits);
+      bs->bits = 0;
+      bs->count = 0;
+    }
+  }
+  while (inlen >= 3)
+  {
+    o = base64_put_quad(o, (((uint32_t)in[0]) << 0x10) | (((uint32_t)in[1]) << 0x08) | ((uint32_t)in[2]));
+    in += 3;
+    inlen -= 3;
+  }
+  while (inlen > 0)
+  {
+    bs->bits = (bs->bits << 8) | *in++;
+    bs->count++;
+    inlen--;
+  }
+  return (size_t)(o-out);
+}
+
+/* Flushes a partial group with '=' padding, writing 0 or 4 characters */
+size_t base64_encode_final(base64_state *bs, char *out)
+{
+  size_t n = 0;
+  if (bs->count > 0)
+  {
+    uint32_t triple = bs->bits << ((3 - bs->count) * 8);
+    base64_put_quad(out, triple);
+    if (bs->count < 2) out[2] = '=';
+    out[3] = '=';
+    n = 4;
+  }
+  base64_state_init(bs);
+  return n;
+}
+
+/* Decodes inlen characters, writing at most BASE64_DECODED_LEN(inlen+3) bytes.
+   Characters outside of the alphabet, including padding, are skipped. */
+size_t base64_decode_span(base64_state *bs, const char *in, size_t inlen, uint8_t *out)
+{
+  uint8_t *o = out;
+  const uint8_t *c = (const uint8_t *)in;
+  const uint8_t *e = c + inlen;
+  while (c < e)
+  {
+    if ((bs->count == 0) && ((e-c) >= 4))
+    {
+      uint8_t d1 = decoding_table[c[0]], d2 = decoding_table[c[1]];
+      uint8_t d3 = decoding_table[c[2]], d4 = decoding_table[c[3]];
+      if ((d1 | d2 | d3 | d4) < 0x40)
+      {
+        uint32_t triple = (((uint32_t)d1) << 3 * 6) | (((uint32_t)d2) << 2 * 6) |
+                          (((uint32_t)d3) << 1 * 6) | ((uint32_t)d4);
+        o[0] = (triple >> 2 * 8) & 0xFF;
+        o[1] = (triple >> 1 * 8) & 0xFF;
+        o[2] = (triple >> 0 * 8) & 0xFF;
+        o += 3;
+        c += 4;
+        continue;
+      }
+    }
+    uint8_t d = decoding_table[*c++];
+    if (d >= 0x40) continue;
+    bs->bits = (bs->bits << 6) | d;
+    if ((++bs->count) == 4)
+    {
+      o[0] = (bs->bits >> 2 * 8) & 0xFF;
+      o[1] = (bs->bits >> 1 * 8) & 0xFF;
+      o[2] = (bs->bits >> 0 * 8) & 0xFF;
+      o += 3;
+      bs->bits = 0;
+      bs->count = 0;
+    }
+  }
+  return (size_t)(o-out);
+}
+
+/* Decodes inlen/4 whole groups with no partial group carried in or out.
+   Returns the number of bytes decoded, or -1 if any character is not a
+   base64 digit, in which case the output is not valid. */
+int base64_decode_groups(const char *in, size_t inlen, uint8_t *out)
+{
+  const uint8_t *c = (const uint8_t *)in;
+  const uint8_t *e = c + (inlen & ~3);
+  uint8_t *o = out;
+  uint8_t invalid = 0;
+  while (c < e)
+  {
+    uint8_t d1 = decoding_table[c[0]], d2 = decoding_table[c[1]];
+    uint8_t d3 = decoding_table[c[2]], d4 = decoding_table[c[3]];
+    uint32_t triple = (((uint32_t)d1) << 3 * 6) | (((uint32_t)d2) << 2 * 6) |
+                      (((uint32_t)d3) << 1 * 6) | ((uint32_t)d4);
+    invalid |= d1 | d2 | d3 | d4;
+    o[0] = (triple >> 2 * 8) & 0xFF;
+    o[1] = (triple >> 1 * 8) & 0xFF;
+    o[2] = (triple >> 0 * 8) & 0xFF;
+    o += 3;
+    c += 4;
+  }
+  return (invalid >= 0x40) ? -1 : (int)(o-out);
+}
+
+/* Flushes the bytes of a partial group, writing at most 2 bytes */
+size_t base64_decode_final(base64_state *bs, uint8_t *out)
+{
+  size_t n = 0;
+  if (bs->count > 1)
+  {
+    uint32_t triple = bs->bits << ((4 - bs->count) * 6);
+    out[n++] = (triple >> 2 * 8) & 0xFF;
+    if (bs->count > 2) out[n++] = (triple >> 1 * 8) & 0xFF;
+  }
+  base64_state_init(bs);
+  return n;
+}
+
 int ctblake2s( void *out, size_t outlen, const void *in, size_t inlen, const void *key, size_t keylen )
 {
 	BLAKE2s blake2s;
@@ -125,6 +269,11 @@ int ctblake2s( void *out, size_t outlen, const void *in, size_t inlen, const voi
 
 /* PBKDF2 for 32 bits output */
 int key_derivation_function(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len)
+{
+  return key_derivation_function_iterations(hash, passphrase, passphrase_len, salt, salt_len, KEY_DERIVATION_HASHES);
+}
+
+int key_derivation_function_iterations(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len, uint32_t iterations)
 {
   BLAKE2s blake2s;
   const uint8_t b[4] = { 0, 0, 0, 1 };
@@ -136,7 +285,7 @@ int key_derivation_function(void *hash, void *passphrase, size_t passphrase_len,
   blake2s.finalize(hash, KEYMANAGER_HASHLEN);
   memcpy((void *)current_hash, (void *)hash, KEYMANAGER_HASHLEN);
     
-	for (uint32_t n=1;n<KEY_DERIVATION_HASHES;n++)
+	for (uint32_t n=1;n<iterations;n++)
 	{
     blake2s.reset((uint8_t *)current_hash, KEYMANAGER_HASHLEN);
     blake2s.update((uint8_t *)passphrase, passphrase_len);
@@ -146,19 +295,213 @@ int key_derivation_function(void *hash, void *passphrase, size_t passphrase_len,
 	return 0;
 }
 
+/* PBKDF2 style with the passphrase as the fixed key of each iteration in
+   place of the last hash.  The passphrase is hashed to a key which is
+   absorbed with the salt once, and that state is restored for each iteration
+   so an iteration compresses one block rather than two.  This gives a
+   different result from key_derivation_function_iterations. */
+int key_derivation_function_v2(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len, uint32_t iterations)
+{
+  BLAKE2s blake2s;
+  BLAKE2s::State keyed;
+  const uint8_t b[4] = { 0, 0, 0, 1 };
+  uint8_t key[KEYMANAGER_HASHLEN];
+  uint8_t current_hash[KEYMANAGER_HASHLEN];
+
+  ctblake2s(key, sizeof(key), passphrase, passphrase_len, NULL, 0);
+  blake2s.reset(key, sizeof(key), KEYMANAGER_HASHLEN);
+  blake2s.update((uint8_t *)salt, salt_len);
+  blake2s.saveState(keyed);
+  blake2s.update(b, sizeof(b));
+  blake2s.finalize(hash, KEYMANAGER_HASHLEN);
+  memcpy((void *)current_hash, (void *)hash, KEYMANAGER_HASHLEN);
+
+  for (uint32_t n=1;n<iterations;n++)
+  {
+    blake2s.restoreState(keyed);
+    blake2s.update(current_hash, KEYMANAGER_HASHLEN);
+    blake2s.finalize(current_hash, KEYMANAGER_HASHLEN);
+    for (int i=0;i<KEYMANAGER_HASHLEN;i++) ((uint8_t *)hash)[i] ^= current_hash[i];
+  }
+  clean(keyed);
+  clean(key);
+  clean(current_hash);
+  return 0;
+}
+
+#define KEY_DERIVATION_CALIBRATE_HASHES 64
+#define KEY_DERIVATION_CALIBRATE_MS 100
+
+/* Times the key derivation function on this device and returns the number
+   of iterations that takes about target_ms */
+uint32_t key_derivation_calibrate(uint32_t target_ms)
+{
+  uint8_t hash[KEYMANAGER_HASHLEN];
+  uint8_t salt[KEYMANAGER_HASHLEN];
+  uint32_t done = 0;
+  uint32_t start = millis(), elapsed;
+
+  memset(salt, '\000', sizeof(salt));
+  do
+  {
+    key_derivation_function_iterations(hash, salt, sizeof(salt), salt, sizeof(salt), KEY_DERIVATION_CALIBRATE_HASHES);
+    done += KEY_DERIVATION_CALIBRATE_HASHES;
+    elapsed = millis() - start;
+  } while (elapsed < KEY_DERIVATION_CALIBRATE_MS);
+  uint64_t iterations = (((uint64_t)done) * target_ms) / elapsed;
+  if (iterations < KEY_DERIVATION_MIN_HASHES) iterations = KEY_DERIVATION_MIN_HASHES;
+  if (iterations > KEY_DERIVATION_MAX_HASHES) iterations = KEY_DERIVATION_MAX_HASHES;
+  return (uint32_t)iterations;
+}
+
 int aes256_gcm_memcrypt(bool encrypt, void *aes_key, void *aes_iv, void *tag, void *buffer, size_t inlen)
 {
-  GCM<AES256> cipher;
-  cipher.setKey((const uint8_t *)aes_key, cipher.keySize());
-  cipher.setIV((const uint8_t *)aes_iv, cipher.ivSize());
+  return aes256_gcm_memcrypt_auth(encrypt, aes_key, aes_iv, tag, NULL, 0, buffer, inlen);
+}
+
+/* As aes256_gcm_memcrypt, with authlen bytes at auth authenticated but not
+   encrypted */
+int aes256_gcm_memcrypt_auth(bool encrypt, void *aes_key, void *aes_iv, void *tag, const void *auth, size_t authlen, void *buffer, size_t inlen)
+{
+  aes256_gcm_context gc;
+  int ok = 1;
+  aes256_gcm_init(&gc, aes_key);
+  aes256_gcm_setiv(&gc, aes_iv);
+  if (authlen > 0) aes256_gcm_auth(&gc, auth, authlen);
   if (encrypt)
   {
-      cipher.encrypt((uint8_t *)buffer,(uint8_t *)buffer, inlen);
-      cipher.computeTag((uint8_t *)tag, AES_GCM_TAG_LENGTH);
-      return 1;
+    aes256_gcm_encrypt(&gc, buffer, buffer, inlen);
+    aes256_gcm_compute_tag(&gc, tag);
+  } else
+  {
+    aes256_gcm_decrypt(&gc, buffer, buffer, inlen);
+    ok = aes256_gcm_check_tag(&gc, tag);
+  }
+  aes256_gcm_clear(&gc);
+  return ok;
+}
+
+void aes256_gcm_init(aes256_gcm_context *gc, const void *aes_key)
+{
+  gc->cipher.setKey((const uint8_t *)aes_key, AES_KEYLEN);
+  memset(gc->hash_key, '\000', sizeof(gc->hash_key));
+  gc->cipher.encryptBlock(gc->hash_key, gc->hash_key);
+}
+
+void aes256_gcm_setiv(aes256_gcm_context *gc, const void *aes_iv)
+{
+  memcpy(gc->counter, aes_iv, AES_GCM_IV_LENGTH);
+  memset(&gc->counter[AES_GCM_IV_LENGTH], '\000', AES_BLOCKLEN - AES_GCM_IV_LENGTH);
+  gc->counter[AES_BLOCKLEN-1] = 1;
+  gc->cipher.encryptBlock(gc->mask, gc->counter);
+  gc->ghash.reset(gc->hash_key);
+  gc->posn = AES_BLOCKLEN;
+  gc->data_started = 0;
+  gc->auth_len = gc->data_len = 0;
+}
+
+void aes256_gcm_auth(aes256_gcm_context *gc, const void *data, size_t len)
+{
+  gc->ghash.update(data, len);
+  gc->auth_len += len;
+}
+
+static void aes256_gcm_start_data(aes256_gcm_context *gc, size_t len)
+{
+  if (!gc->data_started)
+  {
+    gc->ghash.pad();
+    gc->data_started = 1;
+  }
+  gc->data_len += len;
+}
+
+static void aes256_gcm_ctr(aes256_gcm_context *gc, uint8_t *out, const uint8_t *in, size_t len)
+{
+  while (len > 0)
+  {
+    if (gc->posn == AES_BLOCKLEN)
+    {
+      for (int i=AES_BLOCKLEN-1;(i>=AES_GCM_IV_LENGTH) && ((++gc->counter[i]) == 0);i--);
+      gc->cipher.encryptBlock(gc->keystream, gc->counter);
+      gc->posn = 0;
+    }
+    size_t n = AES_BLOCKLEN - gc->posn;
+    if (n > len) n = len;
+    for (size_t i=0;i<n;i++) out[i] = in[i] ^ gc->keystream[gc->posn+i];
+    gc->posn += n;
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+
+void aes256_gcm_encrypt(aes256_gcm_context *gc, void *out, const void *in, size_t len)
+{
+  aes256_gcm_start_data(gc, len);
+  aes256_gcm_ctr(gc, (uint8_t *)out, (const uint8_t *)in, len);
+  gc->ghash.update(out, len);
+}
+
+void aes256_gcm_decrypt(aes256_gcm_context *gc, void *out, const void *in, size_t len)
+{
+  aes256_gcm_start_data(gc, len);
+  gc->ghash.update(in, len);
+  aes256_gcm_ctr(gc, (uint8_t *)out, (const uint8_t *)in, len);
+}
+
+/* Takes ciphertext into the tag without decrypting it */
+void aes256_gcm_hash(aes256_gcm_context *gc, const void *data, size_t len)
+{
+  aes256_gcm_start_data(gc, len);
+  gc->ghash.update(data, len);
+}
+
+void aes256_gcm_compute_tag(aes256_gcm_context *gc, void *tag)
+{
+  uint8_t sizes[AES_BLOCKLEN];
+  for (int i=0;i<8;i++)
+  {
+    sizes[i] = (uint8_t)((gc->auth_len*8) >> (56-i*8));
+    sizes[i+8] = (uint8_t)((gc->data_len*8) >> (56-i*8));
   }
-  cipher.decrypt((uint8_t *)buffer,(uint8_t *)buffer, inlen);
-  return cipher.checkTag(tag, AES_GCM_TAG_LENGTH);
+  gc->ghash.pad();
+  gc->ghash.update(sizes, sizeof(sizes));
+  gc->ghash.finalize(tag, AES_GCM_TAG_LENGTH);
+  for (int i=0;i<AES_GCM_TAG_LENGTH;i++) ((uint8_t *)tag)[i] ^= gc->mask[i];
+}
+
+int aes256_gcm_check_tag(aes256_gcm_context *gc, const void *tag)
+{
+  uint8_t computed[AES_GCM_TAG_LENGTH];
+  aes256_gcm_compute_tag(gc, computed);
+  int ok = secure_compare(computed, tag, AES_GCM_TAG_LENGTH);
+  clean(computed);
+  return ok;
+}
+
+void aes256_gcm_seal(aes256_gcm_context *gc, const void *aes_iv, void *tag, void *buffer, size_t inlen)
+{
+  aes256_gcm_setiv(gc, aes_iv);
+  aes256_gcm_encrypt(gc, buffer, buffer, inlen);
+  aes256_gcm_compute_tag(gc, tag);
+}
+
+int aes256_gcm_open(aes256_gcm_context *gc, const void *aes_iv, const void *tag, void *buffer, size_t inlen)
+{
+  aes256_gcm_setiv(gc, aes_iv);
+  aes256_gcm_decrypt(gc, buffer, buffer, inlen);
+  return aes256_gcm_check_tag(gc, tag);
+}
+
+void aes256_gcm_clear(aes256_gcm_context *gc)
+{
+  gc->cipher.clear();
+  gc->ghash.clear();
+  clean(gc->hash_key);
+  clean(gc->counter);
+  clean(gc->mask);
+  clean(gc->keystream);
 }
 
 void * __builtin_return_address (unsigned int level);
@@ -171,26 +514,6 @@ int heap_stack_distance()
   return ((uint32_t)v)-((uint32_t)v2);
 }
 
-#define poly 0x1021
-
-uint32_t calc_crc16(uint8_t *addr, uint32_t num)
-{
-  int i;
-  uint32_t crc = 0;
-  for (; num>0; num--)              
-    {
-    crc = crc ^ (((uint32_t)*addr++) << 8);      
-    for (i=0; i<8; i++)              
-      {
-      crc = crc << 1;                
-      if (crc & 0x10000)             
-        crc = (crc ^ poly) & 0xFFFF; 
-                                    
-      }                              
-    }                                
-    return(crc);                     
-}
-
 #ifdef __cplusplus
 }
 #endif
@@ -10,7 +10,12 @@
 extern "C" {
 #endif
 
+/* KEY_DERIVATION_HASHES is the cost of stores and files that do not record
+   their own.  A recorded cost outside of the MIN to MAX range is refused. */
 #define KEY_DERIVATION_HASHES 1000
+#define KEY_DERIVATION_MIN_HASHES 100
+#define KEY_DERIVATION_MAX_HASHES 1000000
+#define KEY_DERIVATION_TARGET_MS 1000
 #define KEY_MAX_PASSPHRASE_LENGTH 256
 #define KEYMANAGER_HASHLEN 32
 #define KEYMANAGER_KEYBYTES 32
@@ -19,6 +24,7 @@ extern "C" {
 #define AES_KEYLEN 32
 #define AES_BLOCKLEN 16
 #define AES_GCM_TAG_LENGTH 16
+#define AES_GCM_IV_LENGTH 12
 #define KEYMANAGER_SYMMETRICKEY_LEN AES_KEYLEN
 #define KEYMANAGER_MAX_SECRET_LEN KEYMANAGER_PUBLICKEY_LEN
 
@@ -30,15 +36,67 @@ typedef int (*base64_writedata)(int c, void *v);
 int base64_encode(base64_readdata rd, void *vrd, base64_writedata wd, void *vwd);
 int base64_decode(base64_readdata rd, void *vrd, base64_writedata wd, void *vwd);
 int is_base64_char(char ch);
+
+/* Buffer oriented BASE 64 encoding.  The state carries partial groups
+   between calls so that a stream can be converted in spans of any size. */
+
+typedef struct _base64_state
+{
+  uint32_t bits;
+  uint8_t  count;
+} base64_state;
+
+#define BASE64_ENCODED_LEN(n) ((((n)+2)/3)*4)
+#define BASE64_DECODED_LEN(n) ((((n)+3)/4)*3)
+
+void base64_state_init(base64_state *bs);
+size_t base64_encode_span(base64_state *bs, const uint8_t *in, size_t inlen, char *out);
+size_t base64_encode_final(base64_state *bs, char *out);
+size_t base64_decode_span(base64_state *bs, const char *in, size_t inlen, uint8_t *out);
+size_t base64_decode_final(base64_state *bs, uint8_t *out);
+int base64_decode_groups(const char *in, size_t inlen, uint8_t *out);
 		
 /* Crypto tools assist */
 
+/* AES-256 GCM with the key schedule and hash key kept for a key, so that
+   each message under the key only sets up its counter.  The IV is
+   AES_GCM_IV_LENGTH bytes.  Ciphertext can also be hashed without being
+   decrypted, to check a tag alone.  Clear the context when done with the
+   key. */
+typedef struct _aes256_gcm_context
+{
+  AES256   cipher;
+  GHASH    ghash;
+  uint8_t  hash_key[AES_BLOCKLEN];
+  uint8_t  counter[AES_BLOCKLEN];
+  uint8_t  mask[AES_BLOCKLEN];
+  uint8_t  keystream[AES_BLOCKLEN];
+  uint8_t  posn;
+  uint8_t  data_started;
+  uint64_t auth_len;
+  uint64_t data_len;
+} aes256_gcm_context;
+
 int ctblake2s( void *out, size_t outlen, const void *in, size_t inlen, const void *key, size_t keylen );
 int ctblake2srehash( void *hash, size_t inlen, int numhash);
 int aes256_memcrypt(bool encrypt, void *aes_key, void *aes_iv, void *buffer, size_t inlen);
 int aes256_gcm_memcrypt(bool encrypt, void *aes_key, void *aes_iv, void *tag, void *buffer, size_t inlen);
+int aes256_gcm_memcrypt_auth(bool encrypt, void *aes_key, void *aes_iv, void *tag, const void *auth, size_t authlen, void *buffer, size_t inlen);
+void aes256_gcm_init(aes256_gcm_context *gc, const void *aes_key);
+void aes256_gcm_setiv(aes256_gcm_context *gc, const void *aes_iv);
+void aes256_gcm_auth(aes256_gcm_context *gc, const void *data, size_t len);
+void aes256_gcm_encrypt(aes256_gcm_context *gc, void *out, const void *in, size_t len);
+void aes256_gcm_decrypt(aes256_gcm_context *gc, void *out, const void *in, size_t len);
+void aes256_gcm_hash(aes256_gcm_context *gc, const void *data, size_t len);
+void aes256_gcm_compute_tag(aes256_gcm_context *gc, void *tag);
+int aes256_gcm_check_tag(aes256_gcm_context *gc, const void *tag);
+void aes256_gcm_seal(aes256_gcm_context *gc, const void *aes_iv, void *tag, void *buffer, size_t inlen);
+int aes256_gcm_open(aes256_gcm_context *gc, const void *aes_iv, const void *tag, void *buffer, size_t inlen);
+void aes256_gcm_clear(aes256_gcm_context *gc);
 int key_derivation_function(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len);
-uint32_t calc_crc16(uint8_t *addr, uint32_t num);
+int key_derivation_function_iterations(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len, uint32_t iterations);
+int key_derivation_function_v2(void *hash, void *passphrase, size_t passphrase_len, void *salt, size_t salt_len, uint32_t iterations);
+uint32_t key_derivation_calibrate(uint32_t target_ms);
 int heap_stack_distance();
 
 #ifdef __cplusplus
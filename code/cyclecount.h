@@ -0,0 +1,38 @@
+#ifndef _CYCLECOUNT_H
+#define _CYCLECOUNT_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+/* The Cortex-M3 debug cycle counter.  CPU_CYCLES counts once it is enabled
+   by setting DEMCR_TRCENA in DEMCR and CYCCNTENA in DWT_CTRL. */
+
+#ifdef __arm__
+
+#define DEMCR           (*((volatile uint32_t *)0xE000EDFC))
+#define DWT_CTRL        (*(volatile uint32_t *)0xe0001000)
+#define CYCCNTENA       (1<<0)
+#define DWT_CYCCNT      ((volatile uint32_t *)0xE0001004)
+#define CPU_CYCLES      *DWT_CYCCNT
+#define DEMCR_TRCENA    0x01000000
+
+#endif
+
+#endif  /* _CYCLECOUNT_H */
@@ -23,12 +23,17 @@ freely, subject to the following restrictions:
 #include <ff.h>
 #include <AES.h>
 #include <GCM.h>
+#include <GHASH.h>
+#include <Crypto.h>
+#include <BLAKE2s.h>
 #include "consoleio.h"
 #include "fileop.h"
 #include "fileenc.h"
 #include "keymanager.h"
 #include "cryptotool.h"
 #include "random.h"
+#include "compress.h"
+#include "benchmark.h"
 
 #define USE_MINIPRINTF
 
@@ -56,65 +61,533 @@ int fileenc_check_key_selected(void)
   return 0;
 }
 
+int filedec_check_key_selected(void)
+{
+  if (current_key_private.entry_type == KEY_TYPE_ECDH_PRIVATE) return 1;
+  return fileenc_check_key_selected();
+}
+
 int fileenc_hash_derived_key(void *hash, void *secret, size_t secretlen, void *salt, size_t saltlen)
 {
   key_derivation_function((void *)hash, (void *)secret, secretlen, (void *)salt, saltlen);
 }
 
-#define FILEENC_READBUF_SIZE (AES_BLOCKLEN*64)
+void fileenc_chunk_nonce(uint8_t *nonce, const uint8_t *iv, uint32_t chunkno)
+{
+  memcpy(nonce, iv, AES_BLOCKLEN);
+  nonce[8]  ^= (uint8_t)(chunkno >> 24);
+  nonce[9]  ^= (uint8_t)(chunkno >> 16);
+  nonce[10] ^= (uint8_t)(chunkno >> 8);
+  nonce[11] ^= (uint8_t)chunkno;
+}
+
+/* The secret and the keys derived from it for one operation.  Deriving a
+   key is the expensive step, so the last salt and key for the header, the
+   payload and a recipient's wrapped key are kept, and a batch of files
+   reuses them.  When a file has a data key, the header and payload keys
+   are derived from it rather than from the secret.  Under the expand
+   schedule only the header key is stretched for, into the master slot, and
+   the header and payload keys are expanded from the master key. */
+
+#define FILEENC_KEY_HEADER  0
+#define FILEENC_KEY_PAYLOAD 1
+#define FILEENC_KEY_WRAP    2
+#define FILEENC_KEY_MASTER  3
+#define FILEENC_KEY_SLOTS   4
+
+typedef struct _fileenc_keys
+{
+  uint8_t secret[KEYMANAGER_MAX_SECRET_LEN];
+  int     secretlen;
+  uint8_t public_key[KEYMANAGER_PUBLICKEY_LEN];
+  uint8_t public_key_set;
+  uint8_t data_key[KEYMANAGER_MAX_SECRET_LEN];
+  uint8_t data_key_set;
+  uint8_t binding[KEYMANAGER_HASHLEN];
+  uint8_t binding_set;
+  uint32_t iterations;
+  uint32_t accepted_iterations;
+  uint32_t schedule;
+  uint32_t slot_iterations[FILEENC_KEY_SLOTS];
+  uint32_t slot_schedule[FILEENC_KEY_SLOTS];
+  uint8_t salt[FILEENC_KEY_SLOTS][KEYMANAGER_HASHLEN];
+  uint8_t key[FILEENC_KEY_SLOTS][AES_KEYLEN];
+  uint8_t valid[FILEENC_KEY_SLOTS];
+} fileenc_keys;
+
+/* A file may ask for a key derivation cost up to FILEENC_MAX_COST_FACTOR
+   times that of this device's store, or of files that do not record one if
+   that is larger.  A cost above that of the store is only run once the
+   user has agreed to it for this operation. */
+#define FILEENC_MAX_COST_FACTOR 8
+
+uint32_t fileenc_local_iterations(void)
+{
+  uint32_t iterations = keymanager_kdf_iterations();
+  return (iterations < KEY_DERIVATION_HASHES) ? KEY_DERIVATION_HASHES : iterations;
+}
+
+int fileenc_keys_init(fileenc_keys *fk)
+{
+  memset((void *)fk,'\000',sizeof(*fk));
+  fk->iterations = keymanager_kdf_iterations();
+  fk->accepted_iterations = fileenc_local_iterations();
+  fk->schedule = FILEENC_SCHEDULE_EXPAND;
+  if (keymanager_compute_secret(fk->secret, &fk->secretlen)) return 1;
+  file_report_error("Bad secret key");
+  return 0;
+}
+
+/* A file being decrypted with a private key may name the public key of the
+   other side in its header, so a public key need not be selected yet */
+int filedec_keys_init(fileenc_keys *fk)
+{
+  if ((current_key_private.entry_type == KEY_TYPE_ECDH_PRIVATE) && (current_key_public.entry_type != KEY_TYPE_ECDH_PUBLIC))
+  {
+    memset((void *)fk,'\000',sizeof(*fk));
+    fk->iterations = keymanager_kdf_iterations();
+    fk->accepted_iterations = fileenc_local_iterations();
+    fk->schedule = FILEENC_SCHEDULE_EXPAND;
+    return 1;
+  }
+  return fileenc_keys_init(fk);
+}
+
+/* Computes the secret again after the public key of the other side
+   changes.  A public key found for this file is used in place of the
+   selected one. */
+int fileenc_keys_set_secret(fileenc_keys *fk)
+{
+  memset(fk->valid, '\000', sizeof(fk->valid));
+  if (fk->public_key_set ? keymanager_compute_shared_secret(fk->public_key, fk->secret, &fk->secretlen) :
+                           keymanager_compute_secret(fk->secret, &fk->secretlen)) return 1;
+  fk->secretlen = 0;
+  file_report_error("Bad secret key");
+  return 0;
+}
+
+void fileenc_keys_clear(fileenc_keys *fk)
+{
+  memset((void *)fk,'\000',sizeof(*fk));
+}
+
+/* Expands the key for one use from the master key with a keyed hash of the
+   use and its salt */
+void fileenc_keys_expand(const uint8_t *master, int which, const uint8_t *salt, uint8_t *key)
+{
+  uint8_t info[1+KEYMANAGER_HASHLEN];
+  info[0] = which + 1;
+  memcpy(&info[1], salt, KEYMANAGER_HASHLEN);
+  ctblake2s(key, AES_KEYLEN, info, sizeof(info), master, KEYMANAGER_HASHLEN);
+  memset(info, '\000', sizeof(info));
+}
+
+const uint8_t *fileenc_keys_derive(fileenc_keys *fk, int which, const uint8_t *salt)
+{
+  if ((!fk->valid[which]) || (fk->slot_iterations[which] != fk->iterations) || (fk->slot_schedule[which] != fk->schedule) ||
+      (memcmp(fk->salt[which], salt, KEYMANAGER_HASHLEN)))
+  {
+    const uint8_t *secret = fk->secret;
+    int secretlen = fk->secretlen;
+    if ((fk->data_key_set) && (which != FILEENC_KEY_WRAP))
+    {
+      secret = fk->data_key;
+      secretlen = sizeof(fk->data_key);
+    }
+    memcpy(fk->salt[which], salt, KEYMANAGER_HASHLEN);
+    if ((fk->schedule == FILEENC_SCHEDULE_EXPAND) && (which != FILEENC_KEY_WRAP))
+    {
+      if (which == FILEENC_KEY_HEADER)
+      {
+        key_derivation_function_v2((void *)fk->key[FILEENC_KEY_MASTER], (void *)secret, secretlen, fk->salt[which], KEYMANAGER_HASHLEN, fk->iterations);
+        fk->valid[FILEENC_KEY_PAYLOAD] = 0;
+      }
+      fileenc_keys_expand(fk->key[FILEENC_KEY_MASTER], which, fk->salt[which], fk->key[which]);
+    } else
+      key_derivation_function_iterations((void *)fk->key[which], (void *)secret, secretlen, fk->salt[which], KEYMANAGER_HASHLEN, fk->iterations);
+    fk->slot_iterations[which] = fk->iterations;
+    fk->slot_schedule[which] = fk->schedule;
+    fk->valid[which] = 1;
+  }
+  return fk->key[which];
+}
+
+/* Takes the key derivation cost recorded in a file, where zero is the cost
+   of files written before it was recorded */
+int fileenc_keys_set_iterations(fileenc_keys *fk, uint32_t iterations)
+{
+  uint32_t local = fileenc_local_iterations();
+  if (iterations == 0) iterations = KEY_DERIVATION_HASHES;
+  if ((iterations < KEY_DERIVATION_MIN_HASHES) || (iterations > KEY_DERIVATION_MAX_HASHES) ||
+      (iterations > (local * FILEENC_MAX_COST_FACTOR)))
+  {
+    file_report_error("Unsupported key derivation cost");
+    return 0;
+  }
+  if (iterations > fk->accepted_iterations)
+  {
+    console_puts("\r\nKey derivation cost of file: ");
+    console_printuint(iterations);
+    console_puts("\r\nKey derivation cost of device: ");
+    console_printuint(local);
+    console_puts("\r\nDeriving the key will take longer\r\nthan unlocking the key store.");
+    if (console_yes(18))
+    {
+      file_report_error("Key derivation cost not accepted");
+      return 0;
+    }
+    fk->accepted_iterations = iterations;
+  }
+  fk->iterations = iterations;
+  return 1;
+}
 
-#define FILEENC_WRITEBUF_SIZE 36
+int fileenc_keys_set_schedule(fileenc_keys *fk, uint32_t schedule)
+{
+  if ((schedule != FILEENC_SCHEDULE_SEPARATE) && (schedule != FILEENC_SCHEDULE_EXPAND))
+  {
+    file_report_error("Unsupported key schedule");
+    return 0;
+  }
+  fk->schedule = schedule;
+  return 1;
+}
+
+void fileenc_keys_set_data_key(fileenc_keys *fk, const uint8_t *data_key)
+{
+  if ((data_key == NULL) && (!fk->data_key_set)) return;
+  if (data_key != NULL)
+    memcpy(fk->data_key, data_key, sizeof(fk->data_key));
+  else
+    memset(fk->data_key, '\000', sizeof(fk->data_key));
+  fk->data_key_set = (data_key != NULL);
+  memset(fk->binding, '\000', sizeof(fk->binding));
+  fk->binding_set = 0;
+  fk->valid[FILEENC_KEY_HEADER] = fk->valid[FILEENC_KEY_PAYLOAD] = 0;
+}
+
+/* The length of a recipients block as written */
+uint16_t fileenc_recipients_len(const fileenc_recipients *fr)
+{
+  return sizeof(*fr) - sizeof(fileenc_recipient)*(FILEENC_MAX_RECIPIENTS - fr->count);
+}
+
+/* Hashes the id, count and cost of a recipients block and the id and salt
+   of each recipient, which each wrap authenticates, or the whole block,
+   which the file header authenticates */
+void fileenc_recipients_hash(const fileenc_recipients *fr, int whole, uint8_t *hash)
+{
+  BLAKE2s blake2s;
+  if (whole)
+  {
+    ctblake2s(hash, KEYMANAGER_HASHLEN, fr, fileenc_recipients_len(fr), NULL, 0);
+    return;
+  }
+  blake2s.reset(KEYMANAGER_HASHLEN);
+  blake2s.update(fr, offsetof(fileenc_recipients, recipient));
+  for (int i=0;i<fr->count;i++)
+  {
+    blake2s.update(fr->recipient[i].id, sizeof(fr->recipient[i].id));
+    blake2s.update(fr->recipient[i].salt, sizeof(fr->recipient[i].salt));
+  }
+  blake2s.finalize(hash, KEYMANAGER_HASHLEN);
+}
+
+void fileenc_recipient_id(uint8_t *id, const uint8_t *public_key)
+{
+  keymanager_fingerprint(id, public_key);
+}
+
+/* Salts are only drawn for the first file encrypted with a key setup */
+const uint8_t *fileenc_keys_new(fileenc_keys *fk, int which, uint8_t *salt)
+{
+  if (fk->valid[which])
+    memcpy(salt, fk->salt[which], KEYMANAGER_HASHLEN);
+  else
+    randomness_get_whitened_bits(salt, KEYMANAGER_HASHLEN);
+  return fileenc_keys_derive(fk, which, salt);
+}
+
+/* The encrypt path is a pipeline of three stages.  Plaintext is read and
+   encrypted (after compression, if selected) into the staging buffer along
+   with the chunk headers and tags,
+   the staging buffer is armored in whole lines (or copied, for a binary
+   payload) into the write buffer, and the write buffer is flushed in whole
+   sectors aligned to the sectors of the ciphertext file. */
+
+#define FILEENC_LINE_BYTES 27
+#define FILEENC_LINE_CHARS (BASE64_ENCODED_LEN(FILEENC_LINE_BYTES)+1)
+
+#define FILEENC_READBUF_SIZE (FILEENC_LINE_BYTES*14)
+
+#define FILEENC_WRITEBUF_SIZE (FF_MAX_SS+FILEENC_LINE_CHARS)
+
+/* Compressed plaintext waiting to be encrypted.  More than a chunk is kept
+   ahead of the chunk being encrypted so that the final chunk is known. */
+typedef struct _fileenc_compress
+{
+  lzss_encoder lz;
+  uint8_t  out[FILEENC_CHUNK_SIZE+LZSS_GROUP_LEN];
+  uint16_t out_pos;
+  uint16_t out_filled;
+  uint8_t  eof;
+} fileenc_compress;
 
 typedef struct _fileenc_readbuf
 {
-  GCM<AES256> *read_cipher;
+  aes256_gcm_context *read_cipher;
+  fileenc_compress *compress;
   FIL read_file;
+  file_readahead read_ahead;
   uint8_t  read_buf[FILEENC_READBUF_SIZE];
   uint16_t read_filled;
-  uint16_t read_curpos;
   FSIZE_t read_progress;
+  uint8_t  binary;
+  int      payload_format;
+  fileenc_recipients *recipients;
+  benchmark_stages stages;
   FIL write_file;
-  uint8_t  write_buf[FILEENC_WRITEBUF_SIZE];
+  char     write_buf[FILEENC_WRITEBUF_SIZE];
   uint16_t write_curpos;  
   fileenc_total_header fth;
 } fileenc_state;
 
-int fileenc_base64_readdata(void *v)
+void fileenc_read_progress(fileenc_state *fr)
 {
-  fileenc_state *fr = (fileenc_state *)v;
-  if (fr->read_curpos >= fr->read_filled)
+  FSIZE_t pos = file_readahead_tell(&fr->read_ahead);
+  if ((pos-fr->read_progress) >= FILEENC_DISPLAY_INCREMENT)
+  {
+    console_puts("Reading ");
+    console_printuint(pos);
+    console_putch('/');
+    console_printuint(f_size(&fr->read_file));
+    console_printcrlf();
+    fr->read_progress = pos;
+  }
+}
+
+/* Compresses plaintext until more than a chunk of output is ready or all of
+   the plaintext has been compressed */
+int fileenc_compress_fill(fileenc_state *fs)
+{
+  fileenc_compress *fc = fs->compress;
+  fc->out_filled -= fc->out_pos;
+  memmove(fc->out, &fc->out[fc->out_pos], fc->out_filled);
+  fc->out_pos = 0;
+  while (fc->out_filled <= FILEENC_CHUNK_SIZE)
   {
     UINT br;
-    FRESULT res = f_read(&fr->read_file,fr->read_buf,FILEENC_READBUF_SIZE,&br);
-    if ((res != FR_OK) || (br == 0)) return -1;
-    fr->read_cipher->encrypt(fr->read_buf, fr->read_buf, br);
-    fr->read_filled = br;
-    fr->read_curpos = 0;
-    if ((f_tell(&fr->read_file)-fr->read_progress) >= FILEENC_DISPLAY_INCREMENT)
-    {
-      console_puts("Reading ");
-      console_printuint(f_tell(&fr->read_file));
-      console_putch('/');
-      console_printuint(f_size(&fr->read_file));
-      console_printcrlf();
-      fr->read_progress = f_tell(&fr->read_file);
-    }
+    size_t space;
+    uint32_t start = benchmark_ticks();
+    size_t n = lzss_encode_output(&fc->lz, &fc->out[fc->out_filled], sizeof(fc->out)-fc->out_filled, fc->eof);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_COMPRESS, start, n);
+    fc->out_filled += n;
+    if (n > 0) continue;
+    if (fc->eof) break;
+    uint8_t *p = lzss_encode_space(&fc->lz, &space);
+    start = benchmark_ticks();
+    FRESULT res = file_readahead_read(&fs->read_ahead, p, space, &br);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_READ, start, br);
+    if ((res != FR_OK) || (space == 0)) return 0;
+    lzss_encode_added(&fc->lz, br);
+    fc->eof = file_readahead_tell(&fs->read_ahead) >= f_size(&fs->read_file);
+    fileenc_read_progress(fs);
   }
-  return fr->read_buf[fr->read_curpos++];
+  return 1;
 }
 
-int fileenc_base64_writedata(int c, void *v)
+UINT fileenc_read_block(fileenc_state *fr, UINT len)
 {
-  fileenc_state *fw = (fileenc_state *)v;
+  UINT br;
+  if (len > (UINT)(FILEENC_READBUF_SIZE-fr->read_filled))
+    len = FILEENC_READBUF_SIZE-fr->read_filled;
+  if (fr->compress != NULL)
+  {
+    fileenc_compress *fc = fr->compress;
+    br = fc->out_filled - fc->out_pos;
+    if (br > len) br = len;
+    memcpy(&fr->read_buf[fr->read_filled], &fc->out[fc->out_pos], br);
+    fc->out_pos += br;
+  } else
+  {
+    uint32_t start = benchmark_ticks();
+    FRESULT res = file_readahead_read(&fr->read_ahead,&fr->read_buf[fr->read_filled],len,&br);
+    benchmark_stage_add(&fr->stages, BENCHMARK_STAGE_READ, start, br);
+    if (res != FR_OK) return 0;
+    fileenc_read_progress(fr);
+  }
+  if (br == 0) return 0;
+  uint32_t start = benchmark_ticks();
+  aes256_gcm_encrypt(fr->read_cipher, &fr->read_buf[fr->read_filled], &fr->read_buf[fr->read_filled], br);
+  benchmark_stage_add(&fr->stages, BENCHMARK_STAGE_CIPHER, start, br);
+  fr->read_filled += br;
+  return br;
+}
 
-  if (c >= 0)
-    fw->write_buf[fw->write_curpos++] = c; 
-  if ((fw->write_curpos == FILEENC_WRITEBUF_SIZE) || (c < 0))
+void fileenc_write_sectors(fileenc_state *fw, int final)
+{
+  for (;;)
   {
     UINT br;
-    f_write(&fw->write_file,fw->write_buf,fw->write_curpos,&br);
-    f_write(&fw->write_file,"\n",1,&br);
-    fw->write_curpos = 0;
+    UINT n = FF_MAX_SS - (f_tell(&fw->write_file) % FF_MAX_SS);
+    if (fw->write_curpos < n)
+    {
+      if ((!final) || (fw->write_curpos == 0)) return;
+      n = fw->write_curpos;
+    }
+    uint32_t start = benchmark_ticks();
+    f_write(&fw->write_file,fw->write_buf,n,&br);
+    benchmark_stage_add(&fw->stages, BENCHMARK_STAGE_WRITE, start, n);
+    fw->write_curpos -= n;
+    memmove(fw->write_buf, &fw->write_buf[n], fw->write_curpos);
+  }
+}
+
+void fileenc_armor_lines(fileenc_state *fs, int final)
+{
+  base64_state bs;
+  uint16_t pos = 0;
+
+  base64_state_init(&bs);
+  for (;;)
+  {
+    uint16_t n = fs->read_filled - pos;
+    if (n >= FILEENC_LINE_BYTES) 
+      n = FILEENC_LINE_BYTES;
+    else if (!final) break;
+    char *line = &fs->write_buf[fs->write_curpos];
+    uint32_t start = benchmark_ticks();
+    size_t l = base64_encode_span(&bs, &fs->read_buf[pos], n, line);
+    l += base64_encode_final(&bs, &line[l]);
+    line[l++] = '\n';
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_ARMOR, start, n);
+    fs->write_curpos += l;
+    pos += n;
+    fileenc_write_sectors(fs, 0);
+    if (l < FILEENC_LINE_CHARS) break;
+  }
+  fs->read_filled -= pos;
+  memmove(fs->read_buf, &fs->read_buf[pos], fs->read_filled);
+}
+
+void fileenc_copy_block(fileenc_state *fs)
+{
+  uint16_t pos = 0;
+  while (pos < fs->read_filled)
+  {
+    uint16_t n = fs->read_filled - pos;
+    if (n > (FILEENC_WRITEBUF_SIZE - fs->write_curpos))
+      n = FILEENC_WRITEBUF_SIZE - fs->write_curpos;
+    memcpy(&fs->write_buf[fs->write_curpos], &fs->read_buf[pos], n);
+    fs->write_curpos += n;
+    pos += n;
+    fileenc_write_sectors(fs, 0);
+  }
+  fs->read_filled = 0;
+}
+
+void fileenc_drain(fileenc_state *fs, int final)
+{
+  if (fs->binary)
+    fileenc_copy_block(fs);
+  else
+    fileenc_armor_lines(fs, final);
+  if (final) fileenc_write_sectors(fs, 1);
+}
+
+void fileenc_stage(fileenc_state *fs, const void *data, uint16_t len)
+{
+  const uint8_t *d = (const uint8_t *)data;
+  while (len > 0)
+  {
+    uint16_t n = FILEENC_READBUF_SIZE - fs->read_filled;
+    if (n == 0)
+    {
+      fileenc_drain(fs, 0);
+      continue;
+    }
+    if (n > len) n = len;
+    memcpy(&fs->read_buf[fs->read_filled], d, n);
+    fs->read_filled += n;
+    d += n;
+    len -= n;
+  }
+}
+
+int fileenc_chunk_payload(fileenc_state *fs, const uint8_t *iv)
+{
+  uint32_t chunkno = 0;
+  uint16_t hdr;
+
+  fs->read_filled = 0;
+  fs->write_curpos = 0;
+  do
+  {
+    uint8_t nonce[AES_BLOCKLEN];
+    uint8_t chunk_header[FILEENC_CHUNK_HEADER_LEN];
+    uint8_t tag[AES_GCM_TAG_LENGTH];
+    FSIZE_t remaining;
+    if (fs->compress != NULL)
+    {
+      if (!fileenc_compress_fill(fs)) return 0;
+      remaining = fs->compress->out_filled;
+    } else
+      remaining = f_size(&fs->read_file) - file_readahead_tell(&fs->read_ahead);
+    uint16_t len = (remaining > FILEENC_CHUNK_SIZE) ? FILEENC_CHUNK_SIZE : remaining;
+    hdr = len | ((remaining <= FILEENC_CHUNK_SIZE) ? FILEENC_CHUNK_FINAL : 0);
+    chunk_header[0] = hdr & 0xFF;
+    chunk_header[1] = hdr >> 8;
+    fileenc_chunk_nonce(nonce, iv, chunkno++);
+    aes256_gcm_setiv(fs->read_cipher, nonce);
+    aes256_gcm_auth(fs->read_cipher, chunk_header, sizeof(chunk_header));
+    fileenc_stage(fs, chunk_header, sizeof(chunk_header));
+    while (len > 0)
+    {
+      if (fs->read_filled == FILEENC_READBUF_SIZE) fileenc_drain(fs, 0);
+      UINT br = fileenc_read_block(fs, len);
+      if (br == 0) return 0;
+      len -= br;
+    }
+    uint32_t start = benchmark_ticks();
+    aes256_gcm_compute_tag(fs->read_cipher, tag);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_CIPHER, start, 0);
+    fileenc_stage(fs, tag, sizeof(tag));
+  } while (!(hdr & FILEENC_CHUNK_FINAL));
+  fileenc_drain(fs, 1);
+  return 1;
+}
+
+int fileenc_select_payload_format(void)
+{
+  console_clrscr();
+  console_gotoxy(1,5);
+  console_puts("Payload as (A)rmored text or (B)inary?");
+  for (;;)
+  {
+    int ch = toupper(console_getch());
+    if (ch == 'A')
+        return 0;
+    if (ch == 'B')
+        return FILEENC_VERS_BINARY;
+    if (ch == 'Q')
+        return -1;
+  }
+}
+
+int fileenc_select_compression(void)
+{
+  console_clrscr();
+  console_gotoxy(1,5);
+  console_puts("Compress before encrypting (Y/N)?");
+  for (;;)
+  {
+    int ch = toupper(console_getch());
+    if (ch == 'Y')
+        return FILEENC_VERS_LZSS;
+    if (ch == 'N')
+        return 0;
+    if (ch == 'Q')
+        return -1;
   }
 }
 
@@ -129,15 +602,150 @@ const char *fileenc_filename(const char *c)
   return d;
 }
 
-void fileenc_encrypt_state(fileenc_state *fs)
+int fileenc_encrypt_file(fileenc_state *fs, fileenc_keys *fk, const char *filename_plaintext, int payload_format)
+{
+  aes256_gcm_context read_cipher;
+  uint8_t iv2[AES_BLOCKLEN];
+  const uint8_t *aes_key1, *aes_key2;
+  int done;
+
+  fs->compress = NULL;
+  if (payload_format & FILEENC_VERS_LZSS)
+  {
+    fs->compress = (fileenc_compress *)keymanager_malloc(sizeof(fileenc_compress));
+    if (fs->compress == NULL)
+    {
+      file_report_error("Not enough memory to compress");
+      return 0;
+    }
+    lzss_encode_init(&fs->compress->lz);
+    fs->compress->out_pos = fs->compress->out_filled = 0;
+    fs->compress->eof = 0;
+  }
+
+  memset((void *)&fs->fth,'\000',sizeof(fs->fth));
+  randomness_get_whitened_bits(fs->fth.iv1, sizeof(fs->fth.iv1));
+  randomness_get_whitened_bits(iv2, sizeof(iv2));
+  aes_key1 = fileenc_keys_new(fk, FILEENC_KEY_HEADER, fs->fth.salt1);
+  aes_key2 = fileenc_keys_new(fk, FILEENC_KEY_PAYLOAD, fs->fth.fhpu.fhp.salt2);
+  
+  fs->fth.kdf_iterations = fk->iterations;
+  fs->fth.key_schedule = fk->schedule;
+  if (current_key_private.entry_type == KEY_TYPE_ECDH_PRIVATE)
+  {
+    fileenc_recipient_id(fs->fth.sender_id, current_key_private.ksu.priv.public_key);
+    if (fs->recipients == NULL)
+      fileenc_recipient_id(fs->fth.recipient_id, current_key_public.ksu.pub.public_key);
+  }
+  fs->fth.fhpu.fhp.id   =         FILEENC_EXPORT_ID;
+  fs->fth.fhpu.fhp.entry_type =   current_key_private.entry_type;
+  fs->fth.fhpu.fhp.vers =         FILEENC_EXPORT_VERSION | FILEENC_VERS_CHUNKED | payload_format |
+                                  ((fs->recipients != NULL) ? FILEENC_VERS_RECIPIENTS : 0);
+  fs->fth.fhpu.fhp.len =          sizeof(fs->fth.fhpu.fhp);
+  fs->fth.fhpu.fhp.totallen =     sizeof(fs->fth.fhpu);
+  fs->fth.fhpu.fhp.file_length =  f_size(&fs->read_file);
+  memcpy((void *)fs->fth.fhpu.fhp.iv2, (void *)iv2, sizeof(fs->fth.fhpu.fhp.iv2));
+  strcpy_n(fs->fth.fhpu.fhp.filename, fileenc_filename(filename_plaintext), sizeof(fs->fth.fhpu.fhp.filename)-1);
+  aes256_gcm_memcrypt_auth(1, (void *)aes_key1, (void *)fs->fth.iv1, (void *)fs->fth.tag1, fk->binding, fk->binding_set ? sizeof(fk->binding) : 0,
+                           (void *)&fs->fth.fhpu, sizeof(fs->fth.fhpu));
+  if (fs->recipients != NULL)
+    file_write_block(&fs->write_file, "PARANOIABOX-RECIPIENTS", (void *)fs->recipients, fileenc_recipients_len(fs->recipients));
+  file_write_block(&fs->write_file, "PARANOIABOX-FILEHEADER", (void *)&fs->fth, sizeof(fs->fth));
+
+  file_write_header(&fs->write_file,"PARANOIABOX-PAYLOAD",0);
+  fs->read_cipher = &read_cipher;
+  fs->read_progress = 0;
+  aes256_gcm_init(fs->read_cipher, aes_key2);
+  fs->binary = (payload_format & FILEENC_VERS_BINARY) != 0;
+  file_readahead_init(&fs->read_ahead, &fs->read_file, 1);
+  done = fileenc_chunk_payload(fs, iv2);
+  file_readahead_close(&fs->read_ahead);
+  aes256_gcm_clear(fs->read_cipher);
+  if (fs->compress != NULL)
+  {
+    memset((void *)fs->compress, '\000', sizeof(fileenc_compress));
+    free(fs->compress);
+    fs->compress = NULL;
+  }
+  if (!done)
+  {
+    file_report_error("Could not read plaintext file");
+    return 0;
+  }
+  file_write_header(&fs->write_file,"PARANOIABOX-PAYLOAD",1);
+  return 1;
+}
+
+/* Draws a data key and wraps it for each recipient.  The ids and salts of
+   every recipient are drawn first so that each wrap can authenticate them,
+   and the hash of the finished block is kept for the file header. */
+int fileenc_wrap_data_key(fileenc_keys *fk, fileenc_recipients *fr, uint8_t public_keys[][KEYMANAGER_PUBLICKEY_LEN], int count)
+{
+  uint8_t data_key[KEYMANAGER_MAX_SECRET_LEN];
+  uint8_t binding[KEYMANAGER_HASHLEN];
+  int ok = 1;
+
+  memset((void *)fr, '\000', sizeof(*fr));
+  fr->id = FILEENC_RECIPIENTS_ID;
+  fr->count = count;
+  fr->kdf_iterations = fk->iterations;
+  randomness_get_whitened_bits(data_key, sizeof(data_key));
+  fileenc_keys_set_data_key(fk, data_key);
+  for (int i=0;i<count;i++)
+  {
+    fileenc_recipient_id(fr->recipient[i].id, public_keys[i]);
+    randomness_get_whitened_bits(fr->recipient[i].salt, sizeof(fr->recipient[i].salt));
+    randomness_get_whitened_bits(fr->recipient[i].iv, sizeof(fr->recipient[i].iv));
+  }
+  fileenc_recipients_hash(fr, 0, binding);
+  for (int i=0;(i<count) && (ok);i++)
+  {
+    fileenc_recipient *r = &fr->recipient[i];
+    uint8_t secret[KEYMANAGER_MAX_SECRET_LEN];
+    uint8_t wrap_key[AES_KEYLEN];
+    int secretlen;
+    if (keymanager_compute_shared_secret(public_keys[i], secret, &secretlen))
+    {
+      key_derivation_function_iterations((void *)wrap_key, secret, secretlen, r->salt, sizeof(r->salt), fk->iterations);
+      memcpy((void *)r->data_key, (void *)data_key, sizeof(r->data_key));
+      aes256_gcm_memcrypt_auth(1, (void *)wrap_key, (void *)r->iv, (void *)r->tag, binding, sizeof(binding), (void *)r->data_key, sizeof(r->data_key));
+    } else ok = 0;
+    memset(secret, '\000', sizeof(secret));
+    memset(wrap_key, '\000', sizeof(wrap_key));
+  }
+  memset(data_key, '\000', sizeof(data_key));
+  if (ok)
+  {
+    fileenc_recipients_hash(fr, 1, fk->binding);
+    fk->binding_set = 1;
+  } else file_report_error("Bad secret key");
+  return ok;
+}
+
+void fileenc_encrypt_state(fileenc_state *fs, int multiple)
 {
   char filename_plaintext[256];
-  if (!fileenc_check_key_selected()) return;
+  int payload_format, compression;
+  uint8_t public_keys[FILEENC_MAX_RECIPIENTS][KEYMANAGER_PUBLICKEY_LEN];
+  int count = 0;
+  fs->recipients = NULL;
+  if (multiple)
+  {
+    if (current_key_private.entry_type != KEY_TYPE_ECDH_PRIVATE)
+    {
+      file_report_error("No private key selected");
+      return;
+    }
+    if ((count = keymanager_select_recipients(public_keys, FILEENC_MAX_RECIPIENTS)) <= 0) return;
+  } else if (!fileenc_check_key_selected()) return;
   {
     char filename_ciphertext[256];
     if (!file_select_plaintext("Select plaintext file", 0, filename_plaintext, sizeof(filename_plaintext)-1)) return;
     if (!file_select_ciphertext("Select directory for ciphertext", 1, filename_ciphertext, sizeof(filename_ciphertext)-1)) return;
     if (!file_enter_filename("Filename for ciphertext output:", filename_ciphertext, sizeof(filename_ciphertext)-1)) return;
+    if ((payload_format = fileenc_select_payload_format()) < 0) return;
+    if ((compression = fileenc_select_compression()) < 0) return;
+    payload_format |= compression;
     FRESULT fres;
     fres = f_open(&fs->read_file, filename_plaintext, FA_READ);
     if (fres != FR_OK)
@@ -155,52 +763,28 @@ void fileenc_encrypt_state(fileenc_state *fs)
   }
   console_clrscr();
   console_puts("Encrypting file:\r\n");
+  benchmark_stages_init(&fs->stages);
   {
-    uint8_t secret[KEYMANAGER_MAX_SECRET_LEN];
-    uint8_t tag[AES_GCM_TAG_LENGTH];
-    int secretlen;
-    if (keymanager_compute_secret(secret, &secretlen))
-    {
-      GCM<AES256> read_cipher;
-      uint8_t salt2[KEYMANAGER_HASHLEN];
-      uint8_t iv2[AES_BLOCKLEN];
-      uint8_t aes_key1[AES_KEYLEN];
-      uint8_t aes_key2[AES_KEYLEN];
-
-      memset((void *)&fs->fth,'\000',sizeof(fs->fth));
-      randomness_get_whitened_bits(fs->fth.iv1, sizeof(fs->fth.iv1));
-      randomness_get_whitened_bits(fs->fth.salt1, sizeof(fs->fth.salt1));
-      randomness_get_whitened_bits(salt2, sizeof(salt2));
-      randomness_get_whitened_bits(iv2, sizeof(iv2));
-      key_derivation_function((void *)aes_key1, secret, secretlen, fs->fth.salt1, sizeof(fs->fth.salt1));
-      
-      fs->fth.fhpu.fhp.id   =         FILEENC_EXPORT_ID;
-      fs->fth.fhpu.fhp.entry_type =   current_key_private.entry_type;
-      fs->fth.fhpu.fhp.vers =         FILEENC_EXPORT_VERSION;
-      fs->fth.fhpu.fhp.len =          sizeof(fs->fth.fhpu.fhp);
-      fs->fth.fhpu.fhp.totallen =     sizeof(fs->fth.fhpu);
-      fs->fth.fhpu.fhp.file_length =  f_size(&fs->read_file);
-      memcpy((void *)fs->fth.fhpu.fhp.salt2, (void *)salt2, sizeof(fs->fth.fhpu.fhp.salt2));
-      memcpy((void *)fs->fth.fhpu.fhp.iv2, (void *)iv2, sizeof(fs->fth.fhpu.fhp.iv2));
-      strcpy_n(fs->fth.fhpu.fhp.filename, fileenc_filename(filename_plaintext), sizeof(fs->fth.fhpu.fhp.filename)-1);
-      aes256_gcm_memcrypt(1, (void *)aes_key1, (void *)fs->fth.iv1, (void *)fs->fth.tag1, (void *)&fs->fth.fhpu, sizeof(fs->fth.fhpu));
-      file_write_block(&fs->write_file, "PARANOIABOX-FILEHEADER", (void *)&fs->fth, sizeof(fs->fth));
-
-      file_write_header(&fs->write_file,"PARANOIABOX-PAYLOAD",0);
-      fs->read_cipher = &read_cipher;
-      fs->read_filled = fs->read_curpos = 0;
-      fs->write_curpos = 0;
-      fs->read_progress = 0;
-      key_derivation_function((void *)aes_key2, secret, secretlen, salt2, sizeof(salt2));
-      fs->read_cipher->setKey((const uint8_t *)aes_key2, fs->read_cipher->keySize());
-      fs->read_cipher->setIV((const uint8_t *)iv2, fs->read_cipher->ivSize());
-      base64_encode(fileenc_base64_readdata,(void *)fs,  fileenc_base64_writedata, (void *)fs);
-      fileenc_base64_writedata(-1, (void *)fs); 
-      fs->read_cipher->computeTag((uint8_t *)tag, AES_GCM_TAG_LENGTH);
-      file_write_header(&fs->write_file,"PARANOIABOX-PAYLOAD",1);
-      
-      file_write_block(&fs->write_file, "PARANOIABOX-ENDBLOCK", (void *)tag, sizeof(tag));      
-    } else file_report_error("Bad secret key");
+    fileenc_keys fk;
+    int done = 0;
+    if (multiple)
+    {
+      memset((void *)&fk,'\000',sizeof(fk));
+      fk.iterations = keymanager_kdf_iterations();
+      fk.schedule = FILEENC_SCHEDULE_EXPAND;
+      fs->recipients = (fileenc_recipients *)keymanager_malloc(sizeof(fileenc_recipients));
+      if ((fs->recipients != NULL) && (fileenc_wrap_data_key(&fk, fs->recipients, public_keys, count)))
+        done = fileenc_encrypt_file(fs, &fk, filename_plaintext, payload_format);
+      free(fs->recipients);
+      fs->recipients = NULL;
+    } else if (fileenc_keys_init(&fk))
+      done = fileenc_encrypt_file(fs, &fk, filename_plaintext, payload_format);
+    fileenc_keys_clear(&fk);
+    if (done)
+    {
+      benchmark_stages_report(&fs->stages);
+      console_press_space();
+    }
   }  
   f_close(&fs->write_file);
   f_close(&fs->read_file);
@@ -208,89 +792,490 @@ void fileenc_encrypt_state(fileenc_state *fs)
 
 void fileenc_encrypt(void)
 {
-  fileenc_state *fs = (fileenc_state *)malloc(sizeof(fileenc_state));
+  fileenc_state *fs = (fileenc_state *)keymanager_malloc(sizeof(fileenc_state));
   if (fs == NULL) return;
-  fileenc_encrypt_state(fs);
+  fileenc_encrypt_state(fs, 0);
   free(fs);
 }
 
+void fileenc_encrypt_recipients(void)
+{
+  fileenc_state *fs = (fileenc_state *)keymanager_malloc(sizeof(fileenc_state));
+  if (fs == NULL) return;
+  fileenc_encrypt_state(fs, 1);
+  free(fs);
+}
+
+
+#define FILEDEC_WRITEBUF_SIZE (FILEENC_CHUNK_RECORD_LEN+2)
 
-#define FILEDEC_READBUF_SIZE 512
+#define FILEDEC_PLAINBUF_SIZE 256
 
-#define FILEDEC_WRITEBUF_SIZE (AES_BLOCKLEN*64)
+/* Verifying a payload checks its GCM tags without decrypting it.  GCM
+   authenticates the ciphertext, so the ciphertext is only hashed. */
 
 typedef struct _filedec_readbuf
 {
   FIL          read_file;
-  FSIZE_t      read_last_block;
-  uint8_t      read_buf[FILEDEC_READBUF_SIZE];
-  uint16_t     read_filled;
-  uint16_t     read_curpos;
+  file_readahead read_ahead;
   uint8_t      read_abort;
   FIL          write_file;
   uint8_t      write_buf[FILEDEC_WRITEBUF_SIZE];
   uint16_t     write_curpos; 
   FSIZE_t      write_progress;
   FSIZE_t      write_total;
-  GCM<AES256>  *write_cipher;
+  FSIZE_t      write_length;
+  aes256_gcm_context *write_cipher;
+  uint8_t      verify;
+  uint32_t     chunkno;
+  uint8_t      chunk_final;
+  uint8_t      chunk_error;
+  uint8_t      verified;
+  benchmark_stages stages;
+  base64_state bs;
+  lzss_decoder lz;
+  uint8_t      plain_buf[FILEDEC_PLAINBUF_SIZE];
   fileenc_total_header fth;
 } filedec_state;
 
-int filedec_base64_readdata(void *v)
+void filedec_write_progress(filedec_state *fw)
 {
-  filedec_state *fr = (filedec_state *)v;
+  if ((fw->write_length-fw->write_progress) >= FILEENC_DISPLAY_INCREMENT)
+  {
+    console_puts((fw->verify) ? "Verifying " : "Writing ");
+    console_printuint(fw->write_progress);
+    console_putch('/');
+    console_printuint(fw->write_total);
+    console_printcrlf();
+    fw->write_progress = fw->write_length;
+    if (fw->write_progress > fw->fth.fhpu.fhp.file_length)
+      fw->read_abort = 1;
+  }
+}
+
+void filedec_write_block(filedec_state *fw)
+{
+  UINT br;
+  uint32_t start = benchmark_ticks();
+  fw->write_length += fw->write_curpos;
+  if (fw->verify)
+  {
+    aes256_gcm_hash(fw->write_cipher, fw->write_buf, fw->write_curpos);
+    benchmark_stage_add(&fw->stages, BENCHMARK_STAGE_CIPHER, start, fw->write_curpos);
+    fw->write_curpos = 0;
+    filedec_write_progress(fw);
+    return;
+  }
+  aes256_gcm_decrypt(fw->write_cipher, fw->write_buf, fw->write_buf, fw->write_curpos);
+  benchmark_stage_add(&fw->stages, BENCHMARK_STAGE_CIPHER, start, fw->write_curpos);
+  start = benchmark_ticks();
+  f_write(&fw->write_file,fw->write_buf,fw->write_curpos,&br);
+  benchmark_stage_add(&fw->stages, BENCHMARK_STAGE_WRITE, start, fw->write_curpos);
+  fw->write_curpos = 0;
+  filedec_write_progress(fw);
+}
+
+/* Writes the plaintext of a chunk, expanding it first if it is compressed */
+int filedec_write_plain(filedec_state *fs, const uint8_t *data, uint16_t len)
+{
+  UINT br;
+  uint32_t start;
+  if (!(fs->fth.fhpu.fhp.vers & FILEENC_VERS_LZSS))
+  {
+    fs->write_length += len;
+    if (fs->verify) return 1;
+    start = benchmark_ticks();
+    f_write(&fs->write_file,data,len,&br);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_WRITE, start, len);
+    return 1;
+  }
   for (;;)
   {
-    if (fr->read_curpos >= fr->read_filled)
+    size_t used;
+    start = benchmark_ticks();
+    size_t n = lzss_decode(&fs->lz, data, len, &used, fs->plain_buf, sizeof(fs->plain_buf));
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_COMPRESS, start, n);
+    data += used;
+    len -= used;
+    if (n == 0) return 1;
+    if ((fs->write_length + n) > fs->fth.fhpu.fhp.file_length) return 0;
+    fs->write_length += n;
+    start = benchmark_ticks();
+    f_write(&fs->write_file,fs->plain_buf,n,&br);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_WRITE, start, n);
+  }
+}
+
+/* Verifies each complete chunk in the write buffer and writes its plaintext.
+   Nothing is written from a chunk until its tag has been checked. */
+int filedec_write_chunks(filedec_state *fs)
+{
+  while (fs->write_curpos >= FILEENC_CHUNK_HEADER_LEN)
+  {
+    uint8_t nonce[AES_BLOCKLEN];
+    uint16_t hdr = fs->write_buf[0] | (((uint16_t)fs->write_buf[1]) << 8);
+    uint16_t len = hdr & ~FILEENC_CHUNK_FINAL;
+    if ((fs->chunk_final) || (len > FILEENC_CHUNK_SIZE) ||
+        ((!(hdr & FILEENC_CHUNK_FINAL)) && (len != FILEENC_CHUNK_SIZE))) return 0;
+    uint16_t reclen = FILEENC_CHUNK_HEADER_LEN + len + AES_GCM_TAG_LENGTH;
+    if (fs->write_curpos < reclen) break;
+    uint8_t *chunk = &fs->write_buf[FILEENC_CHUNK_HEADER_LEN];
+    fileenc_chunk_nonce(nonce, fs->fth.fhpu.fhp.iv2, fs->chunkno);
+    uint32_t start = benchmark_ticks();
+    aes256_gcm_setiv(fs->write_cipher, nonce);
+    aes256_gcm_auth(fs->write_cipher, fs->write_buf, FILEENC_CHUNK_HEADER_LEN);
+    if (fs->verify)
+      aes256_gcm_hash(fs->write_cipher, chunk, len);
+    else
+      aes256_gcm_decrypt(fs->write_cipher, chunk, chunk, len);
+    int tag_ok = aes256_gcm_check_tag(fs->write_cipher, &chunk[len]);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_CIPHER, start, len);
+    if (!tag_ok)
     {
-      UINT br;
-      fr->read_last_block = f_tell(&fr->read_file);
-      FRESULT res = f_read(&fr->read_file,fr->read_buf,FILEDEC_READBUF_SIZE,&br);
-      if ((res != FR_OK) || (br == 0)) return -1;
-      fr->read_filled = br;
-      fr->read_curpos = 0;
+      memset(chunk, '\000', len);
+      return 0;
     }
-    uint8_t ch = fr->read_buf[fr->read_curpos++];
-    if ((ch == '-') || (fr->read_abort))
+    if ((fs->verify) && (fs->fth.fhpu.fhp.vers & FILEENC_VERS_LZSS)) 
+      fs->write_length = fs->fth.fhpu.fhp.file_length;
+    else if (!filedec_write_plain(fs, chunk, len)) return 0;
+    filedec_write_progress(fs);
+    fs->chunkno++;
+    fs->chunk_final = (hdr & FILEENC_CHUNK_FINAL) != 0;
+    fs->write_curpos -= reclen;
+    memmove(fs->write_buf, &fs->write_buf[reclen], fs->write_curpos);
+  }
+  return 1;
+}
+
+void filedec_flush(filedec_state *fs)
+{
+  if (fs->fth.fhpu.fhp.vers & FILEENC_VERS_CHUNKED)
+  {
+    if (!filedec_write_chunks(fs))
+      fs->chunk_error = fs->read_abort = 1;
+  } else
+    filedec_write_block(fs);
+}
+
+/* The armored payload is scanned a line at a time.  A full line of base64
+   digits is decoded as whole groups straight out of the read-ahead buffer.
+   Any other line (the short last line, a line split between read buffers,
+   CR LF line ends or stray characters) goes through the span decoder, which
+   skips what is not base64.  A line starting with '-' ends the payload and
+   is left unread. */
+
+#define FILEDEC_LINE_DIGITS (FILEENC_LINE_CHARS-1)
+
+void filedec_dearmor_payload(filedec_state *fs)
+{
+  uint8_t line_start = 1;
+  base64_state_init(&fs->bs);
+  while (!fs->read_abort)
+  {
+    const uint8_t *data;
+    UINT l, space = FILEDEC_WRITEBUF_SIZE - fs->write_curpos;
+    uint32_t start = benchmark_ticks();
+    UINT n = file_readahead_peek(&fs->read_ahead, &data);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_READ, start, 0);
+    if ((n == 0) || ((line_start) && (data[0] == '-'))) break;
+    start = benchmark_ticks();
+    if ((line_start) && (n > FILEDEC_LINE_DIGITS) && (data[FILEDEC_LINE_DIGITS] == '\n') &&
+        (fs->bs.count == 0) && (space >= FILEENC_LINE_BYTES) &&
+        (base64_decode_groups((const char *)data, FILEDEC_LINE_DIGITS, &fs->write_buf[fs->write_curpos]) >= 0))
+    {
+      fs->write_curpos += FILEENC_LINE_BYTES;
+      l = FILEENC_LINE_CHARS;
+    } else
     {
-      f_lseek(&fr->read_file, fr->read_last_block);
-      return -1;
+      const uint8_t *nl = (const uint8_t *)memchr(data,'\n',n);
+      UINT m = (space/3)*4;
+      if (m == 0)
+      {
+        filedec_flush(fs);
+        continue;
+      }
+      l = (nl != NULL) ? (UINT)(nl - data + 1) : n;
+      if (l > m) l = m;
+      fs->write_curpos += base64_decode_span(&fs->bs, (const char *)data, l, &fs->write_buf[fs->write_curpos]);
     }
-    if (is_base64_char(ch)) return ch;
+    line_start = (data[l-1] == '\n');
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_ARMOR, start, l);
+    fs->stages.bytes[BENCHMARK_STAGE_READ] += l;
+    file_readahead_consume(&fs->read_ahead, l);
   }
+  if ((FILEDEC_WRITEBUF_SIZE - fs->write_curpos) < 2)
+    filedec_flush(fs);
+  fs->write_curpos += base64_decode_final(&fs->bs, &fs->write_buf[fs->write_curpos]);
+  filedec_flush(fs);
 }
 
-int filedec_base64_writedata(int c, void *v)
+void filedec_binary_payload(filedec_state *fs)
 {
-  filedec_state *fw = (filedec_state *)v;
+  while (fs->write_length < fs->write_total)
+  {
+    UINT br;
+    FSIZE_t n = fs->write_total - fs->write_length;
+    if (n > FILEDEC_WRITEBUF_SIZE) n = FILEDEC_WRITEBUF_SIZE;
+    uint32_t start = benchmark_ticks();
+    FRESULT res = file_readahead_read(&fs->read_ahead,fs->write_buf,n,&br);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_READ, start, br);
+    if ((res != FR_OK) || (br == 0)) break;
+    fs->write_curpos = br;
+    filedec_write_block(fs);
+  }
+}
 
-  if (c >= 0) 
-    fw->write_buf[fw->write_curpos++] = c; 
-  if ((fw->write_curpos == FILEDEC_WRITEBUF_SIZE) || (c < 0))
+void filedec_binary_chunks(filedec_state *fs)
+{
+  while ((!fs->chunk_final) && (!fs->read_abort))
   {
     UINT br;
-    fw->write_cipher->decrypt(fw->write_buf, fw->write_buf, fw->write_curpos);
-    f_write(&fw->write_file,fw->write_buf,fw->write_curpos,&br);
-    fw->write_curpos = 0;
-    if ((f_tell(&fw->write_file)-fw->write_progress) >= FILEENC_DISPLAY_INCREMENT)
-    {
-      console_puts("Writing ");
-      console_printuint(fw->write_progress);
-      console_putch('/');
-      console_printuint(fw->write_total);
-      console_printcrlf();
-      fw->write_progress = f_tell(&fw->write_file);
-      if (fw->write_progress > fw->fth.fhpu.fhp.file_length)
-        fw->read_abort = 1;
-    }
+    uint32_t start = benchmark_ticks();
+    FRESULT res = file_readahead_read(&fs->read_ahead,fs->write_buf,FILEENC_CHUNK_HEADER_LEN,&br);
+    if ((res != FR_OK) || (br != FILEENC_CHUNK_HEADER_LEN)) break;
+    UINT len = (fs->write_buf[0] | (((uint16_t)fs->write_buf[1]) << 8)) & ~FILEENC_CHUNK_FINAL;
+    if (len > FILEENC_CHUNK_SIZE) len = FILEENC_CHUNK_SIZE;
+    len += AES_GCM_TAG_LENGTH;
+    res = file_readahead_read(&fs->read_ahead,&fs->write_buf[FILEENC_CHUNK_HEADER_LEN],len,&br);
+    benchmark_stage_add(&fs->stages, BENCHMARK_STAGE_READ, start, FILEENC_CHUNK_HEADER_LEN+br);
+    if ((res != FR_OK) || (br != len)) break;
+    fs->write_curpos = FILEENC_CHUNK_HEADER_LEN + len;
+    filedec_flush(fs);
   }
+}
+
+FSIZE_t filedec_check_tag(filedec_state *fs)
+{
+  if (fs->write_length == fs->fth.fhpu.fhp.file_length)
+  {
+    if (file_skip_header(&fs->read_file,"PARANOIABOX-PAYLOAD",1))
+    {
+      uint8_t tag[AES_GCM_TAG_LENGTH];
+      if(file_read_block(&fs->read_file, "PARANOIABOX-ENDBLOCK", (void *)tag, sizeof(tag)))
+      { 
+        if (aes256_gcm_check_tag(fs->write_cipher, tag))
+        {
+           fs->verified = 1;
+           return fs->fth.fhpu.fhp.file_length;
+        }
+        else file_report_error("Payload Tag is invalid");
+      } else file_report_error("End block not found");
+    } else file_report_error("End of payload not found");                
+  } else file_report_error("Payload length does not match header");
+  return 0;
+}
+
+FSIZE_t filedec_check_chunks(filedec_state *fs)
+{
+  if (!fs->chunk_error)
+  {
+    if ((fs->chunk_final) && (fs->write_length == fs->fth.fhpu.fhp.file_length))
+    {
+      if (file_skip_header(&fs->read_file,"PARANOIABOX-PAYLOAD",1))
+      {
+        fs->verified = 1;
+        return fs->fth.fhpu.fhp.file_length;
+      }
+      else file_report_error("End of payload not found");                
+    } else file_report_error("Payload length does not match header");
+  } else file_report_error("Payload Tag is invalid");
   return 0;
 }
 
+/* Finds this key's entry in the recipients block and unwraps the data key.
+   The hashes of the block are taken before the entry is unwrapped in
+   place. */
+int filedec_unwrap_data_key(FIL *f, fileenc_keys *fk)
+{
+  int found = 0;
+  fileenc_recipients *fr = (fileenc_recipients *)keymanager_malloc(sizeof(fileenc_recipients));
+  if (fr == NULL) return 0;
+  memset((void *)fr,'\000',sizeof(*fr));
+  if ((file_read_block(f, "PARANOIABOX-RECIPIENTS", (void *)fr, sizeof(*fr))) && 
+      ((fr->id == FILEENC_RECIPIENTS_ID) || (fr->id == FILEENC_RECIPIENTS_ID_UNBOUND)) && (fr->count <= FILEENC_MAX_RECIPIENTS))
+  {
+    uint8_t binding[KEYMANAGER_HASHLEN], whole[KEYMANAGER_HASHLEN];
+    int bound = (fr->id == FILEENC_RECIPIENTS_ID);
+    uint8_t id[FILEENC_RECIPIENT_ID_LEN];
+    fileenc_recipient *r = NULL;
+    if (current_key_private.entry_type == KEY_TYPE_ECDH_PRIVATE)
+    {
+      fileenc_recipient_id(id, current_key_private.ksu.priv.public_key);
+      for (int i=0;i<fr->count;i++)
+      {
+        if (!memcmp(fr->recipient[i].id, id, sizeof(id)))
+        {
+          r = &fr->recipient[i];
+          break;
+        }
+      }
+    }
+    if (r == NULL)
+      file_report_error("Not a recipient of this file");
+    else if (fileenc_keys_set_iterations(fk, fr->kdf_iterations))
+    {
+      const uint8_t *wrap_key = fileenc_keys_derive(fk, FILEENC_KEY_WRAP, r->salt);
+      fileenc_recipients_hash(fr, 0, binding);
+      fileenc_recipients_hash(fr, 1, whole);
+      if (aes256_gcm_memcrypt_auth(0, (void *)wrap_key, (void *)r->iv, (void *)r->tag, binding, bound ? sizeof(binding) : 0,
+                                   (void *)r->data_key, sizeof(r->data_key)))
+      {
+        fileenc_keys_set_data_key(fk, r->data_key);
+        if (bound)
+        {
+          memcpy(fk->binding, whole, sizeof(fk->binding));
+          fk->binding_set = 1;
+        }
+        found = 1;
+      } else file_report_error("Recipient Tag is invalid");
+    }
+  } else file_report_error("Could not read recipients");
+  memset((void *)fr,'\000',sizeof(*fr));
+  free(fr);
+  return found;
+}
+
+static int fileenc_id_set(const uint8_t *id)
+{
+  for (int i=0;i<FILEENC_RECIPIENT_ID_LEN;i++)
+    if (id[i] != 0) return 1;
+  return 0;
+}
+
+/* Finds the public key of the other side named in the file header, by
+   looking its fingerprint up in the key store, unless it is the public key
+   already selected.  The other side is the sender, or the recipient when
+   the file was sent with this private key.  The key found is kept in fk,
+   and the selected public key is left as it is.  The file is left where it
+   was. */
+int filedec_select_public_key(FIL *f, fileenc_total_header *fth, fileenc_keys *fk)
+{
+  uint8_t id[FILEENC_RECIPIENT_ID_LEN];
+  const uint8_t *other;
+  key_entry ke;
+  if (current_key_private.entry_type != KEY_TYPE_ECDH_PRIVATE) return 1;
+  FSIZE_t start = f_tell(f);
+  memset((void *)fth,'\000',sizeof(*fth));
+  int ok = file_read_block(f, "PARANOIABOX-FILEHEADER", (void *)fth, sizeof(*fth));
+  f_lseek(f, start);
+  if (ok)
+  {
+    fileenc_recipient_id(id, current_key_private.ksu.priv.public_key);
+    other = memcmp(fth->sender_id, id, sizeof(id)) ? fth->sender_id : fth->recipient_id;
+    if ((fk->public_key_set) || (current_key_public.entry_type == KEY_TYPE_ECDH_PUBLIC))
+    {
+      fileenc_recipient_id(id, fk->public_key_set ? fk->public_key : current_key_public.ksu.pub.public_key);
+      if (!memcmp(other, id, sizeof(id))) other = NULL;
+    }
+    if ((other != NULL) && (fileenc_id_set(other)))
+    {
+      if (keymanager_find_public_key(other, &ke))
+      {
+        memcpy((void *)fk->public_key, (void *)ke.ksu.pub.public_key, sizeof(fk->public_key));
+        fk->public_key_set = 1;
+        console_puts("Public key: ");
+        console_puts(ke.description);
+        console_printcrlf();
+        memset((void *)&ke,'\000',sizeof(ke));
+        if (!fileenc_keys_set_secret(fk)) return 0;
+      } else if (fk->public_key_set)
+      {
+        memset(fk->public_key, '\000', sizeof(fk->public_key));
+        fk->public_key_set = 0;
+        fk->secretlen = 0;
+      }
+    }
+  }
+  if ((!fk->public_key_set) && (current_key_public.entry_type != KEY_TYPE_ECDH_PUBLIC))
+  {
+    file_report_error("No public key selected");
+    return 0;
+  }
+  if (fk->secretlen == 0) return fileenc_keys_set_secret(fk);
+  return 1;
+}
+
+/* Any recipient of a file for several recipients could have written it */
+#define FILEDEC_SENDER_WARNING "Several recipients: the sender is not\r\nproven, any recipient could write this\r\n"
+
+/* Reads and checks the file header of a ciphertext file and leaves the file
+   positioned at the start of the payload.  Returns the payload key. */
+const uint8_t *filedec_read_header(FIL *f, fileenc_total_header *fth, fileenc_keys *fk)
+{
+  if (!filedec_select_public_key(f, fth, fk)) return NULL;
+  memset((void *)fth,'\000',sizeof(*fth));
+  fileenc_keys_set_data_key(fk, NULL);
+  if ((file_at_header(f, "PARANOIABOX-RECIPIENTS", 0)) && (!filedec_unwrap_data_key(f, fk))) return NULL;
+  
+  if(!file_read_block(f, "PARANOIABOX-FILEHEADER", (void *)fth, sizeof(*fth)))
+    file_report_error("Could not read file header");
+  else if ((fileenc_keys_set_iterations(fk, fth->kdf_iterations)) && (fileenc_keys_set_schedule(fk, fth->key_schedule)))
+  {
+    const uint8_t *aes_key1 = fileenc_keys_derive(fk, FILEENC_KEY_HEADER, fth->salt1);
+    if (aes256_gcm_memcrypt_auth(0, (void *)aes_key1, (void *)fth->iv1, (void *)fth->tag1, fk->binding, fk->binding_set ? sizeof(fk->binding) : 0,
+                                 (void *)&fth->fhpu, sizeof(fth->fhpu)))
+    {
+       if ((fth->fhpu.fhp.id == FILEENC_EXPORT_ID) && ((fth->fhpu.fhp.vers & ~FILEENC_VERS_SUPPORTED) == FILEENC_EXPORT_VERSION) &&
+           ((!(fth->fhpu.fhp.vers & FILEENC_VERS_LZSS)) || (fth->fhpu.fhp.vers & FILEENC_VERS_CHUNKED)) &&
+           (((fth->fhpu.fhp.vers & FILEENC_VERS_RECIPIENTS) != 0) == (fk->data_key_set != 0)) &&
+           (fth->fhpu.fhp.len == sizeof(fth->fhpu.fhp)) && (fth->fhpu.fhp.entry_type == current_key_private.entry_type))
+       {
+          fth->fhpu.fhp.filename[sizeof(fth->fhpu.fhp.filename)-1] = '\000';
+          if (fk->data_key_set) console_puts(FILEDEC_SENDER_WARNING);
+          if (file_skip_header(f,"PARANOIABOX-PAYLOAD",0))
+            return fileenc_keys_derive(fk, FILEENC_KEY_PAYLOAD, fth->fhpu.fhp.salt2);
+          else file_report_error("No payload found");
+       } else file_report_error("Wrong version of header");
+    } else file_report_error("Header Tag is invalid");
+  }
+  return NULL;
+}
+
+/* Decrypts the payload of a ciphertext file whose header is in fs->fth,
+   returning the length of the plaintext output to keep. */
+FSIZE_t filedec_decrypt_payload(filedec_state *fs, const uint8_t *aes_key2)
+{
+  aes256_gcm_context write_cipher;
+  FSIZE_t plain_length;
+  fs->write_cipher = &write_cipher;
+  fs->read_abort = 0;
+  fs->write_curpos = 0;
+  fs->write_progress = 0;
+  fs->write_length = 0;
+  fs->write_total = fs->fth.fhpu.fhp.file_length;
+  fs->chunkno = 0;
+  fs->chunk_final = fs->chunk_error = 0;
+  fs->verified = 0;
+  lzss_decode_init(&fs->lz);
+  aes256_gcm_init(fs->write_cipher, aes_key2);
+  file_readahead_init(&fs->read_ahead, &fs->read_file, 1);
+  if (fs->fth.fhpu.fhp.vers & FILEENC_VERS_CHUNKED)
+  {
+    if (fs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY)
+      filedec_binary_chunks(fs);
+    else
+      filedec_dearmor_payload(fs);
+    file_readahead_sync(&fs->read_ahead);
+    plain_length = filedec_check_chunks(fs);
+  } else
+  {
+    aes256_gcm_setiv(fs->write_cipher, fs->fth.fhpu.fhp.iv2);
+    if (fs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY)
+      filedec_binary_payload(fs);
+    else
+      filedec_dearmor_payload(fs);
+    file_readahead_sync(&fs->read_ahead);
+    plain_length = filedec_check_tag(fs);
+  }
+  file_readahead_close(&fs->read_ahead);
+  aes256_gcm_clear(fs->write_cipher);
+  return plain_length;
+}
+
 void fileenc_decrypt_state(filedec_state *fs)
 {
   FSIZE_t destroy_output = 0;
-  if (!fileenc_check_key_selected()) return;
+  if (!filedec_check_key_selected()) return;
   {
     char filename_ciphertext[256];
     char filename_plaintext[256];
@@ -314,59 +1299,23 @@ void fileenc_decrypt_state(filedec_state *fs)
   }
   console_clrscr();
   console_puts("Decrypting file:\r\n");
+  benchmark_stages_init(&fs->stages);
+  fs->verified = 0;
+  fs->verify = 0;
   {
-    uint8_t secret[KEYMANAGER_MAX_SECRET_LEN];
-    int secretlen;
-    if (keymanager_compute_secret(secret, &secretlen))
+    fileenc_keys fk;
+    if (filedec_keys_init(&fk))
     {
-      memset((void *)&fs->fth,'\000',sizeof(fs->fth));
-      
-      if(file_read_block(&fs->read_file, "PARANOIABOX-FILEHEADER", (void *)&fs->fth, sizeof(fs->fth)))
-      {
-        
-        uint8_t aes_key1[AES_KEYLEN];
-        key_derivation_function((void *)aes_key1, secret, secretlen, fs->fth.salt1, sizeof(fs->fth.salt1));
-        if (aes256_gcm_memcrypt(0, (void *)aes_key1, (void *)fs->fth.iv1, (void *)fs->fth.tag1, (void *)&fs->fth.fhpu, sizeof(fs->fth.fhpu)))
-        {
-           if ((fs->fth.fhpu.fhp.id == FILEENC_EXPORT_ID) && (fs->fth.fhpu.fhp.vers == FILEENC_EXPORT_VERSION) &&
-               (fs->fth.fhpu.fhp.len == sizeof(fs->fth.fhpu.fhp)) && (fs->fth.fhpu.fhp.entry_type == current_key_private.entry_type))
-           {
-              fs->fth.fhpu.fhp.filename[sizeof(fs->fth.fhpu.fhp.filename)-1] = '\000';
-              if (file_skip_header(&fs->read_file,"PARANOIABOX-PAYLOAD",0))
-              {
-                GCM<AES256>  write_cipher;
-                uint8_t aes_key2[AES_KEYLEN];
-                key_derivation_function((void *)aes_key2, secret, secretlen, fs->fth.fhpu.fhp.salt2, sizeof(fs->fth.fhpu.fhp.salt2));
-                fs->write_cipher = &write_cipher;
-                fs->read_filled = fs->read_curpos = 0;
-                fs->read_abort = 0;
-                fs->write_curpos = 0;
-                fs->write_progress = 0;
-                fs->write_total = fs->fth.fhpu.fhp.file_length;
-                fs->write_cipher->setKey((const uint8_t *)aes_key2, fs->write_cipher->keySize());
-                fs->write_cipher->setIV((const uint8_t *)fs->fth.fhpu.fhp.iv2, fs->write_cipher->ivSize());
-                base64_decode(filedec_base64_readdata,(void *)fs,  filedec_base64_writedata, (void *)fs);
-                filedec_base64_writedata(-1, (void *)fs); 
-                if (f_tell(&fs->write_file) == fs->fth.fhpu.fhp.file_length)
-                {
-                  if (file_skip_header(&fs->read_file,"PARANOIABOX-PAYLOAD",1))
-                  {
-                    uint8_t tag[AES_GCM_TAG_LENGTH];
-                    if(file_read_block(&fs->read_file, "PARANOIABOX-ENDBLOCK", (void *)tag, sizeof(tag)))
-                    { 
-                      if (fs->write_cipher->checkTag(tag, AES_GCM_TAG_LENGTH))
-                      {
-                         destroy_output = fs->fth.fhpu.fhp.file_length;
-                      }
-                      else file_report_error("Payload Tag is invalid");
-                    } else file_report_error("End block not found");
-                  } else file_report_error("End of payload not found");                
-                } else file_report_error("Payload length does not match header");
-              } else file_report_error("No payload found");
-           } else file_report_error("Wrong version of header");
-        } else file_report_error("Header Tag is invalid");
-      } else file_report_error("Could not read file header");
-    } else file_report_error("Bad secret key");
+      const uint8_t *aes_key2 = filedec_read_header(&fs->read_file, &fs->fth, &fk);
+      if (aes_key2 != NULL)
+        destroy_output = filedec_decrypt_payload(fs, aes_key2);
+    }
+    fileenc_keys_clear(&fk);
+    if (fs->verified)
+    {
+      benchmark_stages_report(&fs->stages);
+      console_press_space();
+    }
   }
   f_lseek(&fs->write_file,destroy_output);
   f_truncate(&fs->write_file);
@@ -376,12 +1325,483 @@ void fileenc_decrypt_state(filedec_state *fs)
 
 void fileenc_decrypt(void)
 {
-  filedec_state *fs = (filedec_state *)malloc(sizeof(filedec_state));
+  filedec_state *fs = (filedec_state *)keymanager_malloc(sizeof(filedec_state));
   if (fs == NULL) return;
   fileenc_decrypt_state(fs);
   free(fs);
 }
 
+/* Checks the header and payload tags of a ciphertext file without writing
+   any plaintext */
+void fileenc_verify_state(filedec_state *fs)
+{
+  char filename_ciphertext[256];
+  if (!filedec_check_key_selected()) return;
+  if (!file_select_ciphertext("Select ciphertext file to verify", 0, filename_ciphertext, sizeof(filename_ciphertext)-1)) return;
+  if (f_open(&fs->read_file, filename_ciphertext, FA_READ) != FR_OK)
+  {
+    file_report_error("Could not open ciphertext file");
+    return;
+  }
+  console_clrscr();
+  console_puts("Verifying file:\r\n");
+  benchmark_stages_init(&fs->stages);
+  fs->verified = 0;
+  fs->verify = 1;
+  {
+    fileenc_keys fk;
+    if (filedec_keys_init(&fk))
+    {
+      const uint8_t *aes_key2 = filedec_read_header(&fs->read_file, &fs->fth, &fk);
+      if (aes_key2 != NULL)
+        filedec_decrypt_payload(fs, aes_key2);
+    }
+    fileenc_keys_clear(&fk);
+  }
+  if (fs->verified)
+  {
+    console_puts((fs->fth.fhpu.fhp.vers & FILEENC_VERS_RECIPIENTS) ? "File is intact: " : "File is authentic: ");
+    console_puts(fs->fth.fhpu.fhp.filename);
+    console_puts(", ");
+    console_printuint(fs->fth.fhpu.fhp.file_length);
+    console_puts(" bytes\r\n");
+    benchmark_stages_report(&fs->stages);
+    console_press_space();
+  }
+  fs->verify = 0;
+  f_close(&fs->read_file);
+}
+
+void fileenc_verify(void)
+{
+  filedec_state *fs = (filedec_state *)keymanager_malloc(sizeof(filedec_state));
+  if (fs == NULL) return;
+  fileenc_verify_state(fs);
+  free(fs);
+}
+
+/* Batch mode encrypts or decrypts every file in a directory with one key
+   setup.  The secret is computed once, and the files encrypted in a batch
+   share their salts, so the key derivation runs once per batch rather than
+   twice per file.  Each file still has its own random IVs.  Decrypting a
+   batch skips the key derivation for each file whose salt matches the
+   previous file's salt. */
+
+#define FILEENC_BATCH_SUFFIX ".pbx"
+
+typedef int (*fileenc_batch_file)(void *state, fileenc_keys *fk, const char *filename_in, const char *dir_out);
+
+void fileenc_batch_path(char *path, const char *dir, const char *name, int maxlen)
+{
+  strcpy_n(path, dir, maxlen);
+  strcat_n(path, "/", maxlen);
+  strcat_n(path, name, maxlen);
+}
+
+void fileenc_batch_directory(const char *dir_in, const char *dir_out, fileenc_keys *fk, void *state, fileenc_batch_file batch_file, benchmark_stages *stages)
+{
+  DIR dp;
+  uint32_t files = 0, failed = 0, total = 0;
+  unsigned long start = millis();
+
+  if (f_opendir(&dp, dir_in) != FR_OK)
+  {
+    file_report_error("Could not open directory");
+    return;
+  }
+  for (;;)
+  {
+    FILINFO nfo;
+    char filename_in[256];
+    if ((f_readdir(&dp, &nfo) != FR_OK) || (nfo.fname[0] == '\000')) break;
+    if (nfo.fattrib & (AM_DIR | AM_HID | AM_SYS)) continue;
+    fileenc_batch_path(filename_in, dir_in, nfo.fname, sizeof(filename_in)-1);
+    unsigned long file_start = millis();
+    if (batch_file(state, fk, filename_in, dir_out))
+    {
+      files++;
+      total += nfo.fsize;
+      benchmark_report_ms(nfo.fname, nfo.fsize, millis()-file_start);
+    } else 
+    {
+      failed++;
+      console_puts(nfo.fname);
+      console_puts(": failed\r\n");
+    }
+  }
+  f_closedir(&dp);
+  console_printuint(files);
+  console_puts(" files done, ");
+  console_printuint(failed);
+  console_puts(" failed\r\n");
+  benchmark_report_ms("Total", total, millis()-start);
+  benchmark_stages_report(stages);
+  console_press_space();
+}
+
+static int fileenc_batch_encrypt_file(void *v, fileenc_keys *fk, const char *filename_in, const char *dir_out)
+{
+  fileenc_state *fs = (fileenc_state *)v;
+  char filename_out[256];
+  int done = 0;
+
+  fileenc_batch_path(filename_out, dir_out, fileenc_filename(filename_in), sizeof(filename_out)-1);
+  strcat_n(filename_out, FILEENC_BATCH_SUFFIX, sizeof(filename_out)-1);
+  if (f_open(&fs->read_file, filename_in, FA_READ) != FR_OK) return 0;
+  if (f_open(&fs->write_file, filename_out, FA_WRITE | FA_CREATE_NEW) == FR_OK)
+  {
+    done = fileenc_encrypt_file(fs, fk, filename_in, fs->payload_format);
+    f_close(&fs->write_file);
+    if (!done) f_unlink(filename_out);
+  }
+  f_close(&fs->read_file);
+  return done;
+}
+
+static int fileenc_batch_decrypt_file(void *v, fileenc_keys *fk, const char *filename_in, const char *dir_out)
+{
+  filedec_state *fs = (filedec_state *)v;
+  FSIZE_t destroy_output = 0;
+
+  fs->verified = 0;
+  if (f_open(&fs->read_file, filename_in, FA_READ) != FR_OK) return 0;
+  const uint8_t *aes_key2 = filedec_read_header(&fs->read_file, &fs->fth, fk);
+  if (aes_key2 != NULL)
+  {
+    char filename_out[256];
+    fileenc_batch_path(filename_out, dir_out, fileenc_filename(fs->fth.fhpu.fhp.filename), sizeof(filename_out)-1);
+    if (f_open(&fs->write_file, filename_out, FA_WRITE | FA_CREATE_NEW) == FR_OK)
+    {
+      destroy_output = filedec_decrypt_payload(fs, aes_key2);
+      f_lseek(&fs->write_file,destroy_output);
+      f_truncate(&fs->write_file);
+      f_close(&fs->write_file);
+      if (!fs->verified) f_unlink(filename_out);
+    } else file_report_error("Could not create plaintext file");
+  }
+  f_close(&fs->read_file);
+  return fs->verified;
+}
+
+void fileenc_batch_encrypt(void)
+{
+  char dir_plaintext[256];
+  char dir_ciphertext[256];
+  int payload_format, compression;
+  if (!fileenc_check_key_selected()) return;
+  if (!file_select_plaintext("Select directory to encrypt", 1, dir_plaintext, sizeof(dir_plaintext)-1)) return;
+  if (!file_select_ciphertext("Select directory for ciphertext", 1, dir_ciphertext, sizeof(dir_ciphertext)-1)) return;
+  if ((payload_format = fileenc_select_payload_format()) < 0) return;
+  if ((compression = fileenc_select_compression()) < 0) return;
+  fileenc_state *fs = (fileenc_state *)keymanager_malloc(sizeof(fileenc_state));
+  if (fs == NULL) return;
+  console_clrscr();
+  console_puts("Encrypting directory:\r\n");
+  {
+    fileenc_keys fk;
+    fs->payload_format = payload_format | compression;
+    fs->recipients = NULL;
+    benchmark_stages_init(&fs->stages);
+    if (fileenc_keys_init(&fk))
+      fileenc_batch_directory(dir_plaintext, dir_ciphertext, &fk, (void *)fs, fileenc_batch_encrypt_file, &fs->stages);
+    fileenc_keys_clear(&fk);
+  }
+  free(fs);
+}
+
+void fileenc_batch_decrypt(void)
+{
+  char dir_ciphertext[256];
+  char dir_plaintext[256];
+  if (!filedec_check_key_selected()) return;
+  if (!file_select_ciphertext("Select directory to decrypt", 1, dir_ciphertext, sizeof(dir_ciphertext)-1)) return;
+  if (!file_select_plaintext("Select directory for plaintext", 1, dir_plaintext, sizeof(dir_plaintext)-1)) return;
+  filedec_state *fs = (filedec_state *)keymanager_malloc(sizeof(filedec_state));
+  if (fs == NULL) return;
+  console_clrscr();
+  console_puts("Decrypting directory:\r\n");
+  fs->verify = 0;
+  {
+    fileenc_keys fk;
+    benchmark_stages_init(&fs->stages);
+    if (filedec_keys_init(&fk))
+      fileenc_batch_directory(dir_ciphertext, dir_plaintext, &fk, (void *)fs, fileenc_batch_decrypt_file, &fs->stages);
+    fileenc_keys_clear(&fk);
+  }
+  free(fs);
+}
+
+void fileenc_batch(void)
+{
+  console_clrscr();
+  console_gotoxy(1,5);
+  console_puts("Batch (E)ncrypt or (D)ecrypt directory?");
+  for (;;)
+  {
+    int ch = toupper(console_getch());
+    if (ch == 'E')
+    {
+      fileenc_batch_encrypt();
+      return;
+    }
+    if (ch == 'D')
+    {
+      fileenc_batch_decrypt();
+      return;
+    }
+    if (ch == 'Q')
+      return;
+  }
+}
+
+/* The viewer decrypts single chunks of the payload on demand.  The ciphertext
+   of chunk n is found by its offset in the payload: records are laid end to
+   end, and an armored payload is written in full lines, so the line and
+   column of any payload byte can be computed directly.  The length of a line
+   and of its line end are measured from the first line, so that armor whose
+   line ends became CR LF, or that was wrapped again at another length, can
+   still be viewed.  Each computed line is checked to start after a line end.
+   Armor whose lines are not all the same length is read from the start of
+   the payload for each chunk instead, which is slow for large files. */
+
+#define FILEVIEW_CACHE_CHUNKS 2
+#define FILEVIEW_ARMOR_BUF 128
+
+#define FILEVIEW_ERROR_TAG 1
+#define FILEVIEW_ERROR_LAYOUT 2
+
+typedef struct _fileview_chunk
+{
+  uint32_t     chunkno;
+  uint32_t     last_used;
+  uint16_t     len;
+  uint8_t      valid;
+  uint8_t      plaintext[FILEENC_CHUNK_SIZE];
+} fileview_chunk;
+
+typedef struct _fileview_state
+{
+  FIL            read_file;
+  FSIZE_t        payload_start;
+  aes256_gcm_context *cipher;
+  uint32_t       use_count;
+  uint16_t       line_bytes;
+  uint16_t       line_stride;
+  uint8_t        armor_scan;
+  uint8_t        error;
+  fileview_chunk cache[FILEVIEW_CACHE_CHUNKS];
+  uint8_t        record[FILEENC_CHUNK_RECORD_LEN+2];
+  char           armor_buf[FILEVIEW_ARMOR_BUF];
+  fileenc_total_header fth;
+} fileview_state;
+
+/* Measures the lines of an armored payload from its first line, or chooses
+   to scan the payload if the first line is not whole groups of digits */
+void fileview_measure_armor(fileview_state *vs)
+{
+  uint8_t decoded[BASE64_DECODED_LEN(FILEVIEW_ARMOR_BUF)];
+  UINT br;
+  vs->armor_scan = 1;
+  if ((f_lseek(&vs->read_file, vs->payload_start) != FR_OK) ||
+      (f_read(&vs->read_file, vs->armor_buf, sizeof(vs->armor_buf), &br) != FR_OK)) return;
+  char *nl = (char *)memchr(vs->armor_buf, '\n', br);
+  if (nl == NULL) return;
+  UINT digits = nl - vs->armor_buf;
+  if ((digits > 0) && (vs->armor_buf[digits-1] == '\r')) digits--;
+  if ((digits == 0) || ((digits % 4) != 0) || (base64_decode_groups(vs->armor_buf, digits, decoded) < 0)) return;
+  vs->line_bytes = (digits / 4) * 3;
+  vs->line_stride = (nl - vs->armor_buf) + 1;
+  vs->armor_scan = (vs->line_stride > (sizeof(vs->armor_buf)-2));
+}
+
+/* Checks that a computed line starts after a line end and is either a full
+   line or the last line of the payload */
+int fileview_check_line(fileview_state *vs, FSIZE_t line_pos)
+{
+  UINT br, before = (line_pos > vs->payload_start) ? 1 : 0;
+  if ((f_lseek(&vs->read_file, line_pos - before) != FR_OK) ||
+      (f_read(&vs->read_file, vs->armor_buf, vs->line_stride + before + 1, &br) != FR_OK)) return 0;
+  if ((before) && ((br == 0) || (vs->armor_buf[0] != '\n'))) return 0;
+  const char *line = &vs->armor_buf[before];
+  const char *nl = (const char *)memchr(line, '\n', br - before);
+  if (nl == NULL) return 0;
+  if ((nl - line) == (vs->line_stride - 1)) return 1;
+  return ((nl - line) < (vs->line_stride - 1)) && ((nl + 1) < (vs->armor_buf + br)) && (nl[1] == '-');
+}
+
+int fileview_read_record(fileview_state *vs, FSIZE_t rec_ofs, uint16_t reclen)
+{
+  UINT br;
+  if (vs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY)
+  {
+    if (f_lseek(&vs->read_file, vs->payload_start + rec_ofs) != FR_OK) return 0;
+    if ((f_read(&vs->read_file, vs->record, reclen, &br) != FR_OK) || (br != reclen)) return 0;
+    return 1;
+  }
+  base64_state bs;
+  FSIZE_t skip = rec_ofs;
+  FSIZE_t pos = vs->payload_start;
+  uint16_t filled = 0;
+  if (!vs->armor_scan)
+  {
+    uint16_t line_groups = vs->line_bytes / 3;
+    FSIZE_t group = rec_ofs / 3;
+    FSIZE_t line_pos = vs->payload_start + (group / line_groups) * vs->line_stride;
+    if (fileview_check_line(vs, line_pos))
+    {
+      pos = line_pos + (group % line_groups) * 4;
+      skip = rec_ofs % 3;
+    } else
+      vs->armor_scan = 1;
+  }
+  if (f_lseek(&vs->read_file, pos) != FR_OK) return 0;
+  base64_state_init(&bs);
+  while (filled < reclen)
+  {
+    uint8_t decoded[BASE64_DECODED_LEN(FILEVIEW_ARMOR_BUF)+2];
+    FRESULT res = f_read(&vs->read_file, vs->armor_buf, sizeof(vs->armor_buf), &br);
+    if ((res != FR_OK) || (br == 0)) return 0;
+    char *dash = (char *)memchr(vs->armor_buf, '-', br);
+    UINT n = (dash != NULL) ? (UINT)(dash - vs->armor_buf) : br;
+    size_t l = base64_decode_span(&bs, vs->armor_buf, n, decoded);
+    if (dash != NULL) l += base64_decode_final(&bs, &decoded[l]);
+    size_t i = 0;
+    if (skip > 0)
+    {
+      i = (skip < l) ? skip : l;
+      skip -= i;
+    }
+    for (;(i<l) && (filled<reclen);i++)
+      vs->record[filled++] = decoded[i];
+    if (dash != NULL) break;
+  }
+  return (filled == reclen);
+}
+
+/* Reads and decrypts a chunk.  A chunk of armor that fails its header or
+   tag where the line layout put it is read again by scanning, before the
+   chunk is taken to be damaged. */
+int fileview_load_chunk(fileview_state *vs, fileview_chunk *vc, uint32_t chunkno)
+{
+  uint8_t nonce[AES_BLOCKLEN];
+  FSIZE_t plain_ofs = ((FSIZE_t)chunkno) * FILEENC_CHUNK_SIZE;
+  FSIZE_t remaining = vs->fth.fhpu.fhp.file_length - plain_ofs;
+  uint16_t len = (remaining > FILEENC_CHUNK_SIZE) ? FILEENC_CHUNK_SIZE : remaining;
+  uint16_t hdr = len | ((remaining <= FILEENC_CHUNK_SIZE) ? FILEENC_CHUNK_FINAL : 0);
+  uint16_t reclen = FILEENC_CHUNK_HEADER_LEN + len + AES_GCM_TAG_LENGTH;
+
+  vc->valid = 0;
+  for (;;)
+  {
+    uint8_t scanned = vs->armor_scan;
+    if (!fileview_read_record(vs, ((FSIZE_t)chunkno) * FILEENC_CHUNK_RECORD_LEN, reclen))
+    {
+      vs->error = (vs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY) ? FILEVIEW_ERROR_TAG : FILEVIEW_ERROR_LAYOUT;
+      return 0;
+    }
+    if ((vs->record[0] | (((uint16_t)vs->record[1]) << 8)) == hdr)
+    {
+      fileenc_chunk_nonce(nonce, vs->fth.fhpu.fhp.iv2, chunkno);
+      aes256_gcm_setiv(vs->cipher, nonce);
+      aes256_gcm_auth(vs->cipher, vs->record, FILEENC_CHUNK_HEADER_LEN);
+      aes256_gcm_decrypt(vs->cipher, vc->plaintext, &vs->record[FILEENC_CHUNK_HEADER_LEN], len);
+      if (aes256_gcm_check_tag(vs->cipher, &vs->record[FILEENC_CHUNK_HEADER_LEN+len])) break;
+      memset(vc->plaintext, '\000', len);
+    }
+    if ((scanned) || (vs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY))
+    {
+      vs->error = FILEVIEW_ERROR_TAG;
+      return 0;
+    }
+    vs->armor_scan = 1;
+  }
+  vc->chunkno = chunkno;
+  vc->len = len;
+  vc->valid = 1;
+  return 1;
+}
+
+static int fileview_read_at(void *v, FSIZE_t ofs)
+{
+  fileview_state *vs = (fileview_state *)v;
+  fileview_chunk *vc = NULL;
+  if ((vs->error) || (ofs >= vs->fth.fhpu.fhp.file_length)) return -1;
+  uint32_t chunkno = ofs / FILEENC_CHUNK_SIZE;
+  for (int i=0;i<FILEVIEW_CACHE_CHUNKS;i++)
+  {
+    fileview_chunk *c = &vs->cache[i];
+    if ((c->valid) && (c->chunkno == chunkno))
+    {
+      vc = c;
+      break;
+    }
+    if ((vc == NULL) || (!c->valid) || ((vc->valid) && (c->last_used < vc->last_used))) vc = c;
+  }
+  if ((!vc->valid) || (vc->chunkno != chunkno))
+  {
+    if (!fileview_load_chunk(vs, vc, chunkno)) return -1;
+  }
+  vc->last_used = ++vs->use_count;
+  return vc->plaintext[ofs % FILEENC_CHUNK_SIZE];
+}
+
+void fileenc_view_state(fileview_state *vs)
+{
+  if (!filedec_check_key_selected()) return;
+  {
+    char filename_ciphertext[256];
+    if (!file_select_ciphertext("Select ciphertext file to view", 0, filename_ciphertext, sizeof(filename_ciphertext)-1)) return;
+    if (f_open(&vs->read_file, filename_ciphertext, FA_READ) != FR_OK)
+    {
+      file_report_error("Could not open ciphertext file");
+      return;
+    }
+  }
+  console_clrscr();
+  console_puts("Opening file:\r\n");
+  {
+    fileenc_keys fk;
+    const uint8_t *aes_key2;
+    if ((filedec_keys_init(&fk)) && ((aes_key2 = filedec_read_header(&vs->read_file, &vs->fth, &fk)) != NULL))
+    {
+      if (vs->fth.fhpu.fhp.vers & FILEENC_VERS_RECIPIENTS) console_press_space();
+      if (vs->fth.fhpu.fhp.vers & FILEENC_VERS_LZSS)
+        file_report_error("Compressed files must be decrypted to view");
+      else if (vs->fth.fhpu.fhp.vers & FILEENC_VERS_CHUNKED)
+      {
+        aes256_gcm_context cipher;
+        file_view_source src;
+        vs->cipher = &cipher;
+        aes256_gcm_init(vs->cipher, aes_key2);
+        vs->payload_start = f_tell(&vs->read_file);
+        vs->use_count = 0;
+        vs->error = 0;
+        if (!(vs->fth.fhpu.fhp.vers & FILEENC_VERS_BINARY)) fileview_measure_armor(vs);
+        for (int i=0;i<FILEVIEW_CACHE_CHUNKS;i++) vs->cache[i].valid = 0;
+        src.state = (void *)vs;
+        src.size = vs->fth.fhpu.fhp.file_length;
+        src.read_at = fileview_read_at;
+        file_view_source_display(vs->fth.fhpu.fhp.filename, &src, 20, 38);
+        aes256_gcm_clear(vs->cipher);
+        if (vs->error == FILEVIEW_ERROR_LAYOUT)
+          file_report_error("Armor layout not supported for viewing, decrypt instead");
+        else if (vs->error) file_report_error("Payload Tag is invalid");
+      } else file_report_error("File must be re-encrypted to view");
+    }
+    fileenc_keys_clear(&fk);
+  }
+  f_close(&vs->read_file);
+}
+
+void fileenc_view(void)
+{
+  fileview_state *vs = (fileview_state *)keymanager_malloc(sizeof(fileview_state));
+  if (vs == NULL) return;
+  fileenc_view_state(vs);
+  memset(vs, '\000', sizeof(fileview_state));
+  free(vs);
+}
+
 #ifdef __cplusplus
 }
 #endif  
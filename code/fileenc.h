@@ -30,6 +30,21 @@ extern "C" {
 #define FILEENC_EXPORT_ID 0xBBCC
 #define FILEENC_EXPORT_VERSION 0x1000
 
+/* Payload format flags carried in the low bits of vers */
+#define FILEENC_VERS_BINARY    0x0001
+#define FILEENC_VERS_CHUNKED   0x0002
+#define FILEENC_VERS_LZSS      0x0004
+#define FILEENC_VERS_RECIPIENTS 0x0008
+#define FILEENC_VERS_SUPPORTED (FILEENC_VERS_BINARY | FILEENC_VERS_CHUNKED | FILEENC_VERS_LZSS | FILEENC_VERS_RECIPIENTS)
+
+/* A chunked payload is a sequence of records, each a two byte little-endian
+   header holding the chunk length and final flag, the ciphertext of the chunk
+   and its GCM tag.  Every chunk but the last is FILEENC_CHUNK_SIZE long. */
+#define FILEENC_CHUNK_SIZE (AES_BLOCKLEN*64)
+#define FILEENC_CHUNK_FINAL 0x8000
+#define FILEENC_CHUNK_HEADER_LEN 2
+#define FILEENC_CHUNK_RECORD_LEN (FILEENC_CHUNK_HEADER_LEN+FILEENC_CHUNK_SIZE+AES_GCM_TAG_LENGTH)
+
 #define FILEENC_FILENAME 256
 #define FILEENC_FUTUREPROOF_LENGTH 512
 
@@ -54,16 +69,75 @@ typedef union _fileenc_header_payload_union
   uint8_t filler[FILEENC_FUTUREPROOF_LENGTH];
 } fileenc_header_payload_union;
 
+/* kdf_iterations is the cost of deriving the header and payload keys.  It
+   is zero in files written before the cost was recorded.  key_schedule says
+   how those keys are derived.  Files written before it was recorded stretch
+   the secret once for each key, with salt1 and salt2.  The expand schedule
+   stretches it once with salt1 and expands each key from the result. */
+
+#define FILEENC_SCHEDULE_SEPARATE 0
+#define FILEENC_SCHEDULE_EXPAND   1
+
+#define FILEENC_RECIPIENT_ID_LEN KEYMANAGER_FINGERPRINT_LEN
+
+/* A file encrypted with a private key names the public key of its sender
+   and, unless it is for several recipients, of its recipient by their
+   fingerprints, so that the reader's key manager can choose the other
+   side's public key.  Both are zero in files written before they were
+   recorded and in files encrypted with a symmetric key. */
+
 typedef struct _fileenc_total_header
 {
   uint8_t                         salt1[KEYMANAGER_HASHLEN];
   uint8_t                         iv1[AES_BLOCKLEN];
   uint8_t                         tag1[AES_BLOCKLEN];
   fileenc_header_payload_union    fhpu;
+  uint32_t                        kdf_iterations;
+  uint32_t                        key_schedule;
+  uint8_t                         sender_id[FILEENC_RECIPIENT_ID_LEN];
+  uint8_t                         recipient_id[FILEENC_RECIPIENT_ID_LEN];
 } fileenc_total_header;
 
+/* A file for several recipients is encrypted under a random data key in
+   place of the shared secret.  The recipients block ahead of the file header
+   holds the data key wrapped for each recipient under a key derived from
+   the shared secret of the sender and that recipient.  Each entry is found
+   by a hash of the recipient's public key.  Each wrap authenticates a hash
+   of the block's id, count, cost and every recipient's id and salt, and the
+   file header authenticates a hash of the whole block.  Every recipient
+   holds the data key, so any of them can write a file that the others
+   unwrap as if it came from the sender; such a file does not prove its
+   sender.  Blocks with the UNBOUND id were written before the block was
+   authenticated. */
+
+#define FILEENC_RECIPIENTS_ID 0xBBCE
+#define FILEENC_RECIPIENTS_ID_UNBOUND 0xBBCD
+#define FILEENC_MAX_RECIPIENTS 8
+
+typedef struct _fileenc_recipient
+{
+  uint8_t       id[FILEENC_RECIPIENT_ID_LEN];
+  uint8_t       salt[KEYMANAGER_HASHLEN];
+  uint8_t       iv[AES_BLOCKLEN];
+  uint8_t       tag[AES_BLOCKLEN];
+  uint8_t       data_key[KEYMANAGER_MAX_SECRET_LEN];
+} fileenc_recipient;
+
+typedef struct _fileenc_recipients
+{
+  uint16_t          id;
+  uint16_t          count;
+  uint32_t          kdf_iterations;
+  fileenc_recipient recipient[FILEENC_MAX_RECIPIENTS];
+} fileenc_recipients;
+
+void fileenc_chunk_nonce(uint8_t *nonce, const uint8_t *iv, uint32_t chunkno);
 void fileenc_encrypt(void);
 void fileenc_decrypt(void);
+void fileenc_verify(void);
+void fileenc_view(void);
+void fileenc_batch(void);
+void fileenc_encrypt_recipients(void);
 
 #ifdef __cplusplus
 }
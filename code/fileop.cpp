@@ -150,16 +150,46 @@ void file_mount_volume(uint8_t unmount)
   fs1_mounted = (f_mount(&fs1,"1:",1) == FR_OK);
 }
 
-#define FILE_SELECT_ENTRY_LEN 31
+/* The file selector reads a directory once into an index in a single
+   arena, with the entries from the front and their names packed from the
+   back, and pages, sorts and filters from the index.  A directory with more
+   entries than fit in the arena is shown in part. */
+
 #define FILE_SELECT_MAX_ENTRIES 16
+#define FILE_SELECT_ARENA_SIZE 4096
+#define FILE_SELECT_ARENA_MIN 512
+#define FILE_SELECT_FILTER_LEN 20
+#define FILE_SELECT_NAME_COLUMNS 30
+#define FILE_SELECT_CLEAR_KEY ('U'-64)
+
+#define FILE_SELECT_SORT_NAME 0
+#define FILE_SELECT_SORT_SIZE 1
+#define FILE_SELECT_SORT_DATE 2
+#define FILE_SELECT_SORTS 3
 
 typedef struct
 {
-  BYTE attrib;
   FSIZE_t filesize;
-  char name[FILE_SELECT_ENTRY_LEN+1];
+  uint32_t datetime;
+  uint16_t name;
+  BYTE attrib;
+  BYTE shown;
 } file_select_entry;
 
+typedef struct
+{
+  uint8_t *arena;
+  uint16_t size;
+  uint16_t count;
+  uint16_t names;
+  uint16_t shown;
+  uint8_t truncated;
+  uint8_t sort;
+  char filter[FILE_SELECT_FILTER_LEN+1];
+} file_select_index;
+
+static const char * const file_select_sort_names[FILE_SELECT_SORTS] = { "name", "size", "date" };
+
 int file_strip_pathname(char *filename)
 {
   char *c = filename;
@@ -170,147 +200,268 @@ int file_strip_pathname(char *filename)
   return 1;
 }
 
-int file_select(const char *message, const char *dir, uint8_t seldir, char *selected, int maxlen)
+static file_select_entry *file_select_entries(file_select_index *fsi)
 {
-  int cur_page_entry = 0;
-  file_select_entry *fse;
-  
-  fse = (file_select_entry *)malloc(sizeof(file_select_entry)*FILE_SELECT_MAX_ENTRIES);
-  if (fse == NULL) return 0;
-  strcpy_n(selected,dir,maxlen);
-  int selitem = 0;
+  return (file_select_entry *)fsi->arena;
+}
+
+static const char *file_select_name(file_select_index *fsi, const file_select_entry *f)
+{
+  return (const char *)&fsi->arena[f->name];
+}
+
+/* Reads a directory into the index */
+static int file_select_read_dir(file_select_index *fsi, const char *dir)
+{
+  DIR dp;
+  fsi->count = 0;
+  fsi->names = fsi->size;
+  fsi->truncated = 0;
+  FRESULT fres = f_opendir(&dp,dir);
+  if (fres != FR_OK)
+  {
+    file_report_error("Could not open directory"); 
+    return 0;
+  }
   for (;;)
   {
-    DIR dp;
-    FRESULT fres = f_opendir(&dp,selected);
+    FILINFO nfo;
+    fres = f_readdir(&dp,&nfo);
     if (fres != FR_OK)
     {
-      file_report_error("Could not open directory"); 
-      free(fse);
+      file_report_error("Could not open directory entry"); 
+      f_closedir(&dp);
       return 0;
     }
-    int n = 0, m = 0;
-    for (;;)
+    if (nfo.fname[0] == '\000') break;
+    uint16_t len = strlen(nfo.fname) + 1;
+    if (((uint32_t)(fsi->count+1)*sizeof(file_select_entry) + len) > fsi->names)
     {
-      FILINFO nfo;
-      fres = f_readdir(&dp,&nfo);
-      if (fres != FR_OK)
-      {
-        file_report_error("Could not open directory entry"); 
-        free(fse);
-        return 0;
-      }
-      if (nfo.fname[0] == '\000') break;
-      if ((++m) < cur_page_entry) continue;
-      file_select_entry *f = &fse[n];
-      strcpy_n(f->name,nfo.fname,sizeof(f->name)-1);
-      f->attrib = nfo.fattrib;
-      f->filesize = nfo.fsize;  
-      if ((++n) >= FILE_SELECT_MAX_ENTRIES) break;
+      fsi->truncated = 1;
+      break;
+    }
+    fsi->names -= len;
+    memcpy(&fsi->arena[fsi->names], nfo.fname, len);
+    file_select_entry *f = &file_select_entries(fsi)[fsi->count++];
+    f->name = fsi->names;
+    f->attrib = nfo.fattrib;
+    f->filesize = nfo.fsize;
+    f->datetime = (((uint32_t)nfo.fdate) << 16) | nfo.ftime;
+    f->shown = 1;
+  }
+  f_closedir(&dp);
+  return 1;
+}
+
+static int file_select_compare_name(const char *a, const char *b)
+{
+  while ((*a) && (toupper(*a) == toupper(*b)))
+  {
+    a++;
+    b++;
+  }
+  return toupper(*a) - toupper(*b);
+}
+
+/* Directories come first, then files in the order of the sort */
+static int file_select_compare(file_select_index *fsi, const file_select_entry *a, const file_select_entry *b)
+{
+  if ((a->attrib & AM_DIR) != (b->attrib & AM_DIR))
+    return (a->attrib & AM_DIR) ? -1 : 1;
+  if ((fsi->sort == FILE_SELECT_SORT_SIZE) && (a->filesize != b->filesize))
+    return (a->filesize > b->filesize) ? -1 : 1;
+  if ((fsi->sort == FILE_SELECT_SORT_DATE) && (a->datetime != b->datetime))
+    return (a->datetime > b->datetime) ? -1 : 1;
+  return file_select_compare_name(file_select_name(fsi, a), file_select_name(fsi, b));
+}
+
+static void file_select_sort(file_select_index *fsi)
+{
+  file_select_entry *fse = file_select_entries(fsi);
+  for (uint16_t n=1;n<fsi->count;n++)
+  {
+    file_select_entry f = fse[n];
+    uint16_t m = n;
+    while ((m > 0) && (file_select_compare(fsi, &fse[m-1], &f) > 0))
+    {
+      fse[m] = fse[m-1];
+      m--;
     }
-    f_closedir(&dp);
-    if (n == 0)
+    fse[m] = f;
+  }
+}
+
+/* Shows the entries whose names start with the filter */
+static void file_select_filter(file_select_index *fsi)
+{
+  file_select_entry *fse = file_select_entries(fsi);
+  fsi->shown = 0;
+  for (uint16_t n=0;n<fsi->count;n++)
+  {
+    const char *name = file_select_name(fsi, &fse[n]);
+    const char *c = fsi->filter;
+    while ((*c) && (toupper(*c) == toupper(*name)))
     {
-      if (cur_page_entry >= FILE_SELECT_MAX_ENTRIES)
-        {
-          cur_page_entry -= FILE_SELECT_MAX_ENTRIES;
-          continue;
-        } else
-        {
-          console_gotoxy(1,4);
-          console_puts("No files to select");
-        } 
+      c++;
+      name++;
     }
+    fse[n].shown = (*c == '\000');
+    if (fse[n].shown) fsi->shown++;
+  }
+}
+
+/* The entry at a position among the shown entries */
+static file_select_entry *file_select_shown(file_select_index *fsi, uint16_t pos)
+{
+  file_select_entry *fse = file_select_entries(fsi);
+  for (uint16_t n=0;n<fsi->count;n++)
+  {
+    if (!fse[n].shown) continue;
+    if (pos == 0) return &fse[n];
+    pos--;
+  }
+  return NULL;
+}
+
+static int file_select_open(file_select_index *fsi, const char *dir)
+{
+  fsi->filter[0] = '\000';
+  if (!file_select_read_dir(fsi, dir)) return 0;
+  file_select_sort(fsi);
+  file_select_filter(fsi);
+  return 1;
+}
+
+int file_select(const char *message, const char *dir, uint8_t seldir, char *selected, int maxlen)
+{
+  file_select_index fsi;
+  int selitem = 0;
+  uint8_t filtering = 0;
+
+  memset((void *)&fsi, '\000', sizeof(fsi));
+  for (fsi.size=FILE_SELECT_ARENA_SIZE;fsi.size>=FILE_SELECT_ARENA_MIN;fsi.size/=2)
+    if ((fsi.arena = (uint8_t *)malloc(fsi.size)) != NULL) break;
+  if (fsi.arena == NULL) return 0;
+  strcpy_n(selected,dir,maxlen);
+  int ok = file_select_open(&fsi, selected);
+  while (ok)
+  {
+    int top = selitem - (selitem % FILE_SELECT_MAX_ENTRIES);
     console_clrscr();
     console_puts(message);
     console_puts("\r\nSelect ");
     console_puts(seldir ? "directory:\r\n" : "file:\r\n");
     console_puts(selected);
+    console_gotoxy(0,3);
+    console_puts("Sort by ");
+    console_puts(file_select_sort_names[fsi.sort]);
+    if ((filtering) || (fsi.filter[0] != '\000'))
+    {
+      console_puts(", filter: ");
+      console_puts(fsi.filter);
+      if (filtering) console_putch('_');
+    }
+    if (fsi.truncated) console_puts(" (not all shown)");
+    if (fsi.shown == 0)
+    {
+      console_gotoxy(1,5);
+      console_puts("No files to select");
+    }
+    file_select_entry *f = file_select_shown(&fsi, top);
+    for (int p=0;(p<FILE_SELECT_MAX_ENTRIES) && ((top+p)<fsi.shown);p++,f++)
+    {
+      while (!f->shown) f++;
+      if ((top+p) == selitem) console_highvideo();
+        else console_lowvideo();
+      console_gotoxy(1,p+5);
+      for (const char *c=file_select_name(&fsi, f);(*c) && (c<(file_select_name(&fsi, f)+FILE_SELECT_NAME_COLUMNS));c++)
+        console_putch(*c);
+      console_lowvideo();
+      console_gotoxy(32,p+5);
+      if (f->attrib & AM_DIR)
+      {
+        console_puts("<DIR>");
+      } else console_printuint(f->filesize);
+    }
     console_gotoxy(0,22);
-    console_puts("Up/Down move, Enter Select, Right Enter\r\nDir, Left Leave Dir, Q Quit");
-    for (;;)
+    if (filtering)
+      console_puts("Type start of name, Enter done,\r\nCtrl-U clear filter, Up/Down move");
+    else
+      console_puts("Up/Down move, Enter Select, Right Enter\r\nDir, Left Leave Dir, S Sort, / Filter, Q Quit");
+    int ch = console_getch();
+    if ((filtering) && (ch == 27))
     {
-      for (int p=0;p<n;p++)
-      {        
-        file_select_entry *f = &fse[p];
-        if (p == selitem) console_highvideo();
-          else console_lowvideo();
-        console_gotoxy(1,p+5);
-        console_puts(f->name);
-        console_lowvideo();
-        console_gotoxy(32,p+5);
-        if (f->attrib & AM_DIR)
-        {
-          console_puts("<DIR>");
-        } else console_printuint(f->filesize);
-      }
-      int ch = toupper(console_getch());
-      if (selitem < n)
+      /* The arrow keys arrive as ESC [ and a letter.  They end typing and
+         move in the filtered list. */
+      if (console_getch() != '[') continue;
+      ch = console_getch();
+      filtering = 0;
+    } else if (filtering)
+    {
+      int len = strlen(fsi.filter);
+      if (ch == '\r')
+        filtering = 0;
+      else if (ch == FILE_SELECT_CLEAR_KEY)
+        fsi.filter[0] = '\000';
+      else if ((ch == 8) || (ch == 127))
       {
-        if (ch == 'A')
-        {
-          if (selitem > 0) --selitem;
-          else
-          {
-            if (cur_page_entry >= FILE_SELECT_MAX_ENTRIES)
-            {
-              cur_page_entry -= FILE_SELECT_MAX_ENTRIES;
-              selitem = FILE_SELECT_MAX_ENTRIES-1;
-              break;
-            }
-          }
-        }
-        if (ch == 'B')
-        {
-          if (selitem < (n-1)) ++selitem;
-          else {
-            if (selitem == (FILE_SELECT_MAX_ENTRIES-1))
-            {
-              cur_page_entry += FILE_SELECT_MAX_ENTRIES;
-              selitem = 0;
-              break;
-            }
-          }
-        }
-        if (ch == 'C')
-        {
-          if (fse[selitem].attrib & AM_DIR)
-          {
-            strcat_n(selected,"/",maxlen);
-            strcat_n(selected,fse[selitem].name,maxlen);
-            cur_page_entry = selitem = 0;
-            break;        
-          }
-        }
-      }
-      if (ch == 'D')
+        if (len > 0) fsi.filter[len-1] = '\000';
+      } else if ((ch >= ' ') && (ch < 127) && (len < FILE_SELECT_FILTER_LEN))
       {
-        if (file_strip_pathname(selected))
-        {
-          selitem = 0;
-          break;
-        }
-      }
-      if (ch == '\r')
+        fsi.filter[len] = ch;
+        fsi.filter[len+1] = '\000';
+      } else continue;
+      file_select_filter(&fsi);
+      selitem = 0;
+      continue;
+    }
+    ch = toupper(ch);
+    f = file_select_shown(&fsi, selitem);
+    if (ch == 'A')
+    {
+      if (selitem > 0) --selitem;
+    }
+    if (ch == 'B')
+    {
+      if (selitem < (fsi.shown-1)) ++selitem;
+    }
+    if ((ch == 'C') && (f != NULL) && (f->attrib & AM_DIR))
+    {
+      strcat_n(selected,"/",maxlen);
+      strcat_n(selected,file_select_name(&fsi, f),maxlen);
+      selitem = 0;
+      ok = file_select_open(&fsi, selected);
+    }
+    if ((ch == 'D') && (file_strip_pathname(selected)))
+    {
+      selitem = 0;
+      ok = file_select_open(&fsi, selected);
+    }
+    if (ch == 'S')
+    {
+      fsi.sort = (fsi.sort + 1) % FILE_SELECT_SORTS;
+      file_select_sort(&fsi);
+      selitem = 0;
+    }
+    if (ch == '/')
+      filtering = 1;
+    if (ch == '\r')
+    {
+      if (seldir || ((f != NULL) && !(f->attrib & AM_DIR)))
       {
-        if (seldir || (!(fse[selitem].attrib & AM_DIR) && (!seldir)))
+        if (!seldir)
         {
-          if (!seldir)
-          {
-            strcat_n(selected,"/",maxlen);
-            strcat_n(selected,fse[selitem].name,maxlen);
-          }
-          free(fse);
-          return (1);
+          strcat_n(selected,"/",maxlen);
+          strcat_n(selected,file_select_name(&fsi, f),maxlen);
         }
+        free(fsi.arena);
+        return (1);
       }
-      if (ch == 'Q')
-      {
-        free(fse);
-        return (0);
-      }
-    }    
+    }
+    if (ch == 'Q') break;
   }
+  free(fsi.arena);
+  return (0);
 }
 
 int file_select_ciphertext(const char *message, uint8_t seldir, char *selected, int maxlen)
@@ -340,17 +491,26 @@ int file_select_card(const char *message, char *filename, int maxlen, int seldir
   }
 }
 
-void file_count_lf(FIL *fil, FSIZE_t first_ofs, FSIZE_t last_ofs, FSIZE_t line_ofs[], int numofs, int cols, int maxlines)
+static int file_view_read_at(void *v, FSIZE_t ofs)
+{
+  FIL *fil = (FIL *)v;
+  unsigned char ch;
+  UINT readbytes;
+  if (f_tell(fil) != ofs) f_lseek(fil, ofs);
+  FRESULT res = f_read(fil, (void *) &ch, sizeof(ch), &readbytes);
+  if ((res != FR_OK) || (readbytes < 1)) return -1;
+  return ch;
+}
+
+void file_count_lf(file_view_source *src, FSIZE_t first_ofs, FSIZE_t last_ofs, FSIZE_t line_ofs[], int numofs, int cols, int maxlines)
 {
   int i, curcol=0;
+  FSIZE_t ofs = first_ofs;
   for (i=0;i<numofs;i++) line_ofs[i] = first_ofs;
-  f_lseek(fil, first_ofs);
   for (;;)
   {
-    unsigned char ch;
-    UINT readbytes;
-    FRESULT res = f_read(fil, (void *) &ch, sizeof(ch), &readbytes);
-    if ((readbytes < 1) || (f_tell(fil) >= last_ofs)) return;
+    int ch = src->read_at(src->state, ofs++);
+    if ((ch < 0) || (ofs >= last_ofs)) return;
     if ((ch >= ' ')&& (ch <= '~')) curcol++;
     if ((curcol >= cols) || (ch == '\n'))
     {
@@ -359,22 +519,19 @@ void file_count_lf(FIL *fil, FSIZE_t first_ofs, FSIZE_t last_ofs, FSIZE_t line_o
       {
         i--; line_ofs[i] = line_ofs[i-1];
       }
-      line_ofs[0] = f_tell(fil);
+      line_ofs[0] = ofs;
       if ((--maxlines) <= 0) return;
     }
   }
 }   
 
-void file_display_lines(FIL *fil, FSIZE_t ofs, int lines, int cols)
+void file_display_lines(file_view_source *src, FSIZE_t ofs, int lines, int cols)
 {
   int curcol = 0;
-  f_lseek(fil,ofs);
   for (;;)
   {
-    unsigned char ch;
-    UINT readbytes;
-    FRESULT res = f_read(fil, (void *) &ch, sizeof(ch), &readbytes);
-    if (readbytes < 1) return;
+    int ch = src->read_at(src->state, ofs++);
+    if (ch < 0) return;
     if ((ch >= ' ')&& (ch <= '~')) 
     {
       console_putch(ch);
@@ -391,38 +548,27 @@ void file_display_lines(FIL *fil, FSIZE_t ofs, int lines, int cols)
 
 #define FILE_VIEW_DISPLAY_MAXROWS 25
 
-void file_view_display(const char *filename, int rows, int cols)
+void file_view_source_display(const char *title, file_view_source *src, int rows, int cols)
 { 
-  FIL fil;
-  FRESULT fres;
   FSIZE_t line_ofs[FILE_VIEW_DISPLAY_MAXROWS];
   FSIZE_t current_offset = 0;
   int maxscreenchars = rows*cols;
 
   if (rows > FILE_VIEW_DISPLAY_MAXROWS) return;
-  fres = f_open(&fil, filename, FA_READ);
-  if (fres != FR_OK)
-  {
-    file_report_error("Could not open file");
-    return;
-  }
   for (;;)
   {
     console_clrscr();
     console_highvideo();
-    console_puts(filename);
+    console_puts(title);
     console_lowvideo();
     console_printcrlf();
     console_printcrlf();
-    file_display_lines(&fil, current_offset, rows, cols);
+    file_display_lines(src, current_offset, rows, cols);
     for (;;)
     {
       int ch = toupper(console_getch());
       if (ch == 'Q')
-      {
-        f_close(&fil);
         return;
-      }
       if (ch == 'A')
       {
          FSIZE_t new_offset;
@@ -430,15 +576,15 @@ void file_view_display(const char *filename, int rows, int cols)
             new_offset = 0;
          else
             new_offset = current_offset - maxscreenchars;
-         file_count_lf(&fil, new_offset, current_offset, line_ofs, rows, cols, maxscreenchars);
+         file_count_lf(src, new_offset, current_offset, line_ofs, rows, cols, maxscreenchars);
          current_offset = line_ofs[rows/2-1];
          break;        
       }
       if (ch == 'B')
       {
          FSIZE_t ahead_offset = current_offset + (rows*cols);
-         if (ahead_offset > f_size(&fil)) ahead_offset = f_size(&fil);
-         file_count_lf(&fil, current_offset, ahead_offset, line_ofs, rows, cols, rows/2);
+         if (ahead_offset > src->size) ahead_offset = src->size;
+         file_count_lf(src, current_offset, ahead_offset, line_ofs, rows, cols, rows/2);
          current_offset = line_ofs[0];
          break;        
       }
@@ -446,6 +592,25 @@ void file_view_display(const char *filename, int rows, int cols)
   }
 }
 
+void file_view_display(const char *filename, int rows, int cols)
+{ 
+  FIL fil;
+  FRESULT fres;
+  file_view_source src;
+
+  fres = f_open(&fil, filename, FA_READ);
+  if (fres != FR_OK)
+  {
+    file_report_error("Could not open file");
+    return;
+  }
+  src.state = (void *)&fil;
+  src.size = f_size(&fil);
+  src.read_at = file_view_read_at;
+  file_view_source_display(filename, &src, rows, cols);
+  f_close(&fil);
+}
+
 void file_view(void)
 {
   char filename[256];
@@ -520,58 +685,44 @@ int file_skip_header(FIL *f, const char *header, int term)
   return 0;
 }
 
-#define FILEBLOCKENCODE_WRITEBUF_SIZE 36
-
-typedef struct _fileblockencode
+/* Checks if the next line of the file is the header without moving past it */
+int file_at_header(FIL *f, const char *header, int term)
 {
-  uint8_t *read_buf;
-  uint16_t read_total;
-  uint16_t read_curpos;
-  FIL     *write_file;
-  uint8_t  write_buf[FILEBLOCKENCODE_WRITEBUF_SIZE];
-  uint16_t write_curpos;  
-} fileblockencode;
+  char matchline[80];
+  char line[80];
+  FSIZE_t ofs = f_tell(f);
+  int found;
 
-int fileblockencode_readdata(void *v)
-{
-  fileblockencode *f = (fileblockencode *)v;
-  if (f->read_curpos >= f->read_total) return -1;
-  return f->read_buf[f->read_curpos++];
+  file_create_header(header, term, matchline, sizeof(matchline)-1);
+  found = (file_getline(f, line, sizeof(line)-1)) && (!strcmp(line,matchline));
+  f_lseek(f, ofs);
+  return found;
 }
 
-int fileblockencode_writedata(int c, void *v)
-{
-  fileblockencode *f = (fileblockencode *)v;
-
-  if (c >= 0)
-    f->write_buf[f->write_curpos++] = c; 
-  if ((f->write_curpos == FILEBLOCKENCODE_WRITEBUF_SIZE) || (c < 0))
-  {
-    UINT br;
-    f_write(f->write_file,f->write_buf,f->write_curpos,&br);
-    f_write(f->write_file,"\n",1,&br);
-    f->write_curpos = 0;
-  }
-}
+#define FILEBLOCKENCODE_LINE_BYTES 27
 
 int file_write_block(FIL *f, const char *header, void *v, uint16_t len)
 {
-  fileblockencode *fs;
-
-  fs = (fileblockencode *) malloc(sizeof(fileblockencode));
-  if (fs == NULL) return 0;
+  const uint8_t *p = (const uint8_t *)v;
+  char line[BASE64_ENCODED_LEN(FILEBLOCKENCODE_LINE_BYTES)+1];
+  base64_state bs;
 
-  fs->read_buf = (uint8_t *)v;
-  fs->read_total = len;
-  fs->read_curpos = 0;
-  fs->write_file = f;
-  fs->write_curpos = 0;
-  
+  base64_state_init(&bs);
   file_write_header(f,header,0);
-  base64_encode(fileblockencode_readdata,(void *)fs,  fileblockencode_writedata, (void *)fs);  
-  fileblockencode_writedata(-1,fs);
+  for (;;)
+  {
+    UINT br;
+    uint16_t n = (len > FILEBLOCKENCODE_LINE_BYTES) ? FILEBLOCKENCODE_LINE_BYTES : len;
+    size_t l = base64_encode_span(&bs, p, n, line);
+    p += n;
+    len -= n;
+    if (n < FILEBLOCKENCODE_LINE_BYTES) 
+      l += base64_encode_final(&bs, &line[l]);
+    line[l++] = '\n';
+    f_write(f,line,l,&br);
+    if (l < sizeof(line)) break;
+  }
   file_write_header(f,header,1);
-  free(fs);
   return 1;
 }
 
@@ -579,81 +730,209 @@ int file_write_block(FIL *f, const char *header, void *v, uint16_t len)
 
 typedef struct _fileblockdecode
 {
-  FIL     *read_file;
-  FSIZE_t  read_last_block;
-  uint8_t  read_buf[FILEBLOCKDECODE_READBUF_SIZE];
-  uint16_t read_filled;
-  uint16_t read_curpos;
-  uint8_t *write_buf;
-  uint16_t write_curpos;  
-  uint16_t write_total;
-  uint16_t write_end;
+  char         read_buf[FILEBLOCKDECODE_READBUF_SIZE];
+  uint8_t      write_buf[BASE64_DECODED_LEN(FILEBLOCKDECODE_READBUF_SIZE)+2];
+  base64_state bs;
 } fileblockdecode;
 
-int fileblockdecode_readdata(void *v)
+int file_read_block(FIL *f, const char *header, void *v, uint16_t len)
 {
-  fileblockdecode *f = (fileblockdecode *)v;
-  
-  if (f->write_end) 
-  {
-    f_lseek(f->read_file, f->read_last_block);
-    return -1;
-  }
-  for (;;)
+  fileblockdecode *fd;
+  uint16_t write_curpos = 0;
+  int found = 0;
+
+  if (!file_skip_header(f,header,0)) return 0;
+  fd = (fileblockdecode *)malloc(sizeof(fileblockdecode));
+  if (fd == NULL) return 0;
+  base64_state_init(&fd->bs);
+  while (!found)
   {
-    if (f->read_curpos >= f->read_filled)
+    UINT br;
+    FSIZE_t read_block = f_tell(f);
+    FRESULT res = f_read(f,fd->read_buf,FILEBLOCKDECODE_READBUF_SIZE,&br);
+    if ((res != FR_OK) || (br == 0)) break;
+    char *dash = (char *)memchr(fd->read_buf,'-',br);
+    UINT n = (dash != NULL) ? (UINT)(dash - fd->read_buf) : br;
+    size_t dl = base64_decode_span(&fd->bs, fd->read_buf, n, fd->write_buf);
+    if (dash != NULL)
     {
-      UINT br;
-      f->read_last_block = f_tell(f->read_file);
-      FRESULT res = f_read(f->read_file,f->read_buf,FILEBLOCKDECODE_READBUF_SIZE,&br);
-      if ((res != FR_OK) || (br == 0)) return -1;
-      f->read_filled = br;
-      f->read_curpos = 0;
+      dl += base64_decode_final(&fd->bs, &fd->write_buf[dl]);
+      f_lseek(f, read_block + n);
+      found = 1;
     }
-    uint8_t ch = f->read_buf[f->read_curpos++];
-    if (is_base64_char(ch)) return ch;
+    if (dl > (size_t)(len - write_curpos)) dl = len - write_curpos;
+    memcpy((uint8_t *)v + write_curpos, fd->write_buf, dl);
+    write_curpos += dl;
   }
+  free(fd);
+  return found && file_skip_header(f,header,1);
+}
+    
+/* The card driver has no DMA, so the default backend reads when the read
+   is issued and the wait has nothing to do.  The latency backend models a
+   card that transfers in the background, taking file_read_latency_us for
+   each sector, so the benefit of overlapping can be measured without one. */
+
+static void file_read_sync_start(file_readahead *ra, uint8_t *buf)
+{
+  ra->res = f_read(ra->f, buf, FILE_READAHEAD_SIZE, &ra->filled[ra->cur ^ 1]);
 }
 
-int fileblockdecode_writedata(int c, void *v)
+static void file_read_sync_wait(file_readahead *ra)
 {
-  fileblockdecode *f = (fileblockdecode *)v;
+  (void)ra;
+}
+
+const file_read_backend file_read_backend_sync = { file_read_sync_start, file_read_sync_wait, 0 };
+
+uint32_t file_read_latency_us = 1000;
+
+static void file_read_latency_start(file_readahead *ra, uint8_t *buf)
+{
+  file_read_sync_start(ra, buf);
+  ra->due = micros() + file_read_latency_us * ((ra->filled[ra->cur ^ 1] + FF_MAX_SS - 1) / FF_MAX_SS);
+}
+
+static void file_read_latency_wait(file_readahead *ra)
+{
+  while ((int32_t)(ra->due - micros()) > 0);
+}
+
+const file_read_backend file_read_backend_latency = { file_read_latency_start, file_read_latency_wait, 1 };
+
+const file_read_backend *file_read_backend_default = &file_read_backend_sync;
+
+static void file_readahead_reset(file_readahead *ra)
+{
+  ra->buf[0] = ra->first;
+  ra->buf[1] = (ra->second != NULL) ? ra->second : ra->first;
+  ra->filled[0] = ra->filled[1] = 0;
+  ra->pos = 0;
+  ra->base = f_tell(ra->f);
+  ra->res = FR_OK;
+  ra->cur = 0;
+  ra->pending = 0;
+  ra->eof = 0;
+}
 
-  if (f->write_end) return 0;
-  if (c >= 0)
-    f->write_buf[f->write_curpos++] = c;
-  if (f->write_curpos >= f->write_total)
-    f->write_end = 1;
+void file_readahead_init(file_readahead *ra, FIL *f, uint8_t overlap)
+{
+  ra->f = f;
+  ra->backend = file_read_backend_default;
+  ra->second = NULL;
+  ra->overlap = overlap;
+  file_readahead_reset(ra);
+}
+
+static void file_readahead_start(file_readahead *ra)
+{
+  ra->backend->start(ra, ra->buf[ra->cur ^ 1]);
+  ra->pending = 1;
+}
+
+static void file_readahead_wait(file_readahead *ra)
+{
+  if (ra->pending)
+  {
+    ra->backend->wait(ra);
+    ra->pending = 0;
+  }
+}
+
+/* Whether the next read can be issued before the caller is done with the
+   current buffer.  A read that completes when it is issued gains nothing
+   from it, so the second buffer is only allocated for a background
+   backend, and without it the reader waits for the caller. */
+static int file_readahead_overlaps(file_readahead *ra)
+{
+  if ((!ra->overlap) || (!ra->backend->background)) return 0;
+  if (ra->second == NULL)
+  {
+    if ((ra->second = (uint8_t *)malloc(FILE_READAHEAD_SIZE)) == NULL) return 0;
+    ra->buf[ra->cur ^ 1] = ra->second;
+  }
   return 1;
 }
 
-int file_read_block(FIL *f, const char *header, void *v, uint16_t len)
+/* Makes the buffer being read the current buffer and issues the next read */
+static void file_readahead_next(file_readahead *ra)
 {
-  fileblockdecode *fd;
+  if (!ra->pending) file_readahead_start(ra);
+  file_readahead_wait(ra);
+  ra->base += ra->filled[ra->cur];
+  ra->cur ^= 1;
+  ra->pos = 0;
+  if ((ra->res != FR_OK) || (ra->filled[ra->cur] < FILE_READAHEAD_SIZE))
+    ra->eof = 1;
+  else if (file_readahead_overlaps(ra))
+    file_readahead_start(ra);
+}
 
-  fd = (fileblockdecode *)malloc(sizeof(fileblockdecode));
-  if (fd == NULL) return 0;
+/* Returns the number of bytes available without another read, reading if
+   there are none, and zero at the end of the file */
+UINT file_readahead_peek(file_readahead *ra, const uint8_t **data)
+{
+  if ((ra->pos == ra->filled[ra->cur]) && (!ra->eof))
+    file_readahead_next(ra);
+  *data = &ra->buf[ra->cur][ra->pos];
+  return ra->filled[ra->cur] - ra->pos;
+}
 
-  fd->read_file = f;
-  fd->read_filled = 0;
-  fd->read_curpos = 0;
-  fd->write_buf = (uint8_t *) v;
-  fd->write_total = len;
-  fd->write_curpos = 0;
-  fd->write_end = 0;
-  if (file_skip_header(f,header,0))
+void file_readahead_consume(file_readahead *ra, UINT len)
+{
+  ra->pos += len;
+}
+
+FRESULT file_readahead_read(file_readahead *ra, void *buf, UINT len, UINT *br)
+{
+  uint8_t *d = (uint8_t *)buf;
+  *br = 0;
+  while (len > 0)
   {
-    base64_decode(fileblockdecode_readdata,(void *)fd,  fileblockdecode_writedata, (void *)fd);
-    if (file_skip_header(f,header,1))
-     {
-        free(fd);
-        return 1;
-     }
+    const uint8_t *data;
+    UINT n = file_readahead_peek(ra, &data);
+    if (n == 0) break;
+    if (n > len) n = len;
+    memcpy(d, data, n);
+    file_readahead_consume(ra, n);
+    d += n;
+    len -= n;
+    *br += n;
   }
-  free(fd);
-  return 0;
+  return (*br > 0) ? FR_OK : ra->res;
 }
-    
+
+FSIZE_t file_readahead_tell(file_readahead *ra)
+{
+  return ra->base + ra->pos;
+}
+
+/* Discards what has been read ahead and repositions the file */
+void file_readahead_seek(file_readahead *ra, FSIZE_t ofs)
+{
+  file_readahead_wait(ra);
+  f_lseek(ra->f, ofs);
+  file_readahead_reset(ra);
+}
+
+/* Returns the file to the position the caller has read to */
+void file_readahead_sync(file_readahead *ra)
+{
+  file_readahead_seek(ra, file_readahead_tell(ra));
+}
+
+/* Releases the second buffer.  The reader may still be used afterwards. */
+void file_readahead_close(file_readahead *ra)
+{
+  file_readahead_wait(ra);
+  if (ra->second == NULL) return;
+  if (ra->buf[ra->cur] == ra->second)
+    memcpy(ra->first, ra->second, ra->filled[ra->cur]);
+  free(ra->second);
+  ra->second = NULL;
+  ra->buf[0] = ra->buf[1] = ra->first;
+}
+
 #ifdef __cplusplus
 }
 #endif  
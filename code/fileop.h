@@ -27,12 +27,75 @@ freely, subject to the following restrictions:
 extern "C" {
 #endif  
 
+/* A random-access byte source for the viewer.  read_at returns the byte at
+   ofs or -1 past the end of the source or on an error. */
+typedef struct _file_view_source
+{
+  void    *state;
+  FSIZE_t size;
+  int     (*read_at)(void *state, FSIZE_t ofs);
+} file_view_source;
+
+/* Double-buffered sequential reader.  While the caller works on the data in
+   one buffer, the read of the next buffer has already been issued through
+   the backend, so that a backend that completes reads in the background
+   (such as by DMA) overlaps the transfer with the caller's processing.  The
+   position of the underlying file is ahead of the caller's position until
+   file_readahead_seek or file_readahead_sync is called.  Only the first
+   buffer is held in the reader.  The second is allocated when overlap is
+   asked for and the backend reads in the background, and is released by
+   file_readahead_close; otherwise both buffers are the same. */
+
+#define FILE_READAHEAD_SIZE FF_MAX_SS
+
+typedef struct _file_readahead file_readahead;
+
+typedef struct _file_read_backend
+{
+  void    (*start)(file_readahead *ra, uint8_t *buf);
+  void    (*wait)(file_readahead *ra);
+  uint8_t background;
+} file_read_backend;
+
+struct _file_readahead
+{
+  FIL     *f;
+  const file_read_backend *backend;
+  uint8_t first[FILE_READAHEAD_SIZE];
+  uint8_t *second;
+  uint8_t *buf[2];
+  UINT    filled[2];
+  UINT    pos;
+  FSIZE_t base;
+  FRESULT res;
+  uint32_t due;
+  uint8_t cur;
+  uint8_t pending;
+  uint8_t overlap;
+  uint8_t eof;
+};
+
+extern const file_read_backend file_read_backend_sync;
+extern const file_read_backend file_read_backend_latency;
+extern const file_read_backend *file_read_backend_default;
+extern uint32_t file_read_latency_us;
+
+void file_readahead_init(file_readahead *ra, FIL *f, uint8_t overlap);
+FRESULT file_readahead_read(file_readahead *ra, void *buf, UINT len, UINT *br);
+UINT file_readahead_peek(file_readahead *ra, const uint8_t **data);
+void file_readahead_consume(file_readahead *ra, UINT len);
+FSIZE_t file_readahead_tell(file_readahead *ra);
+void file_readahead_seek(file_readahead *ra, FSIZE_t ofs);
+void file_readahead_sync(file_readahead *ra);
+void file_readahead_close(file_readahead *ra);
+
 void file_report_error(const char *error_message);
 void file_edit(void);
 void file_new(void);
 void file_mount_volume(uint8_t unmount);
 int file_select(const char *message, const char *dir, uint8_t seldir, char *selected, int maxlen);
 int file_select_card(const char *message, char *filename, int maxlen, int seldir);
+void file_view_source_display(const char *title, file_view_source *src, int rows, int cols);
 void file_view_display(const char *filename, int rows, int cols);
 void file_view(void);
 void file_delete(void);
@@ -41,6 +104,7 @@ int file_select_plaintext(const char *message,uint8_t seldir, char *selected, in
 int file_enter_filename(const char *message, char *filename, int len);
 void file_write_header(FIL *f, const char *header, int term);
 int file_skip_header(FIL *f, const char *header, int term);
+int file_at_header(FIL *f, const char *header, int term);
 int file_write_block(FIL *f, const char *header, void *v, uint16_t len);
 int file_read_block(FIL *f, const char *header, void *v, uint16_t len);
 
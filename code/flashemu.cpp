@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef __arm__
+
+#include <string.h>
+#include "flashemu.h"
+
+static uint8_t flashemu_mem[FLASHEMU_SIZE];
+static uint8_t flashemu_ready;
+static flashemu_stats flashemu_counts;
+static int32_t flashemu_power = -1;
+
+static uint8_t *flashemu_locate(void *flash_addr, uint32_t len)
+{
+  uintptr_t addr = (uintptr_t)flash_addr;
+  if (!flashemu_ready) flashemu_reset();
+  if ((addr < FLASHEMU_BASE) || ((addr - FLASHEMU_BASE + len) > FLASHEMU_SIZE))
+    return NULL;
+  return &flashemu_mem[addr - FLASHEMU_BASE];
+}
+
+void flashemu_reset(void)
+{
+  memset(flashemu_mem, 0xFF, sizeof(flashemu_mem));
+  memset(&flashemu_counts, '\000', sizeof(flashemu_counts));
+  flashemu_power = -1;
+  flashemu_ready = 1;
+}
+
+uint8_t *flashemu_memory(void)
+{
+  if (!flashemu_ready) flashemu_reset();
+  return flashemu_mem;
+}
+
+const flashemu_stats *flashemu_get_stats(void)
+{
+  return &flashemu_counts;
+}
+
+void flashemu_power_limit(int32_t halfwords)
+{
+  flashemu_power = halfwords;
+}
+
+int eraseflashpage(void *flash_page)
+{
+  uint8_t *p = flashemu_locate(flash_page, FLASHSTRUCT_PAGE_SIZE);
+  if ((p == NULL) || ((p - flashemu_mem) % FLASHSTRUCT_PAGE_SIZE) || (flashemu_power == 0))
+  {
+    flashemu_counts.refused++;
+    return 0;
+  }
+  memset(p, 0xFF, FLASHSTRUCT_PAGE_SIZE);
+  flashemu_counts.erases[(p - flashemu_mem) / FLASHSTRUCT_PAGE_SIZE]++;
+  return 1;
+}
+
+int programflash(void *flash_addr, const void *data, int len)
+{
+  uint8_t *p = flashemu_locate(flash_addr, (len+1) & ~1);
+  const uint8_t *bl = (const uint8_t *) data;
+  int c;
+
+  if ((p == NULL) || ((p - flashemu_mem) & 1))
+  {
+    flashemu_counts.refused++;
+    return 0;
+  }
+  for (c=0;c<len;c+=2)
+  {
+    if (flashemu_power == 0) return 0;
+    if (((p[c] != 0xFF) || (p[c+1] != 0xFF)) && ((bl[c] != 0) || (bl[c+1] != 0)))
+    {
+      flashemu_counts.refused++;
+      return 0;
+    }
+    p[c] = bl[c];
+    p[c+1] = bl[c+1];
+    flashemu_counts.programmed++;
+    if (flashemu_power > 0) flashemu_power--;
+  }
+  return 1;
+}
+
+void readflashbytes(void *flash_page, uint32_t offset, void *data, int len)
+{
+  uint8_t *p = flashemu_locate(((uint8_t *)flash_page) + offset, len);
+  if (p == NULL)
+    memset(data, 0xFF, len);
+  else
+    memcpy(data, p, len);
+}
+
+#endif  /* __arm__ */
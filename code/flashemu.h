@@ -0,0 +1,58 @@
+#ifndef _FLASHEMU_H
+#define _FLASHEMU_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdint.h>
+#include "flashstruct.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Off the device the flash holding the key store is emulated in memory.
+   Erasing sets a page to 0xFF and counts against the wear of that page.
+   Programming a halfword that is not erased fails unless it is programmed
+   to zero, as on the STM32F1.  A loss of power is emulated by limiting how
+   many more halfwords may be programmed, after which nothing more is
+   erased or programmed. */
+
+#define FLASHEMU_BASE 0x0801C000u
+#define FLASHEMU_PAGES 16
+#define FLASHEMU_SIZE (FLASHEMU_PAGES*FLASHSTRUCT_PAGE_SIZE)
+
+typedef struct _flashemu_stats
+{
+  uint32_t erases[FLASHEMU_PAGES];
+  uint32_t programmed;
+  uint32_t refused;
+} flashemu_stats;
+
+void flashemu_reset(void);
+uint8_t *flashemu_memory(void);
+const flashemu_stats *flashemu_get_stats(void);
+void flashemu_power_limit(int32_t halfwords);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _FLASHEMU_H */
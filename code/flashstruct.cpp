@@ -21,6 +21,10 @@ freely, subject to the following restrictions:
 #include "Arduino.h"
 #include <stdarg.h>
 #include "flashstruct.h"
+#include "checksum.h"
+#include "cyclecount.h"
+
+#ifdef __arm__
 
 #include "libmaple/util.h"
 #include "libmaple/flash.h"
@@ -28,13 +32,6 @@ freely, subject to the following restrictions:
 #define FLASH_KEY1      ((uint32_t)0x45670123)
 #define FLASH_KEY2      ((uint32_t)0xCDEF89AB)
 
-#define DEMCR           (*((volatile uint32_t *)0xE000EDFC))
-#define DWT_CTRL        (*(volatile uint32_t *)0xe0001000)
-#define CYCCNTENA       (1<<0)
-#define DWT_CYCCNT      ((volatile uint32_t *)0xE0001004)
-#define CPU_CYCLES      *DWT_CYCCNT
-#define DEMCR_TRCENA    0x01000000
-
 static int wait_flash_not_busy(void)
 {
   unsigned int inittime = CPU_CYCLES;
@@ -46,61 +43,95 @@ static int wait_flash_not_busy(void)
   return 0;
 }
 
-int writeflashstruct(void *flash_page, int num_blocks, void *blocks[], int blocklen[])
+static int unlock_flash(void)
 {
-  int err = 1;
-  __IO uint16_t *curloc = (uint16_t *) flash_page;
-  int n;
   //FLASH_Unlock
   FLASH_BASE->KEYR = FLASH_KEY1;
   FLASH_BASE->KEYR = FLASH_KEY2;
+  return wait_flash_not_busy();
+}
+
+/* Sets every byte of the page at flash_page to 0xFF */
+int eraseflashpage(void *flash_page)
+{
+  int err = unlock_flash();
+  if (err)
+  {
+    FLASH_BASE->CR |= FLASH_CR_PER; 
+    FLASH_BASE->AR = (unsigned int)flash_page;
+    FLASH_BASE->CR |= FLASH_CR_STRT;
+    err = wait_flash_not_busy();
+    FLASH_BASE->CR &= ~FLASH_CR_PER;
+  }
+  FLASH_BASE->CR |= FLASH_CR_LOCK;
+  return err;
+}
+
+/* Programs len bytes, rounded up to whole halfwords, at flash_addr.  Each
+   halfword must be erased unless it is programmed to zero. */
+int programflash(void *flash_addr, const void *data, int len)
+{
+  __IO uint16_t *curloc = (uint16_t *) flash_addr;
+  const uint8_t *bl = (const uint8_t *) data;
+  int err = unlock_flash();
+  int c;
 
-  err = wait_flash_not_busy(); 
-  for (n=0;(n<num_blocks) && (err != 0);n++)
+  for (c=0;(c<len) && (err != 0);c+=2)
   {
-    uint16_t *bl = (uint16_t *) blocks[n];
-    unsigned int shortlen = (blocklen[n]+1)/2;
-    unsigned int c;
-    for (c=0;(c<shortlen) && (err != 0);c++)
-    {
-      if ((((unsigned int)curloc) & 0x3FF) == 0)
-      {
-        FLASH_BASE->CR |= FLASH_CR_PER; 
-        FLASH_BASE->AR = (unsigned int)curloc;
-        FLASH_BASE->CR |= FLASH_CR_STRT;
-        err = wait_flash_not_busy();
-        FLASH_BASE->CR &= ~FLASH_CR_PER;
-      }
-      if (err)
-      {
-         FLASH_BASE->CR |= FLASH_CR_PG;
-         if (err = wait_flash_not_busy())
-            *curloc++ = bl[c];
-         FLASH_BASE->CR &= ~FLASH_CR_PG;
-      }
-    }
+    FLASH_BASE->CR |= FLASH_CR_PG;
+    *curloc++ = ((uint16_t)bl[c]) | (((uint16_t)bl[c+1]) << 8);
+    err = wait_flash_not_busy();
+    FLASH_BASE->CR &= ~FLASH_CR_PG;
   }
   FLASH_BASE->CR |= FLASH_CR_LOCK;
   return err;
 }
 
+/* Copies bytes from anywhere in a flash structure, without checking it */
+void readflashbytes(void *flash_page, uint32_t offset, void *data, int len)
+{
+  memcpy(data, ((uint8_t *)flash_page) + offset, len);
+}
+
+#else
+
+/* Elsewhere the flash is emulated in memory */
+#include "flashemu.h"
+
+#endif
+
+static uint32_t flash_crc32(void *flash_page, uint32_t len)
+{
+  uint8_t buf[32];
+  uint32_t crc = CHECKSUM_CRC32_INIT;
+  uint32_t offset, n;
+
+  for (offset=0;offset<len;offset+=n)
+  {
+    n = (len - offset) > sizeof(buf) ? sizeof(buf) : (len - offset);
+    readflashbytes(flash_page, offset, buf, n);
+    crc = checksum_crc32(crc, buf, n);
+  }
+  return crc;
+}
+
+/* Reads a key store in the old single structure format, which was written
+   as blocks followed by a CRC32 of them.  Returns zero if the CRC32 does
+   not match.  Flash written before the CRC was recorded is erased there
+   and is accepted. */
 int readflashstruct(void *flash_page, int num_blocks, void *blocks[], int blocklen[])
 {
-  int err = 1;
-  uint16_t *curloc = (uint16_t *) flash_page;
+  uint32_t offset = 0;
+  uint32_t crc, stored_crc;
   int n;
 
-  for (n=0;(n<num_blocks) & (err != 0);n++)
+  for (n=0;n<num_blocks;n++)
   {
-    uint16_t *bl = (uint16_t *) blocks[n];
-    unsigned int shortlen = (blocklen[n]+1)/2;
-    unsigned int c;
-    if (bl == NULL)
-       curloc += shortlen;
-    else
-    {
-       for (c=0;(c<shortlen) & (err != 0);c++) bl[c] = *curloc++;
-    }
+    if (blocks[n] != NULL)
+      readflashbytes(flash_page, offset, blocks[n], blocklen[n]);
+    offset += (blocklen[n]+1) & ~1;
   }
-  return err;
+  crc = flash_crc32(flash_page, offset);
+  readflashbytes(flash_page, offset, &stored_crc, sizeof(stored_crc));
+  return (stored_crc == 0xFFFFFFFFu) || (stored_crc == crc);
 }
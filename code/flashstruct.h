@@ -21,7 +21,12 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
  */
 
+/* Flash is erased a page at a time and programmed a halfword at a time */
+#define FLASHSTRUCT_PAGE_SIZE 1024
+
+int eraseflashpage(void *flash_page);
+int programflash(void *flash_addr, const void *data, int len);
 int readflashstruct(void *flash_page, int num_blocks, void *blocks[], int blocklen[]);
-int writeflashstruct(void *flash_page, int num_blocks, void *blocks[], int blocklen[]);
+void readflashbytes(void *flash_page, uint32_t offset, void *data, int len);
 
 #endif  /* _FLASHSTRUCT_H */
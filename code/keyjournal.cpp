@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+#include "flashstruct.h"
+#include "keyjournal.h"
+#include "checksum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KEYJOURNAL_ERASED_ITEM 0xFF
+
+static uint8_t kj_mounted;
+static uint8_t kj_head;
+static uint16_t kj_pos;
+static uint32_t kj_sequence[KEYJOURNAL_PAGES];
+static uint16_t kj_index[KEYJOURNAL_ITEMS];
+
+static void keyjournal_read_bytes(uint32_t offset, void *data, int len)
+{
+  readflashbytes((void *)KEYJOURNAL_ADDRESS, offset, data, len);
+}
+
+static int keyjournal_program(uint32_t offset, const void *data, int len)
+{
+  return programflash((void *)(uintptr_t)(KEYJOURNAL_ADDRESS + offset), data, len);
+}
+
+/* The erase count of a page, which is only trusted on pages of the journal
+   and on erased pages */
+static uint32_t keyjournal_erases(int page)
+{
+  keyjournal_page_header kph;
+  keyjournal_read_bytes(page*KEYJOURNAL_PAGE_SIZE, &kph, sizeof(kph));
+  if (((kph.id != KEYJOURNAL_ID) && (kph.id != 0xFFFF)) || (kph.erases == 0xFFFFFFFFu))
+    return 0;
+  return kph.erases;
+}
+
+static int keyjournal_erase(int page)
+{
+  uint32_t erases = keyjournal_erases(page) + 1;
+  kj_sequence[page] = 0;
+  if (!eraseflashpage((void *)(uintptr_t)(KEYJOURNAL_ADDRESS + page*KEYJOURNAL_PAGE_SIZE))) return 0;
+  return keyjournal_program(page*KEYJOURNAL_PAGE_SIZE + offsetof(keyjournal_page_header, erases), &erases, sizeof(erases));
+}
+
+static int keyjournal_free_pages(void)
+{
+  int n, count = 0;
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+    if (kj_sequence[n] == 0) count++;
+  return count;
+}
+
+/* The page with the lowest sequence number above after, or -1 */
+static int keyjournal_next_page(uint32_t after)
+{
+  int n, page = -1;
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+    if ((kj_sequence[n] > after) && ((page < 0) || (kj_sequence[n] < kj_sequence[page])))
+      page = n;
+  return page;
+}
+
+/* Starts a new page after the newest, choosing the erased page that has
+   been erased the fewest times.  The page id is programmed last so that a
+   page that was not finished reads as erased. */
+static int keyjournal_open(void)
+{
+  keyjournal_page_header kph;
+  uint8_t buf[32];
+  uint32_t offset, erases, least = 0xFFFFFFFFu;
+  int n, page = -1;
+
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+  {
+    if (kj_sequence[n] != 0) continue;
+    erases = keyjournal_erases(n);
+    if (erases < least)
+    {
+      least = erases;
+      page = n;
+    }
+  }
+  if (page < 0) return 0;
+  for (offset=offsetof(keyjournal_page_header, id);offset<KEYJOURNAL_PAGE_SIZE;offset+=sizeof(buf))
+  {
+    keyjournal_read_bytes(page*KEYJOURNAL_PAGE_SIZE + offset, buf, sizeof(buf));
+    for (n=0;(n<(int)sizeof(buf)) && (buf[n] == 0xFF);n++);
+    if (n < (int)sizeof(buf)) break;
+  }
+  if ((offset < KEYJOURNAL_PAGE_SIZE) && (!keyjournal_erase(page))) return 0;
+  kph.sequence = kj_sequence[kj_head] + 1;
+  kph.vers = KEYJOURNAL_VERSION;
+  kph.id = KEYJOURNAL_ID;
+  offset = page*KEYJOURNAL_PAGE_SIZE;
+  if (!keyjournal_program(offset + offsetof(keyjournal_page_header, sequence), &kph.sequence, sizeof(kph.sequence))) return 0;
+  if (!keyjournal_program(offset + offsetof(keyjournal_page_header, vers), &kph.vers, sizeof(kph.vers))) return 0;
+  if (!keyjournal_program(offset + offsetof(keyjournal_page_header, id), &kph.id, sizeof(kph.id))) return 0;
+  kj_sequence[page] = kph.sequence;
+  kj_head = page;
+  kj_pos = sizeof(keyjournal_page_header);
+  return 1;
+}
+
+/* The checksum of a record, over its item, tag, length and data */
+static uint32_t keyjournal_crc(const keyjournal_record *kr, const void *data)
+{
+  uint32_t crc = checksum_crc32(CHECKSUM_CRC32_INIT, kr, offsetof(keyjournal_record, crc));
+  return checksum_crc32(crc, data, kr->len);
+}
+
+/* Reads the record at offset, whose length has been checked, returning
+   zero if it does not match its checksum */
+static int keyjournal_read_record(uint32_t offset, keyjournal_record *kr, uint8_t *data)
+{
+  keyjournal_read_bytes(offset, kr, sizeof(*kr));
+  keyjournal_read_bytes(offset + sizeof(*kr), data, kr->len);
+  return keyjournal_crc(kr, data) == kr->crc;
+}
+
+/* Indexes the committed records of a page, returning the offset after the
+   last record.  The length of a record is programmed first, so a record
+   that was cut short can be stepped over.  A damaged length fills the rest
+   of the page. */
+static uint16_t keyjournal_scan_page(int page)
+{
+  keyjournal_record kr;
+  uint8_t buf[KEYJOURNAL_MAX_DATA];
+  uint16_t pos = sizeof(keyjournal_page_header);
+  uint16_t commit;
+
+  while ((pos + KEYJOURNAL_RECORD_SIZE(0)) <= KEYJOURNAL_PAGE_SIZE)
+  {
+    keyjournal_read_bytes(page*KEYJOURNAL_PAGE_SIZE + pos, &kr, sizeof(kr));
+    if ((kr.item == KEYJOURNAL_ERASED_ITEM) && (kr.tag == 0xFF) && (kr.len == 0xFFFF)) break;
+    if ((kr.len > KEYJOURNAL_MAX_DATA) || ((pos + KEYJOURNAL_RECORD_SIZE(kr.len)) > KEYJOURNAL_PAGE_SIZE))
+      return KEYJOURNAL_PAGE_SIZE;
+    keyjournal_read_bytes(page*KEYJOURNAL_PAGE_SIZE + pos + KEYJOURNAL_RECORD_SIZE(kr.len) - sizeof(commit), &commit, sizeof(commit));
+    if ((commit == KEYJOURNAL_COMMIT) && (kr.item < KEYJOURNAL_ITEMS) &&
+        keyjournal_read_record(page*KEYJOURNAL_PAGE_SIZE + pos, &kr, buf))
+      kj_index[kr.item] = page*KEYJOURNAL_PAGE_SIZE + pos;
+    pos += KEYJOURNAL_RECORD_SIZE(kr.len);
+  }
+  memset(buf, '\000', sizeof(buf));
+  return pos;
+}
+
+/* Finds the pages of the journal and the newest record of each item,
+   returning zero if the flash does not hold a journal */
+int keyjournal_mount(void)
+{
+  keyjournal_page_header kph;
+  int n, page;
+
+  kj_mounted = 0;
+  for (n=0;n<KEYJOURNAL_ITEMS;n++) kj_index[n] = KEYJOURNAL_NONE;
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+  {
+    keyjournal_read_bytes(n*KEYJOURNAL_PAGE_SIZE, &kph, sizeof(kph));
+    kj_sequence[n] = ((kph.id == KEYJOURNAL_ID) && (kph.vers == KEYJOURNAL_VERSION) && (kph.sequence != 0xFFFFFFFFu)) ? kph.sequence : 0;
+  }
+  for (page=keyjournal_next_page(0);page>=0;page=keyjournal_next_page(kj_sequence[page]))
+  {
+    kj_head = page;
+    kj_pos = keyjournal_scan_page(page);
+    kj_mounted = 1;
+  }
+  return kj_mounted;
+}
+
+/* Erases every page and starts an empty journal */
+int keyjournal_format(void)
+{
+  int n;
+  kj_mounted = 0;
+  for (n=0;n<KEYJOURNAL_ITEMS;n++) kj_index[n] = KEYJOURNAL_NONE;
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+    if (!keyjournal_erase(n)) return 0;
+  kj_head = 0;
+  if (!keyjournal_open()) return 0;
+  kj_mounted = 1;
+  return 1;
+}
+
+/* Copies up to len bytes of the newest record of an item and returns its
+   length, which is zero if the item has no record or was erased, or -1 if
+   the record no longer matches its checksum */
+int keyjournal_read(int item, uint8_t *tag, void *data, int len)
+{
+  keyjournal_record kr;
+  uint8_t buf[KEYJOURNAL_MAX_DATA];
+  if ((!kj_mounted) || (kj_index[item] == KEYJOURNAL_NONE)) return 0;
+  if (!keyjournal_read_record(kj_index[item], &kr, buf))
+    len = -1;
+  else
+  {
+    if (tag != NULL) *tag = kr.tag;
+    memcpy(data, buf, kr.len < len ? kr.len : len);
+    len = kr.len;
+  }
+  memset(buf, '\000', sizeof(buf));
+  return len;
+}
+
+static int keyjournal_victim(uint32_t max_live);
+static int keyjournal_compact_page(int page);
+
+/* Appends a record with its checksum, opening new pages while more than
+   reserve pages are erased and otherwise compacting the page with the
+   least current data to make room */
+static int keyjournal_append(const keyjournal_record *kr, const void *data, int reserve)
+{
+  uint32_t offset;
+  uint16_t last, commit = KEYJOURNAL_COMMIT;
+  int compactions = 0, page, len = kr->len;
+
+  while ((kj_pos + KEYJOURNAL_RECORD_SIZE(len)) > KEYJOURNAL_PAGE_SIZE)
+  {
+    if (keyjournal_free_pages() > reserve)
+    {
+      if (!keyjournal_open()) return 0;
+    } else if ((reserve == 0) || (++compactions > KEYJOURNAL_PAGES) ||
+               ((page = keyjournal_victim(KEYJOURNAL_PAGE_SIZE)) < 0) || (!keyjournal_compact_page(page)))
+      return 0;
+  }
+  offset = kj_head*KEYJOURNAL_PAGE_SIZE + kj_pos;
+  kj_pos += KEYJOURNAL_RECORD_SIZE(len);
+  if (!keyjournal_program(offset + offsetof(keyjournal_record, len), &kr->len, sizeof(kr->len))) return 0;
+  if (!keyjournal_program(offset, kr, offsetof(keyjournal_record, len))) return 0;
+  if (!keyjournal_program(offset + offsetof(keyjournal_record, crc), &kr->crc, sizeof(kr->crc))) return 0;
+  if (!keyjournal_program(offset + sizeof(*kr), data, len & ~1)) return 0;
+  if (len & 1)
+  {
+    last = ((const uint8_t *)data)[len-1] | 0xFF00;
+    if (!keyjournal_program(offset + sizeof(*kr) + len - 1, &last, sizeof(last))) return 0;
+  }
+  if (!keyjournal_program(offset + KEYJOURNAL_RECORD_SIZE(len) - sizeof(commit), &commit, sizeof(commit))) return 0;
+  kj_index[kr->item] = offset;
+  return 1;
+}
+
+/* The page other than the newest with the least current data, the oldest
+   of those with the same, or -1 if every such page holds more than
+   max_live bytes */
+static int keyjournal_victim(uint32_t max_live)
+{
+  keyjournal_record kr;
+  uint32_t live[KEYJOURNAL_PAGES];
+  int n, page = -1;
+
+  memset(live, '\000', sizeof(live));
+  for (n=0;n<KEYJOURNAL_ITEMS;n++)
+  {
+    if (kj_index[n] == KEYJOURNAL_NONE) continue;
+    keyjournal_read_bytes(kj_index[n], &kr, sizeof(kr));
+    live[kj_index[n] / KEYJOURNAL_PAGE_SIZE] += KEYJOURNAL_RECORD_SIZE(kr.len);
+  }
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+  {
+    if ((kj_sequence[n] == 0) || (n == kj_head) || (live[n] > max_live)) continue;
+    if ((page < 0) || (live[n] < live[page]) || ((live[n] == live[page]) && (kj_sequence[n] < kj_sequence[page])))
+      page = n;
+  }
+  return page;
+}
+
+/* Copies the current records of a page to the newest page and erases it.
+   An erased item whose newest record is on the oldest page has no older
+   record left, so that record is dropped. */
+static int keyjournal_compact_page(int page)
+{
+  keyjournal_record kr;
+  uint8_t buf[KEYJOURNAL_MAX_DATA];
+  uint16_t pos = sizeof(keyjournal_page_header);
+  uint32_t offset;
+  int oldest = (page == keyjournal_next_page(0));
+
+  while ((pos + KEYJOURNAL_RECORD_SIZE(0)) <= KEYJOURNAL_PAGE_SIZE)
+  {
+    offset = page*KEYJOURNAL_PAGE_SIZE + pos;
+    keyjournal_read_bytes(offset, &kr, sizeof(kr));
+    if ((kr.len > KEYJOURNAL_MAX_DATA) || ((pos + KEYJOURNAL_RECORD_SIZE(kr.len)) > KEYJOURNAL_PAGE_SIZE)) break;
+    if ((kr.item < KEYJOURNAL_ITEMS) && (kj_index[kr.item] == offset))
+    {
+      if ((kr.len == 0) && oldest)
+        kj_index[kr.item] = KEYJOURNAL_NONE;
+      else
+      {
+        keyjournal_read_bytes(offset + sizeof(kr), buf, kr.len);
+        if (!keyjournal_append(&kr, buf, 0)) return 0;
+      }
+    }
+    pos += KEYJOURNAL_RECORD_SIZE(kr.len);
+  }
+  memset(buf, '\000', sizeof(buf));
+  return keyjournal_erase(page);
+}
+
+/* A compaction cut short after it opened the last erased page leaves no
+   page erased, and compacting needs one.  The current records left on the
+   page it was copying fit in what is left of the newest page, so before
+   anything else is written the page whose current records fit there is
+   compacted. */
+static int keyjournal_recover(void)
+{
+  int page;
+  if (keyjournal_free_pages() > 0) return 1;
+  if ((page = keyjournal_victim(KEYJOURNAL_PAGE_SIZE - kj_pos)) < 0) return 0;
+  return keyjournal_compact_page(page);
+}
+
+/* Writes a new version of an item.  A length of zero erases it. */
+int keyjournal_write(int item, uint8_t tag, const void *data, int len)
+{
+  keyjournal_record kr;
+  if ((!kj_mounted) || (len > KEYJOURNAL_MAX_DATA)) return 0;
+  if ((len == 0) && (kj_index[item] == KEYJOURNAL_NONE)) return 1;
+  if (!keyjournal_recover()) return 0;
+  kr.item = item;
+  kr.tag = tag;
+  kr.len = len;
+  kr.crc = keyjournal_crc(&kr, data);
+  return keyjournal_append(&kr, data, 1);
+}
+
+/* A page holding records that are never superseded is never compacted,
+   so it is not worn while the other pages are.  The page other than the
+   newest that has been erased the fewest times is returned once it falls
+   KEYJOURNAL_WEAR_SPREAD erases behind the most worn page, or -1. */
+static int keyjournal_cold_page(void)
+{
+  uint32_t erases, most = 0, least = 0xFFFFFFFFu;
+  int n, page = -1;
+
+  for (n=0;n<KEYJOURNAL_PAGES;n++)
+  {
+    erases = keyjournal_erases(n);
+    if (erases > most) most = erases;
+    if ((kj_sequence[n] != 0) && (n != kj_head) && (erases < least))
+    {
+      least = erases;
+      page = n;
+    }
+  }
+  return ((page >= 0) && ((most - least) > KEYJOURNAL_WEAR_SPREAD)) ? page : -1;
+}
+
+/* Once fewer than KEYJOURNAL_SPARE_PAGES are erased, compacts pages that
+   are at least half superseded until there are that many again, so that
+   the next writes seldom wait for compaction, and then a page that has
+   fallen behind in wear */
+int keyjournal_compact(void)
+{
+  int tries, page;
+  if ((!kj_mounted) || (!keyjournal_recover())) return 0;
+  if (keyjournal_free_pages() >= KEYJOURNAL_SPARE_PAGES) return 1;
+  for (tries=0;(tries<KEYJOURNAL_PAGES) && (keyjournal_free_pages() < KEYJOURNAL_SPARE_PAGES);tries++)
+  {
+    if ((page = keyjournal_victim(KEYJOURNAL_PAGE_SPACE/2)) < 0) break;
+    if (!keyjournal_compact_page(page)) return 0;
+  }
+  if ((page = keyjournal_cold_page()) >= 0) return keyjournal_compact_page(page);
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+#ifndef _KEYJOURNAL_H
+#define _KEYJOURNAL_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "keymanager.h"
+#include "flashstruct.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The key store is kept in flash as a journal of records appended to its
+   pages, so that changing one key programs a few halfwords and erases
+   nothing.  Each record holds a new version of an item, the store header,
+   one key slot or the keyring key, and the newest version of each item is
+   the current one.  A record is the item number, a tag byte for the
+   caller, the length, a CRC32 of those and the data, the data and a commit
+   marker programmed last.  A record without its marker was cut short and
+   is ignored, and one that does not match its CRC32 when the journal is
+   mounted is ignored too, leaving the version before it current.
+   Compaction copies a record with its CRC32 as it is.  Each page
+   begins with the number of times it has been erased and the sequence
+   number given to it when it was opened, which orders the records of
+   different pages.  A new page is the erased page with the fewest erases.
+   When only a few pages are left erased, the page with the least current
+   data is compacted by copying its current records to the newest page and
+   erasing it.
+
+   The journal takes the last 16KB of the flash: the eight pages of the
+   store written before the journal and the eight pages below them, so the
+   sketch must stay below 112KB.  That holds KEY_NUMBER private keys with
+   the pages compaction needs to spare. */
+
+#define KEYJOURNAL_ADDRESS (KEYMANAGER_FLASH_STORAGE_ADDRESS-8*KEYJOURNAL_PAGE_SIZE)
+#define KEYJOURNAL_PAGES 16
+#define KEYJOURNAL_PAGE_SIZE FLASHSTRUCT_PAGE_SIZE
+#define KEYJOURNAL_ID 0xAA33
+#define KEYJOURNAL_VERSION 0x1001
+#define KEYJOURNAL_COMMIT 0x5AA5
+#define KEYJOURNAL_ITEMS (KEY_NUMBER+2)
+#define KEYJOURNAL_NONE 0xFFFF
+
+/* Pages kept erased between sessions, one more than compaction needs */
+#define KEYJOURNAL_SPARE_PAGES 2
+
+/* Erases a page may fall behind the most worn page before its records are
+   moved so that it is worn too */
+#define KEYJOURNAL_WEAR_SPREAD 16
+
+#define KEYJOURNAL_MAX_DATA 120
+#define KEYJOURNAL_RECORD_SIZE(len) (sizeof(keyjournal_record)+(((len)+1)&~1)+sizeof(uint16_t))
+#define KEYJOURNAL_PAGE_SPACE (KEYJOURNAL_PAGE_SIZE-sizeof(keyjournal_page_header))
+
+/* The total size of the current records that can always be kept, leaving
+   for each page room for a record that does not fit at its end, and for an
+   erased record of every item */
+#define KEYJOURNAL_CAPACITY ((KEYJOURNAL_PAGES-1)*(KEYJOURNAL_PAGE_SPACE-KEYJOURNAL_RECORD_SIZE(KEYJOURNAL_MAX_DATA)) \
+                             - KEYJOURNAL_RECORD_SIZE(KEYJOURNAL_MAX_DATA) - KEYJOURNAL_ITEMS*KEYJOURNAL_RECORD_SIZE(0))
+
+typedef struct _keyjournal_page_header
+{
+  uint32_t erases;
+  uint16_t id;
+  uint16_t vers;
+  uint32_t sequence;
+} keyjournal_page_header;
+
+typedef struct _keyjournal_record
+{
+  uint8_t  item;
+  uint8_t  tag;
+  uint16_t len;
+  uint32_t crc;
+} keyjournal_record;
+
+int keyjournal_mount(void);
+int keyjournal_format(void);
+int keyjournal_read(int item, uint8_t *tag, void *data, int len);
+int keyjournal_write(int item, uint8_t tag, const void *data, int len);
+int keyjournal_compact(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _KEYJOURNAL_H */
@@ -29,6 +29,8 @@
 #include "keymanager.h"
 #include "random.h"
 #include "flashstruct.h"
+#include "keyjournal.h"
+#include "checksum.h"
 
 #define USE_MINIPRINTF
 
@@ -48,11 +50,171 @@ key_entry current_key_private;
 key_entry current_key_public;
 
 static uint8_t passphrase_hash[KEYMANAGER_HASHLEN];
-static key_storage *ks = NULL;
+static key_storage_header ks_hdr;
+static uint8_t ks_loaded;
+static aes256_gcm_context *ks_cipher = NULL;
+static uint8_t ks_migrate;
+static uint8_t ks_journal;
+static uint8_t ks_keyring[KEY_KEYRING_RECORD_LEN];
+static uint8_t ks_keyring_valid;
+static uint8_t ks_keyring_dirty;
 
-int keymanager_compute_secret(uint8_t *secret, int *secretlen)
+/* An open addressing hash index of the fingerprints of the public keys in
+   the store, built when it is first needed after the store is read and
+   rebuilt after a key changes.  A position holds the slot plus one, or zero
+   if free, and more bits of the fingerprint to check before the slot is
+   decrypted. */
+#define KEYMANAGER_FP_INDEX_SIZE 128
+static uint8_t ks_fp_slot[KEYMANAGER_FP_INDEX_SIZE];
+static uint16_t ks_fp_check[KEYMANAGER_FP_INDEX_SIZE];
+static uint8_t ks_fp_valid;
+
+/* The header is journaled without the slot types, which are the tags of
+   the slot records.  The wrapped keyring key follows the slots. */
+#define KEYMANAGER_JOURNAL_HEADER_LEN offsetof(key_storage_header, types)
+#define KEYMANAGER_KEYRING_ITEM (KEY_NUMBER+1)
+#define KEYMANAGER_MAX_RECORD_LEN (KEY_RECORD_COUNTER_LEN+KEY_DESCRIPTION_LEN+sizeof(key_storage_private)+AES_GCM_TAG_LENGTH)
+static uint32_t kdf_iterations = KEY_DERIVATION_HASHES;
+
+/* Shared secrets computed this session, by private key slot and the public
+   keys of both sides, so that repeated operations with the same
+   correspondent skip the scalar multiplication */
+#define KEYMANAGER_SECRET_CACHE_ENTRIES 4
+#define KEYMANAGER_SECRET_CACHE_TIMEOUT 300000u
+
+typedef struct _keymanager_secret_cache_entry
+{
+  uint8_t  valid;
+  uint8_t  slot;
+  uint32_t last_used;
+  uint8_t  private_public_key[KEYMANAGER_PUBLICKEY_LEN];
+  uint8_t  public_key[KEYMANAGER_PUBLICKEY_LEN];
+  uint8_t  secret[KEYMANAGER_PUBLICKEY_LEN];
+} keymanager_secret_cache_entry;
+
+static keymanager_secret_cache_entry secret_cache[KEYMANAGER_SECRET_CACHE_ENTRIES];
+static uint32_t secret_cache_uses;
+static uint8_t current_key_private_slot;
+
+void keymanager_clear_secret_cache(void)
+{
+  memset((void *)secret_cache,'\000',sizeof(secret_cache));
+  secret_cache_uses = 0;
+}
+
+/* The header of the store stays in memory, unlocked, between sessions with
+   the key manager so that coming back to it does not read and check it
+   again.  The records are read from the journal when a key is needed.  It
+   is cleared when the console has been idle this long or when the
+   passphrase is invalidated. */
+#define KEYMANAGER_SESSION_TIMEOUT 600000u
+
+/* Clears the store kept between sessions, unless a session is using it */
+static void keymanager_release_cache(void)
+{
+  if (ks_cipher != NULL) return;
+  memset(&ks_hdr, '\000', sizeof(ks_hdr));
+  ks_loaded = 0;
+  memset(ks_keyring, '\000', sizeof(ks_keyring));
+  memset(ks_fp_slot, '\000', sizeof(ks_fp_slot));
+  memset(ks_fp_check, '\000', sizeof(ks_fp_check));
+  ks_fp_valid = 0;
+}
+
+/* The heap is kept this far below the stack, enough for the deepest file
+   operation with its FIL and the compressor's buffers on the stack.  An
+   allocation that would leave less fails as if the heap were full, rather
+   than letting the stack grow into the heap later. */
+#define KEYMANAGER_HEAP_HEADROOM 2048
+
+/* Whether the heap can grow by len bytes and keep its headroom below the
+   stack.  The distance is only known on the device. */
+int keymanager_heap_room(size_t len)
+{
+#ifdef __arm__
+  return heap_stack_distance() >= (int)(len + KEYMANAGER_HEAP_HEADROOM);
+#else
+  (void)len;
+  return 1;
+#endif
+}
+
+/* Allocates memory for the key manager and file operations, keeping the
+   heap headroom */
+void *keymanager_malloc(size_t len)
+{
+  void *p = malloc(len);
+  if ((p != NULL) && (!keymanager_heap_room(0)))
+  {
+    free(p);
+    p = NULL;
+  }
+  return p;
+}
+
+/* Clears the store and the passphrase hash, so the passphrase must be
+   entered again */
+void keymanager_lock(void)
+{
+  keymanager_release_cache();
+  memset(passphrase_hash,'\000',sizeof(passphrase_hash));
+  active_key = 0;
+}
+
+static void keymanager_idle(void)
+{
+  unsigned long idle = console_idle_time();
+  if ((secret_cache_uses != 0) && (idle >= KEYMANAGER_SECRET_CACHE_TIMEOUT))
+    keymanager_clear_secret_cache();
+  if (active_key && (ks_cipher == NULL) && (idle >= KEYMANAGER_SESSION_TIMEOUT))
+    keymanager_lock();
+}
+
+static keymanager_secret_cache_entry *keymanager_find_secret(const uint8_t *public_key)
+{
+  keymanager_secret_cache_entry *sce = NULL;
+  for (int i=0;i<KEYMANAGER_SECRET_CACHE_ENTRIES;i++)
+  {
+    keymanager_secret_cache_entry *c = &secret_cache[i];
+    if ((c->valid) && (c->slot == current_key_private_slot) &&
+        (!memcmp(c->private_public_key, current_key_private.ksu.priv.public_key, KEYMANAGER_PUBLICKEY_LEN)) &&
+        (!memcmp(c->public_key, public_key, KEYMANAGER_PUBLICKEY_LEN)))
+    {
+      c->last_used = ++secret_cache_uses;
+      return c;
+    }
+    if ((sce == NULL) || (!c->valid) || ((sce->valid) && (c->last_used < sce->last_used))) sce = c;
+  }
+  sce->valid = 0;
+  return sce;
+}
+
+/* Computes the shared secret of the selected private key and a public key */
+int keymanager_compute_shared_secret(const uint8_t *public_key, uint8_t *secret, int *secretlen)
 {
   uint8_t temp_private_key[KEYMANAGER_PUBLICKEY_LEN];
+  if (current_key_private.entry_type != KEY_TYPE_ECDH_PRIVATE) return 0;
+  *secretlen = KEYMANAGER_PUBLICKEY_LEN;
+  keymanager_secret_cache_entry *sce = keymanager_find_secret(public_key);
+  if (sce->valid)
+  {
+    memcpy((void *)secret, (void *)sce->secret, KEYMANAGER_PUBLICKEY_LEN);
+    return 1;
+  }
+  memcpy((void *)secret, (void *)public_key, KEYMANAGER_PUBLICKEY_LEN);
+  memcpy((void *)temp_private_key, (void *)current_key_private.ksu.priv.private_key, KEYMANAGER_PUBLICKEY_LEN);
+  if (!Curve25519::dh2(secret, temp_private_key)) return 0;
+  sce->valid = 1;
+  sce->slot = current_key_private_slot;
+  sce->last_used = ++secret_cache_uses;
+  memcpy((void *)sce->private_public_key, (void *)current_key_private.ksu.priv.public_key, KEYMANAGER_PUBLICKEY_LEN);
+  memcpy((void *)sce->public_key, (void *)public_key, KEYMANAGER_PUBLICKEY_LEN);
+  memcpy((void *)sce->secret, (void *)secret, KEYMANAGER_PUBLICKEY_LEN);
+  return 1;
+}
+
+int keymanager_compute_secret(uint8_t *secret, int *secretlen)
+{
   if (current_key_private.entry_type == KEY_TYPE_AES)
   {
     *secretlen = sizeof(current_key_private.ksu.sym.symmetric_key);
@@ -60,41 +222,478 @@ int keymanager_compute_secret(uint8_t *secret, int *secretlen)
     return 1;
   }
   if ((current_key_private.entry_type != KEY_TYPE_ECDH_PRIVATE) && (current_key_public.entry_type != KEY_TYPE_ECDH_PUBLIC)) return 0;
-  *secretlen = sizeof(current_key_public.ksu.pub.public_key);
-  memcpy((void *)secret, (void *) &current_key_public.ksu.pub.public_key, sizeof(current_key_public.ksu.pub.public_key));
-  memcpy((void *)temp_private_key, (void *)current_key_private.ksu.priv.private_key, KEYMANAGER_PUBLICKEY_LEN);
-  return Curve25519::dh2(secret, temp_private_key);
+  return keymanager_compute_shared_secret(current_key_public.ksu.pub.public_key, secret, secretlen);
 }
 
 void keymanager_initialize(void)
 {
-  active_key = 0;
+  keymanager_lock();
   current_key_public.entry_type = current_key_private.entry_type = KEY_TYPE_EMPTY;
+  keymanager_clear_secret_cache();
+  console_set_idle(keymanager_idle);
+}
+
+/* The length of the key material of a type of key */
+uint16_t keymanager_key_len(uint8_t type)
+{
+  if (type == KEY_TYPE_ECDH_PRIVATE) return sizeof(key_storage_private);
+  if ((type == KEY_TYPE_AES) || (type == KEY_TYPE_ECDH_PUBLIC)) return KEYMANAGER_SYMMETRICKEY_LEN;
+  return 0;
+}
+
+uint16_t keymanager_record_len(uint8_t type)
+{
+  if (type == KEY_TYPE_EMPTY) return 0;
+  return KEY_RECORD_COUNTER_LEN + KEY_DESCRIPTION_LEN + keymanager_key_len(type) + AES_GCM_TAG_LENGTH;
+}
+
+/* The offset of the record of a slot in a store written before the
+   journal, where the records are packed in slot order */
+uint16_t keymanager_record_offset(int slot)
+{
+  uint16_t offset = 0;
+  for (int i=0;i<slot;i++) offset += keymanager_record_len(ks_hdr.types[i]);
+  return offset;
+}
+
+void keymanager_record_nonce(uint8_t *nonce, uint8_t slot, uint32_t counter)
+{
+  memset(nonce, '\000', AES_GCM_IV_LENGTH);
+  nonce[0] = slot;
+  nonce[8] = (uint8_t)(counter >> 24);
+  nonce[9] = (uint8_t)(counter >> 16);
+  nonce[10] = (uint8_t)(counter >> 8);
+  nonce[11] = (uint8_t)counter;
+}
+
+uint32_t keymanager_get_counter(const uint8_t *rec)
+{
+  return rec[0] | (((uint32_t)rec[1]) << 8) | (((uint32_t)rec[2]) << 16) | (((uint32_t)rec[3]) << 24);
+}
+
+void keymanager_put_counter(uint8_t *rec, uint32_t counter)
+{
+  rec[0] = (uint8_t)counter;
+  rec[1] = (uint8_t)(counter >> 8);
+  rec[2] = (uint8_t)(counter >> 16);
+  rec[3] = (uint8_t)(counter >> 24);
+}
+
+/* Decrypts the key in a slot from its record in the journal.  An empty
+   slot, or one whose record fails its tag, reads as an empty key. */
+int keymanager_load_entry(int slot, key_entry *ke)
+{
+  uint8_t type = ks_hdr.types[slot], rectype;
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  uint8_t aad[2] = { (uint8_t)slot, type };
+  uint8_t rec[KEYMANAGER_MAX_RECORD_LEN];
+  memset((void *)ke, '\000', sizeof(*ke));
+  if (type == KEY_TYPE_EMPTY) return 1;
+  uint16_t keylen = keymanager_key_len(type);
+  if ((keyjournal_read(slot+1, &rectype, rec, sizeof(rec)) != keymanager_record_len(type)) || (rectype != type))
+    return 0;
+  keymanager_record_nonce(nonce, slot, keymanager_get_counter(rec));
+  aes256_gcm_setiv(ks_cipher, nonce);
+  aes256_gcm_auth(ks_cipher, aad, sizeof(aad));
+  aes256_gcm_decrypt(ks_cipher, ke->description, &rec[KEY_RECORD_COUNTER_LEN], KEY_DESCRIPTION_LEN);
+  aes256_gcm_decrypt(ks_cipher, (void *)&ke->ksu, &rec[KEY_RECORD_COUNTER_LEN+KEY_DESCRIPTION_LEN], keylen);
+  if (!aes256_gcm_check_tag(ks_cipher, &rec[KEY_RECORD_COUNTER_LEN+KEY_DESCRIPTION_LEN+keylen]))
+  {
+    memset((void *)ke, '\000', sizeof(*ke));
+    return 0;
+  }
+  ke->entry_type = (key_type)type;
+  return 1;
+}
+
+/* Encrypts a key into a record for a slot under a new counter, returning
+   the length of the record */
+uint16_t keymanager_seal_record(int slot, const key_entry *ke, uint8_t *rec)
+{
+  uint8_t type = ke->entry_type;
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  uint8_t aad[2] = { (uint8_t)slot, type };
+  uint16_t keylen = keymanager_key_len(type);
+  uint32_t counter = ++ks_hdr.counter;
+  keymanager_put_counter(rec, counter);
+  rec += KEY_RECORD_COUNTER_LEN;
+  keymanager_record_nonce(nonce, slot, counter);
+  aes256_gcm_setiv(ks_cipher, nonce);
+  aes256_gcm_auth(ks_cipher, aad, sizeof(aad));
+  aes256_gcm_encrypt(ks_cipher, rec, ke->description, KEY_DESCRIPTION_LEN);
+  aes256_gcm_encrypt(ks_cipher, &rec[KEY_DESCRIPTION_LEN], (const void *)&ke->ksu, keylen);
+  aes256_gcm_compute_tag(ks_cipher, &rec[KEY_DESCRIPTION_LEN+keylen]);
+  return keymanager_record_len(type);
+}
+
+/* The space the current records would take in the journal if the record
+   of a slot had a new length */
+uint32_t keymanager_journal_size(int slot, uint16_t newlen)
+{
+  uint32_t size = KEYJOURNAL_RECORD_SIZE(KEYMANAGER_JOURNAL_HEADER_LEN) + KEYJOURNAL_RECORD_SIZE(KEY_KEYRING_RECORD_LEN);
+  uint16_t len;
+  for (int i=0;i<KEY_NUMBER;i++)
+  {
+    len = (i == slot) ? newlen : keymanager_record_len(ks_hdr.types[i]);
+    if (len) size += KEYJOURNAL_RECORD_SIZE(len);
+  }
+  return size;
+}
+
+/* The fingerprint of a public key, a short hash that names it in file
+   headers and indexes */
+void keymanager_fingerprint(uint8_t *fp, const uint8_t *public_key)
+{
+  ctblake2s(fp, KEYMANAGER_FINGERPRINT_LEN, public_key, KEYMANAGER_PUBLICKEY_LEN, NULL, 0);
+}
+
+/* The public key of a public or private key entry, or NULL */
+const uint8_t *keymanager_entry_public_key(const key_entry *ke)
+{
+  if (ke->entry_type == KEY_TYPE_ECDH_PUBLIC) return ke->ksu.pub.public_key;
+  if (ke->entry_type == KEY_TYPE_ECDH_PRIVATE) return ke->ksu.priv.public_key;
+  return NULL;
+}
+
+static uint16_t keymanager_fp_position(const uint8_t *fp)
+{
+  return (fp[0] | (((uint16_t)fp[1]) << 8)) % KEYMANAGER_FP_INDEX_SIZE;
+}
+
+static uint16_t keymanager_fp_check(const uint8_t *fp)
+{
+  return fp[2] | (((uint16_t)fp[3]) << 8);
+}
+
+/* Adds a slot to the fingerprint index under the fingerprint of its key */
+void keymanager_fp_insert(int slot, const uint8_t *public_key)
+{
+  uint8_t fp[KEYMANAGER_FINGERPRINT_LEN];
+  keymanager_fingerprint(fp, public_key);
+  uint16_t pos = keymanager_fp_position(fp);
+  while (ks_fp_slot[pos] != 0)
+    pos = (pos + 1) % KEYMANAGER_FP_INDEX_SIZE;
+  ks_fp_slot[pos] = slot + 1;
+  ks_fp_check[pos] = keymanager_fp_check(fp);
+}
+
+/* Whether a key of a type would fit in a slot in the journal */
+int keymanager_entry_fits(int slot, uint8_t type)
+{
+  return keymanager_journal_size(slot, keymanager_record_len(type)) <= KEYJOURNAL_CAPACITY;
+}
+
+/* Encrypts a key into its slot under a new counter and appends its record
+   to the journal at once.  The header with the counter is written when the
+   session closes, and until then the counter is recovered from the
+   records. */
+int keymanager_store_entry(int slot, const key_entry *ke)
+{
+  uint8_t rec[KEYMANAGER_MAX_RECORD_LEN];
+  uint8_t type = ke->entry_type;
+  uint8_t oldtype = ks_hdr.types[slot];
+  uint16_t len = 0;
+  if (!keymanager_entry_fits(slot, type))
+  {
+    file_report_error("Key store is full");
+    return 0;
+  }
+  if (type != KEY_TYPE_EMPTY) len = keymanager_seal_record(slot, ke, rec);
+  keyflash_changed = 1;
+  if (!keyjournal_write(slot+1, type, rec, len))
+  {
+    file_report_error("Key store could not be written");
+    return 0;
+  }
+  ks_hdr.types[slot] = type;
+  if ((oldtype == KEY_TYPE_ECDH_PUBLIC) || (oldtype == KEY_TYPE_ECDH_PRIVATE)) ks_fp_valid = 0;
+  if ((ks_fp_valid) && (keymanager_entry_public_key(ke) != NULL))
+    keymanager_fp_insert(slot, keymanager_entry_public_key(ke));
+  return 1;
+}
+
+void keymanager_build_fp_index(void)
+{
+  key_entry ke;
+  memset(ks_fp_slot, '\000', sizeof(ks_fp_slot));
+  for (int slot=0;slot<KEY_NUMBER;slot++)
+  {
+    uint8_t type = ks_hdr.types[slot];
+    if ((type != KEY_TYPE_ECDH_PUBLIC) && (type != KEY_TYPE_ECDH_PRIVATE)) continue;
+    if (keymanager_load_entry(slot, &ke))
+      keymanager_fp_insert(slot, keymanager_entry_public_key(&ke));
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  ks_fp_valid = 1;
+}
+
+/* Finds the slot of the key with a fingerprint, loading it into ke, or
+   returns -1 */
+int keymanager_find_fingerprint(const uint8_t *fp, key_entry *ke)
+{
+  uint8_t key_fp[KEYMANAGER_FINGERPRINT_LEN];
+  if (!ks_fp_valid) keymanager_build_fp_index();
+  for (uint16_t pos=keymanager_fp_position(fp);ks_fp_slot[pos] != 0;pos=(pos + 1) % KEYMANAGER_FP_INDEX_SIZE)
+  {
+    int slot = ks_fp_slot[pos] - 1;
+    if ((ks_fp_check[pos] == keymanager_fp_check(fp)) && (keymanager_load_entry(slot, ke)))
+    {
+      keymanager_fingerprint(key_fp, keymanager_entry_public_key(ke));
+      if (!memcmp(key_fp, fp, sizeof(key_fp))) return slot;
+    }
+  }
+  memset((void *)ke, '\000', sizeof(*ke));
+  return -1;
+}
+
+/* The check tag authenticates the salt under the passphrase hash */
+void keymanager_check_start(void)
+{
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  keymanager_record_nonce(nonce, KEY_STORE_CHECK_SLOT, 0);
+  aes256_gcm_setiv(ks_cipher, nonce);
+  aes256_gcm_auth(ks_cipher, ks_hdr.salt, sizeof(ks_hdr.salt));
+}
+
+int keymanager_check_passphrase(void)
+{
+  keymanager_check_start();
+  return aes256_gcm_check_tag(ks_cipher, ks_hdr.check_tag);
+}
+
+void keymanager_set_check_tag(void)
+{
+  keymanager_check_start();
+  aes256_gcm_compute_tag(ks_cipher, ks_hdr.check_tag);
+}
+
+/* Reads the header of a store written before the journal, kept as a single
+   structure.  Its keys are moved into the journal once the passphrase is
+   known.  A store in the old format has only its salt and cost taken. */
+void keymanager_read_flashstruct(void)
+{
+  void *vp[2];
+  int b[2];
+
+  vp[0] = (void *)&ks_hdr;
+  b[0] = sizeof(key_storage_header);
+  vp[1] = NULL;
+  b[1] = sizeof(key_storage) - sizeof(key_storage_header);
+  if (!readflashstruct((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, 2, vp, b))
+    file_report_error("Key store checksum is invalid");
+  ks_migrate = (ks_hdr.id != KEY_STORE_ID) || (ks_hdr.vers != KEY_STORE_VERSION);
+  if (ks_migrate)
+  {
+    memset(&ks_hdr, '\000', sizeof(ks_hdr));
+    readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, salt), ks_hdr.salt, sizeof(ks_hdr.salt));
+    readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, kdf_iterations), &ks_hdr.kdf_iterations, sizeof(ks_hdr.kdf_iterations));
+    ks_hdr.id = KEY_STORE_ID;
+    ks_hdr.vers = KEY_STORE_VERSION;
+  } else
+  {
+    int n;
+    for (n=0;(n<KEY_NUMBER) && (ks_hdr.types[n] <= KEY_TYPE_ECDH_PUBLIC);n++);
+    if ((n < KEY_NUMBER) || (keymanager_record_offset(KEY_NUMBER) > (sizeof(key_storage) - sizeof(key_storage_header))))
+    {
+      file_report_error("Key store is damaged");
+      memset(ks_hdr.types, '\000', sizeof(ks_hdr.types));
+      memset(ks_hdr.check_tag, '\000', sizeof(ks_hdr.check_tag));
+    }
+  }
+}
+
+/* Gathers the header and the types of the newest record of each slot from
+   the journal.  The counter is advanced past every record, in case a
+   session was cut short after writing records but before writing the
+   header. */
+void keymanager_read_journal(void)
+{
+  uint8_t rec[KEYMANAGER_MAX_RECORD_LEN];
+  uint32_t counter;
+  uint8_t type;
+  int n, len, damaged = 0;
+
+  memset(&ks_hdr, '\000', sizeof(ks_hdr));
+  ks_migrate = 0;
+  if (keyjournal_read(0, NULL, &ks_hdr, KEYMANAGER_JOURNAL_HEADER_LEN) != KEYMANAGER_JOURNAL_HEADER_LEN)
+    damaged = 1;
+  for (n=0;n<KEY_NUMBER;n++)
+  {
+    len = keyjournal_read(n+1, &type, rec, sizeof(rec));
+    if (len == 0) continue;
+    if ((len < 0) || (type > KEY_TYPE_ECDH_PUBLIC) || (len != keymanager_record_len(type)))
+    {
+      damaged = 1;
+      continue;
+    }
+    counter = keymanager_get_counter(rec);
+    if (counter > ks_hdr.counter) ks_hdr.counter = counter;
+    ks_hdr.types[n] = type;
+  }
+  len = keyjournal_read(KEYMANAGER_KEYRING_ITEM, NULL, ks_keyring, sizeof(ks_keyring));
+  if (len == sizeof(ks_keyring))
+  {
+    ks_keyring_valid = 1;
+    counter = keymanager_get_counter(ks_keyring);
+    if (counter > ks_hdr.counter) ks_hdr.counter = counter;
+  } else if (len != 0)
+    damaged = 1;
+  if (damaged)
+    file_report_error("Key store is damaged");
 }
 
+/* Reads the header of the store from the journal, or from a store written
+   before the journal, whose keys are moved into the journal when it is
+   unlocked */
 void keymanager_read_storage(void)
 {
-  void *vp[1];
-  int b[1];
+  ks_fp_valid = 0;
+  ks_keyring_valid = ks_keyring_dirty = 0;
+  ks_journal = keyjournal_mount();
+  if (ks_journal)
+    keymanager_read_journal();
+  else
+    keymanager_read_flashstruct();
+  kdf_iterations = ((ks_hdr.kdf_iterations >= KEY_DERIVATION_MIN_HASHES) && (ks_hdr.kdf_iterations <= KEY_DERIVATION_MAX_HASHES)) ?
+                   ks_hdr.kdf_iterations : KEY_DERIVATION_HASHES;
+  ks_loaded = 1;
+}
+
+/* The keys of the old store are read in order, a GCM stream from the first
+   key, so one key is read by reading all of the keys before it */
+void keymanager_old_start(aes256_gcm_context *old_cipher)
+{
+  uint8_t iv[AES_BLOCKLEN];
+  aes256_gcm_init(old_cipher, passphrase_hash);
+  readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, key_entry_iv), iv, sizeof(iv));
+  aes256_gcm_setiv(old_cipher, iv);
+}
+
+void keymanager_old_next(aes256_gcm_context *old_cipher, int n, key_entry *ke)
+{
+  readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, keu) + n*sizeof(key_entry), ke, sizeof(*ke));
+  aes256_gcm_decrypt(old_cipher, ke, ke, sizeof(*ke));
+}
+
+/* Formats the journal and writes the header and the records of the slots,
+   packed in slot order, into it */
+int keymanager_format_journal(const uint8_t *records)
+{
+  uint16_t offset = 0, len;
+  int n, ok;
+
+  ok = ks_journal = keyjournal_format();
+  if (ok) ok = keyjournal_write(0, 0, &ks_hdr, KEYMANAGER_JOURNAL_HEADER_LEN);
+  for (n=0;(n<KEY_NUMBER) && ok;n++)
+  {
+    len = keymanager_record_len(ks_hdr.types[n]);
+    if (len) ok = keyjournal_write(n+1, ks_hdr.types[n], &records[offset], len);
+    offset += len;
+  }
+  if (ok) ok = keyjournal_compact();
+  if (!ok) file_report_error("Key store could not be written");
+  return ok;
+}
+
+/* Moves the keys of a store written before the journal into the journal.
+   The journal takes the flash of the old store, so the records are
+   gathered in memory first: those of the old record store as they are,
+   and the keys of the old single message store sealed into records. */
+int keymanager_move_old_keys(void)
+{
+  aes256_gcm_context old_cipher;
+  key_entry ke;
+  uint8_t *records = NULL;
+  uint16_t offset = 0, len = keymanager_record_offset(KEY_NUMBER);
+  int n, ok;
+
+  if ((len != 0) && ((records = (uint8_t *)keymanager_malloc(len)) == NULL))
+  {
+    file_report_error("Not enough memory to move the old key store");
+    return 0;
+  }
+  if (ks_migrate)
+  {
+    keymanager_old_start(&old_cipher);
+    for (n=0;n<KEY_NUMBER;n++)
+    {
+      keymanager_old_next(&old_cipher, n, &ke);
+      if (ks_hdr.types[n] != KEY_TYPE_EMPTY)
+        offset += keymanager_seal_record(n, &ke, &records[offset]);
+    }
+    memset((void *)&ke, '\000', sizeof(ke));
+    aes256_gcm_clear(&old_cipher);
+    keymanager_set_check_tag();
+  } else if (len != 0)
+    readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage, records), records, len);
+  ok = keymanager_format_journal(records);
+  if (records != NULL)
+  {
+    memset(records, '\000', len);
+    free(records);
+  }
+  if (ok) ks_migrate = 0;
+  return ok;
+}
+
+/* Checks the old single message store in flash against the passphrase
+   hash and takes the types of its keys */
+int keymanager_migrate_storage(void)
+{
+  aes256_gcm_context old_cipher;
+  key_entry ke;
+  uint8_t tag[AES_GCM_TAG_LENGTH];
+  int n, ok;
 
-  vp[0] = (void *)ks;
-  b[0] = sizeof(key_storage);
-  readflashstruct((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, 1, vp, b);
+  keymanager_old_start(&old_cipher);
+  readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, key_entry_tag), tag, sizeof(tag));
+  for (n=0;n<KEY_NUMBER;n++)
+  {
+    readflashbytes((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, offsetof(key_storage_v1, keu) + n*sizeof(key_entry), &ke, sizeof(ke));
+    aes256_gcm_hash(&old_cipher, &ke, sizeof(ke));
+  }
+  ok = aes256_gcm_check_tag(&old_cipher, tag);
+  aes256_gcm_clear(&old_cipher);
+  if (ok)
+  {
+    keymanager_old_start(&old_cipher);
+    for (n=0;n<KEY_NUMBER;n++)
+    {
+      keymanager_old_next(&old_cipher, n, &ke);
+      ks_hdr.types[n] = ((ke.entry_type != KEY_TYPE_EMPTY) && (ke.entry_type <= KEY_TYPE_ECDH_PUBLIC)) ? ke.entry_type : KEY_TYPE_EMPTY;
+    }
+    memset((void *)&ke, '\000', sizeof(ke));
+    aes256_gcm_clear(&old_cipher);
+  }
+  return ok;
 }
 
-void keymanager_write_storage(void)
+/* The iterations of the key derivation function for the store and for files
+   encrypted with its keys.  Stores written before the count was recorded
+   read back an erased or zero count and use the default. */
+uint32_t keymanager_kdf_iterations(void)
 {
-  void *vp[1];
-  int b[1];
+  return kdf_iterations;
+}
 
-  vp[0] = (void *)ks;
-  b[0] = sizeof(key_storage);
-  writeflashstruct((void *)KEYMANAGER_FLASH_STORAGE_ADDRESS, 1, vp, b);
+/* Appends the header, and the keyring key if it changed, to the journal,
+   then compacts it ahead of the next session.  The records of the slots
+   were appended as they changed. */
+int keymanager_write_storage(void)
+{
+  int ok = ks_journal;
+  if (ok) ok = keyjournal_write(0, 0, &ks_hdr, KEYMANAGER_JOURNAL_HEADER_LEN);
+  if (ok && ks_keyring_dirty)
+    ok = keyjournal_write(KEYMANAGER_KEYRING_ITEM, 0, ks_keyring, ks_keyring_valid ? sizeof(ks_keyring) : 0);
+  if (ok) ok = keyjournal_compact();
+  if (!ok) file_report_error("Key store could not be written");
+  ks_keyring_dirty = 0;
+  return ok;
 }
 
 void keymanager_key_derivation_function(const char *passphrase, uint8_t *hash)
 {
-  key_derivation_function((void *)hash, (void *)passphrase, strlen_n(passphrase), (void *)ks->salt, sizeof(ks->salt));
+  key_derivation_function_iterations((void *)hash, (void *)passphrase, strlen_n(passphrase), (void *)ks_hdr.salt, sizeof(ks_hdr.salt), kdf_iterations);
 }
 
 void keymanager_display_message(const char *message)
@@ -114,37 +713,147 @@ int keymanager_initialize_database()
 {
   uint8_t bits[64];
   char passphrase[KEY_MAX_PASSPHRASE_LENGTH];
-  memset(ks, '\000', sizeof(key_storage));
+  memset(&ks_hdr, '\000', sizeof(ks_hdr));
   keymanager_enter_passphrase("Enter new database passphrase:", passphrase);
   randomness_get_whitened_bits(bits, sizeof(bits));
-  memcpy((void *)ks->salt, (void *)bits, sizeof(ks->salt));
-  randomness_get_whitened_bits(bits, sizeof(bits));
-  memcpy((void *)ks->key_entry_iv, (void *)bits, sizeof(ks->key_entry_iv));
+  memcpy((void *)ks_hdr.salt, (void *)bits, sizeof(ks_hdr.salt));
+  ks_hdr.id = KEY_STORE_ID;
+  ks_hdr.vers = KEY_STORE_VERSION;
+  keymanager_display_message("Calibrating passphrase cost...");
+  ks_hdr.kdf_iterations = kdf_iterations = key_derivation_calibrate(KEY_DERIVATION_TARGET_MS);
   keymanager_key_derivation_function(passphrase, passphrase_hash);
-  return 1;
+  memset(passphrase, '\000', sizeof(passphrase));
+  aes256_gcm_init(ks_cipher, passphrase_hash);
+  keymanager_set_check_tag();
+  ks_migrate = 0;
+  ks_fp_valid = 0;
+  ks_keyring_valid = ks_keyring_dirty = 0;
+  return keymanager_format_journal(NULL);
 }
 
-void keymanager_recalculate_hashes(void)
+/* The key of the keyring on the card is kept in the store as a record of
+   its own, under a slot number no key uses */
+void keymanager_keyring_start(uint32_t counter)
 {
-  uint8_t keh[KEYMANAGER_HASHLEN];
-  uint8_t bits[64];
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  uint8_t aad[2] = { KEY_STORE_KEYRING_SLOT, 0 };
+  keymanager_record_nonce(nonce, KEY_STORE_KEYRING_SLOT, counter);
+  aes256_gcm_setiv(ks_cipher, nonce);
+  aes256_gcm_auth(ks_cipher, aad, sizeof(aad));
+}
 
-  randomness_get_whitened_bits(bits, sizeof(bits));
-  memcpy((void *)ks->key_entry_iv, (void *)bits, sizeof(ks->key_entry_iv));
-  aes256_gcm_memcrypt(1, (void *)passphrase_hash, (void *)ks->key_entry_iv, (void *)ks->key_entry_tag, (void *)&ks->keu, sizeof(ks->keu));
+/* The record holds the key and the counter of the keyring header when the
+   keyring was last closed, encrypted together */
+#define KEYMANAGER_KEYRING_COUNTER (KEY_RECORD_COUNTER_LEN+KEYMANAGER_SYMMETRICKEY_LEN)
+#define KEYMANAGER_KEYRING_TAG (KEYMANAGER_KEYRING_COUNTER+KEY_RECORD_COUNTER_LEN)
+
+int keymanager_keyring_unwrap(uint8_t *key, uint32_t *keyring_counter)
+{
+  uint8_t counter[KEY_RECORD_COUNTER_LEN];
+  if (!ks_keyring_valid) return 0;
+  keymanager_keyring_start(keymanager_get_counter(ks_keyring));
+  aes256_gcm_decrypt(ks_cipher, key, &ks_keyring[KEY_RECORD_COUNTER_LEN], KEYMANAGER_SYMMETRICKEY_LEN);
+  aes256_gcm_decrypt(ks_cipher, counter, &ks_keyring[KEYMANAGER_KEYRING_COUNTER], sizeof(counter));
+  if (aes256_gcm_check_tag(ks_cipher, &ks_keyring[KEYMANAGER_KEYRING_TAG]))
+  {
+    *keyring_counter = keymanager_get_counter(counter);
+    return 1;
+  }
+  memset(key, '\000', KEYMANAGER_SYMMETRICKEY_LEN);
+  return 0;
 }
 
-int keymanager_get_passphrase(void)
+void keymanager_keyring_wrap(const uint8_t *key, uint32_t keyring_counter)
 {
-  uint8_t keh[KEYMANAGER_HASHLEN];
+  uint8_t kc[KEY_RECORD_COUNTER_LEN];
+  uint32_t counter = ++ks_hdr.counter;
+  keymanager_put_counter(ks_keyring, counter);
+  keymanager_put_counter(kc, keyring_counter);
+  keymanager_keyring_start(counter);
+  aes256_gcm_encrypt(ks_cipher, &ks_keyring[KEY_RECORD_COUNTER_LEN], key, KEYMANAGER_SYMMETRICKEY_LEN);
+  aes256_gcm_encrypt(ks_cipher, &ks_keyring[KEYMANAGER_KEYRING_COUNTER], kc, sizeof(kc));
+  aes256_gcm_compute_tag(ks_cipher, &ks_keyring[KEYMANAGER_KEYRING_TAG]);
+  ks_keyring_valid = ks_keyring_dirty = keyflash_changed = 1;
+}
+
+/* Encrypts every record again under a new passphrase hash.  The records
+   are written as they are encrypted, so the header with the new check tag
+   is written straight after them. */
+void keymanager_rekey(const uint8_t *new_hash)
+{
+  aes256_gcm_context *old_cipher = ks_cipher;
+  aes256_gcm_context new_cipher;
+  key_entry ke;
+  uint8_t keyring_key[KEYMANAGER_SYMMETRICKEY_LEN];
+  uint32_t keyring_counter;
+  int keyring = keymanager_keyring_unwrap(keyring_key, &keyring_counter);
+
+  aes256_gcm_init(&new_cipher, new_hash);
+  for (int n=0;n<KEY_NUMBER;n++)
+  {
+    if (ks_hdr.types[n] == KEY_TYPE_EMPTY) continue;
+    ks_cipher = old_cipher;
+    if (!keymanager_load_entry(n, &ke)) continue;
+    ks_cipher = &new_cipher;
+    keymanager_store_entry(n, &ke);
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  ks_cipher = &new_cipher;
+  if (keyring) keymanager_keyring_wrap(keyring_key, keyring_counter);
+  memset(keyring_key, '\000', sizeof(keyring_key));
+  aes256_gcm_clear(&new_cipher);
+  ks_cipher = old_cipher;
+  memcpy(passphrase_hash, new_hash, sizeof(passphrase_hash));
+  aes256_gcm_init(ks_cipher, passphrase_hash);
+  keymanager_set_check_tag();
+  keymanager_write_storage();
+  keyflash_changed = 1;
+}
+
+/* Measures the key derivation function and rekeys the store so that
+   unlocking takes about KEY_DERIVATION_TARGET_MS on this device */
+void keymanager_calibrate(void)
+{
+  char passphrase[KEY_MAX_PASSPHRASE_LENGTH];
+  uint8_t hash[KEYMANAGER_HASHLEN];
+  uint32_t iterations;
+
+  keymanager_enter_passphrase("Re-enter passphrase to calibrate:", passphrase);
+  keymanager_key_derivation_function(passphrase, hash);
+  if (memcmp(hash, passphrase_hash, sizeof(hash)))
+  {
+    keymanager_display_message("Invalid passphrase");
+    console_press_space();
+  } else
+  {
+    keymanager_display_message("Calibrating passphrase cost...");
+    iterations = key_derivation_calibrate(KEY_DERIVATION_TARGET_MS);
+    console_puts("\r\nIterations now: ");
+    console_printuint(kdf_iterations);
+    console_puts("\r\nIterations calibrated: ");
+    console_printuint(iterations);
+    if (!console_yes(12))
+    {
+      ks_hdr.kdf_iterations = kdf_iterations = iterations;
+      keymanager_key_derivation_function(passphrase, hash);
+      keymanager_rekey(hash);
+    }
+  }
+  memset(passphrase, '\000', sizeof(passphrase));
+  memset(hash, '\000', sizeof(hash));
+}
 
+int keymanager_get_passphrase(void)
+{
   if (!active_key)
   {
     char passphrase[KEY_MAX_PASSPHRASE_LENGTH];
     keymanager_enter_passphrase("Enter passphrase:", passphrase);
     keymanager_key_derivation_function(passphrase, passphrase_hash);
+    memset(passphrase, '\000', sizeof(passphrase));
   }
-  if (!aes256_gcm_memcrypt(0, (void *)passphrase_hash, (void *)ks->key_entry_iv, (void *)ks->key_entry_tag, (void *)&ks->keu, sizeof(ks->keu)))
+  aes256_gcm_init(ks_cipher, passphrase_hash);
+  if (!(ks_migrate ? keymanager_migrate_storage() : keymanager_check_passphrase()))
   {
     char destructcode[13];
     console_gotoxy(1, 15);
@@ -154,7 +863,9 @@ int keymanager_get_passphrase(void)
     keyflash_changed = 1;
     return 1;
   }
+  if ((!ks_journal) && (!keymanager_move_old_keys())) return 0;
   active_key = 1;
+  if (!ks_fp_valid) keymanager_build_fp_index();
   return 1;
 }
 
@@ -205,7 +916,53 @@ void keymanager_new_private_key(int entno, key_entry *ke)
   memcpy((void *)ke->ksu.priv.private_key, (void *)private_key, sizeof(ke->ksu.priv.private_key));
   memcpy((void *)ke->ksu.priv.public_key, (void *)public_key, sizeof(ke->ksu.priv.public_key));
   ke->entry_type = KEY_TYPE_ECDH_PRIVATE;
-  keyflash_changed = 1;
+  keymanager_store_entry(entno, ke);
+}
+
+/* Fills an export record with the public key of a public or private key */
+void keymanager_make_export(key_export_public *kep, const key_entry *ke)
+{
+  memset((void *)kep,'\000',sizeof(*kep));
+  kep->id = KEY_EXPORT_ID;
+  kep->vers = KEY_EXPORT_VERSION;
+  kep->len = sizeof(*kep);
+  memcpy((void *)kep->description, (void *)ke->description, sizeof(ke->description));  
+  memcpy((void *)kep->public_key, (void *)keymanager_entry_public_key(ke), KEYMANAGER_PUBLICKEY_LEN);
+  kep->crc16 = checksum_crc16(CHECKSUM_CRC16_INIT, (uint8_t *)kep,sizeof(*kep));
+}
+
+/* Reads the next export record of a file and checks it */
+int keymanager_read_export(FIL *f, key_export_public *kep)
+{
+  memset((void *)kep,'\000',sizeof(*kep));
+  if (!file_read_block(f, "PARANOIABOX-PUBLICKEY", (void *)kep, sizeof(*kep)))
+  {
+    file_report_error("Could not read key file");
+    return 0;
+  }
+  uint16_t read_crc16 = kep->crc16;
+  kep->crc16 = 0;
+  uint16_t compare_crc16 = checksum_crc16(CHECKSUM_CRC16_INIT, (uint8_t *)kep,sizeof(*kep));
+  kep->crc16 = read_crc16;
+  if (read_crc16 != compare_crc16)
+  {
+    file_report_error("CRC on file is invalid");
+    return 0;
+  }
+  if ((kep->id != KEY_EXPORT_ID) || (kep->vers != KEY_EXPORT_VERSION) || (kep->len != sizeof(*kep)))
+  {
+    file_report_error("Version on file is invalid");
+    return 0;
+  }
+  return 1;
+}
+
+void keymanager_export_to_entry(key_entry *ke, const key_export_public *kep)
+{
+  memset((void *)ke, '\000', sizeof(*ke));
+  memcpy((void *)ke->description, (void *)kep->description, sizeof(ke->description));  
+  memcpy((void *)ke->ksu.pub.public_key, (void *)kep->public_key, sizeof(ke->ksu.pub.public_key));
+  ke->entry_type = KEY_TYPE_ECDH_PUBLIC;
 }
 
 void keymanager_export_public_key(int entno, key_entry *ke)
@@ -226,58 +983,215 @@ void keymanager_export_public_key(int entno, key_entry *ke)
   }
   {
     key_export_public kep;
-    memset((void *)&kep,'\000',sizeof(kep));
-    kep.id = KEY_EXPORT_ID;
-    kep.vers = KEY_EXPORT_VERSION;
-    kep.len = sizeof(kep);
-    memcpy((void *)kep.description, (void *)ke->description, sizeof(ke->description));  
-    memcpy((void *)kep.public_key, (void *)ke->ksu.priv.public_key, sizeof(ke->ksu.priv.public_key));
-    kep.crc16 = calc_crc16((uint8_t *)&kep,sizeof(kep));
+    keymanager_make_export(&kep, ke);
     file_write_block(&f, "PARANOIABOX-PUBLICKEY", (void *)&kep, sizeof(kep));
     f_close(&f);
   }
 }
 
-void keymanager_import_public_key(int entno, key_entry *ke)
+/* Reads an exported public key from a file the user selects */
+int keymanager_read_public_key(key_entry *ke)
 {
   FIL f;
-  if (keymanager_erase_this_key("Import public key", entno, ke, NULL, 0)) return;
+  int ok = 0;
   {
     char filename_key[256];
-    if (!file_select_ciphertext("Select filename of imported key", 0, filename_key, sizeof(filename_key)-1)) return;
+    if (!file_select_ciphertext("Select filename of imported key", 0, filename_key, sizeof(filename_key)-1)) return 0;
     FRESULT fres = f_open(&f, filename_key, FA_READ);
     if (fres != FR_OK)
     {
       file_report_error("Could not key file");
       f_close(&f);
-      return;    
+      return 0;
     }
   }
   {
     key_export_public kep;
-    memset((void *)&kep,'\000',sizeof(kep));
-    if (file_read_block(&f, "PARANOIABOX-PUBLICKEY", (void *)&kep, sizeof(kep)))
+    if (keymanager_read_export(&f, &kep))
     {
-      uint16_t read_crc16 = kep.crc16;
-      kep.crc16 = 0;
-      uint16_t compare_crc16 = calc_crc16((uint8_t *)&kep,sizeof(kep));
-      if (read_crc16 == compare_crc16)
-      {
-        if ((kep.id == KEY_EXPORT_ID) && (kep.vers == KEY_EXPORT_VERSION) && (kep.len == sizeof(kep)))
-        {
-          memset((void *)ke, '\000', sizeof(*ke));
-          memcpy((void *)ke->description, (void *)kep.description, sizeof(ke->description));  
-          memcpy((void *)ke->ksu.pub.public_key, (void *)kep.public_key, sizeof(ke->ksu.priv.public_key));
-          ke->entry_type = KEY_TYPE_ECDH_PUBLIC;
-          keyflash_changed = 1;
-        } else
-          file_report_error("Version on file is invalid");
-      } else
-        file_report_error("CRC on file is invalid");
-    } else
-      file_report_error("Could not read key file");
+      keymanager_export_to_entry(ke, &kep);
+      ok = 1;
+    }
+  }
+  f_close(&f);
+  return ok;
+}
+
+/* Opens a key bundle the user selects and checks all of its keys, leaving
+   the file at the first key.  The caller closes the file. */
+int keymanager_open_bundle(FIL *f, key_bundle_header *kbh)
+{
+  {
+    char filename_key[256];
+    if (!file_select_ciphertext("Select filename of key bundle", 0, filename_key, sizeof(filename_key)-1)) return 0;
+    FRESULT fres = f_open(f, filename_key, FA_READ);
+    if (fres != FR_OK)
+    {
+      file_report_error("Could not open bundle file");
+      f_close(f);
+      return 0;
+    }
+  }
+  memset((void *)kbh, '\000', sizeof(*kbh));
+  if (!file_read_block(f, "PARANOIABOX-KEYBUNDLE", (void *)kbh, sizeof(*kbh)))
+  {
+    file_report_error("Could not read bundle file");
+    f_close(f);
+    return 0;
+  }
+  if ((kbh->id != KEY_BUNDLE_ID) || (kbh->vers != KEY_BUNDLE_VERSION) || (kbh->len != sizeof(key_export_public)) || (kbh->count > KEY_BUNDLE_MAX_KEYS))
+  {
+    file_report_error("Version on bundle is invalid");
+    f_close(f);
+    return 0;
+  }
+  FSIZE_t first = f_tell(f);
+  uint32_t crc32 = CHECKSUM_CRC32_INIT;
+  for (uint16_t n=0;n<kbh->count;n++)
+  {
+    key_export_public kep;
+    if (!keymanager_read_export(f, &kep))
+    {
+      f_close(f);
+      return 0;
+    }
+    crc32 = checksum_crc32(crc32, (uint8_t *)&kep, sizeof(kep));
+  }
+  if (crc32 != kbh->crc32)
+  {
+    file_report_error("CRC on bundle is invalid");
+    f_close(f);
+    return 0;
+  }
+  f_lseek(f, first);
+  return 1;
+}
+
+/* Reads the next key of a bundle opened by keymanager_open_bundle */
+int keymanager_read_bundle_key(FIL *f, key_entry *ke)
+{
+  key_export_public kep;
+  if (!keymanager_read_export(f, &kep)) return 0;
+  keymanager_export_to_entry(ke, &kep);
+  return 1;
+}
+
+/* Writes the public keys of all public and private key slots to a bundle.
+   The keys are read twice, once for the checksum in the header and once to
+   write them, so that no more than one key is in memory at a time. */
+void keymanager_export_bundle(void)
+{
+  FIL f;
+  key_entry ke;
+  key_export_public kep;
+  key_bundle_header kbh;
+  memset((void *)&kbh, '\000', sizeof(kbh));
+  kbh.id = KEY_BUNDLE_ID;
+  kbh.vers = KEY_BUNDLE_VERSION;
+  kbh.len = sizeof(kep);
+  kbh.crc32 = CHECKSUM_CRC32_INIT;
+  for (int slot=0;slot<KEY_NUMBER;slot++)
+  {
+    if ((!keymanager_load_entry(slot, &ke)) || (keymanager_entry_public_key(&ke) == NULL)) continue;
+    keymanager_make_export(&kep, &ke);
+    kbh.crc32 = checksum_crc32(kbh.crc32, (uint8_t *)&kep, sizeof(kep));
+    kbh.count++;
+  }
+  if (kbh.count == 0)
+  {
+    file_report_error("No public keys to export");
+    return;
+  }
+  {
+    char filename_key[256];
+    if (!file_select_ciphertext("Select directory for key bundle", 1, filename_key, sizeof(filename_key)-1)) return;
+    if (!file_enter_filename("Filename for key bundle:", filename_key, sizeof(filename_key)-1)) return;
+    FRESULT fres = f_open(&f, filename_key, FA_WRITE | FA_CREATE_NEW);
+    if (fres != FR_OK)
+    {
+      file_report_error("Could not open bundle file");
+      f_close(&f);
+      return;    
+    }
+  }
+  file_write_block(&f, "PARANOIABOX-KEYBUNDLE", (void *)&kbh, sizeof(kbh));
+  for (int slot=0;slot<KEY_NUMBER;slot++)
+  {
+    if ((!keymanager_load_entry(slot, &ke)) || (keymanager_entry_public_key(&ke) == NULL)) continue;
+    keymanager_make_export(&kep, &ke);
+    file_write_block(&f, "PARANOIABOX-PUBLICKEY", (void *)&kep, sizeof(kep));
   }
   f_close(&f);
+  memset((void *)&ke, '\000', sizeof(ke));
+}
+
+/* Imports the keys of a bundle into empty slots.  Keys already in the store
+   are skipped, and the keys go to the store in memory, so that the store is
+   written to flash once when the key manager is left. */
+void keymanager_import_bundle(void)
+{
+  FIL f;
+  key_entry ke, found;
+  key_bundle_header kbh;
+  uint8_t fp[KEYMANAGER_FINGERPRINT_LEN];
+  uint16_t imported = 0, duplicates = 0, no_room = 0;
+  int slot = 0;
+  if (!keymanager_open_bundle(&f, &kbh)) return;
+  for (uint16_t n=0;n<kbh.count;n++)
+  {
+    if (!keymanager_read_bundle_key(&f, &ke)) break;
+    keymanager_fingerprint(fp, ke.ksu.pub.public_key);
+    if (keymanager_find_fingerprint(fp, &found) >= 0)
+    {
+      duplicates++;
+      continue;
+    }
+    while ((slot < KEY_NUMBER) && ((ks_hdr.types[slot] != KEY_TYPE_EMPTY) || (!keymanager_entry_fits(slot, KEY_TYPE_ECDH_PUBLIC))))
+      slot++;
+    if (slot >= KEY_NUMBER)
+    {
+      no_room++;
+      continue;
+    }
+    if (keymanager_store_entry(slot, &ke)) imported++;
+  }
+  f_close(&f);
+  memset((void *)&ke, '\000', sizeof(ke));
+  memset((void *)&found, '\000', sizeof(found));
+  {
+    char s[60];
+    mini_snprintf(s, sizeof(s)-1, "Imported %u, %u already stored, %u did not fit", imported, duplicates, no_room);
+    keymanager_display_message(s);
+    console_press_space();
+  }
+}
+
+/* Imports a public key into a slot unless another slot already holds it */
+void keymanager_import_public_key(int entno, key_entry *ke)
+{
+  key_entry found;
+  uint8_t fp[KEYMANAGER_FINGERPRINT_LEN];
+  if (keymanager_erase_this_key("Import public key", entno, ke, NULL, 0)) return;
+  if (!keymanager_read_public_key(ke)) return;
+  keymanager_fingerprint(fp, ke->ksu.pub.public_key);
+  int slot = keymanager_find_fingerprint(fp, &found);
+  memset((void *)&found, '\000', sizeof(found));
+  if ((slot >= 0) && (slot != entno))
+  {
+    char s[40];
+    mini_snprintf(s, sizeof(s)-1, "Key is already in slot %d", slot+1);
+    file_report_error(s);
+    return;
+  }
+  keymanager_store_entry(entno, ke);
+}
+
+void keymanager_remove_key(int entno, key_entry *ke)
+{
+  if (ke->entry_type == KEY_TYPE_EMPTY) return;
+  if (keymanager_erase_this_key("Remove key", entno, ke, NULL, 0)) return;
+  memset((void *)ke, '\000', sizeof(*ke));
+  keymanager_store_entry(entno, ke);
 }
 
 void keymanager_new_passphrase_key(int entno, key_entry *ke)
@@ -293,7 +1207,7 @@ void keymanager_new_passphrase_key(int entno, key_entry *ke)
   console_gotoxy(1,16);
   console_puts("Name:\r\n");
   console_puts(description);
-  crc16 = calc_crc16((uint8_t *)passphrase,strlen_n(passphrase));
+  crc16 = checksum_crc16(CHECKSUM_CRC16_INIT, (uint8_t *)passphrase,strlen_n(passphrase));
   mini_snprintf(s, sizeof(s)-1,"%04X", crc16);
   console_puts("\r\nCRC16 of passphrase: ");
   console_puts(s);
@@ -304,19 +1218,20 @@ void keymanager_new_passphrase_key(int entno, key_entry *ke)
   memcpy((void *)ke->description,(void *)description,sizeof(ke->description));
   memcpy((void *)ke->ksu.sym.symmetric_key, (void *)keh, sizeof(ke->ksu.sym.symmetric_key));
   ke->entry_type = KEY_TYPE_AES;
-  keyflash_changed = 1;
+  keymanager_store_entry(entno, ke);
 }
 
 void keymanager_select_key(void)
 {
   int key_no = 0;
   int top_key = 0;
+  key_entry entry;
+  key_entry *ke = &entry;
   for (;;)
   {
     int n;
     console_clrscr();
     console_puts("Select key:");
-    key_entry *ke; 
     if (top_key > (KEY_NUMBER-KEYMANAGER_SELECT_DISPLAY))
       top_key = KEY_NUMBER-KEYMANAGER_SELECT_DISPLAY;
     if (top_key < 0)
@@ -324,22 +1239,24 @@ void keymanager_select_key(void)
     for (n=0;n<KEYMANAGER_SELECT_DISPLAY;n++)
     {
       int entno = n + top_key;
-      key_entry *ke = &ks->keu.kes[entno];
+      keymanager_load_entry(entno, ke);
       if (entno == key_no) console_highvideo();
       console_gotoxy(1,n+3);
       keymanager_display_key(entno,ke);
       console_lowvideo();
     }
     console_gotoxy(1,20);
-    console_puts("Q-quits, K-invalidate passphrase\r\nUp/Down/Enter select key\r\nN-New Passphrase Key, P-New Private Key\r\nI-Import Public Key, E-Export Public Key");
+    console_puts("Q-quits, K-invalidate passphrase, C-calibrate, R-remove key\r\nUp/Down/Enter select key\r\nN-New Passphrase Key, P-New Private Key\r\nI/E-Import/Export Public Key, M/X-Import/Export Key Bundle");
     int ch = toupper(console_getch());
-    ke = &ks->keu.kes[key_no];
+    keymanager_load_entry(key_no, ke);
     if (ch == 'Q') break;
     if (ch == 'K')
     {
       invalidate_passphrase = 1;
       break;
     }
+    if (ch == 'C')
+      keymanager_calibrate();
     if (ch == 'A')
     {
       if (key_no > 0) key_no--;
@@ -357,7 +1274,10 @@ void keymanager_select_key(void)
         if (ke->entry_type == KEY_TYPE_ECDH_PUBLIC)
           current_key_public = *ke;
         else
+        {
           current_key_private = *ke;
+          current_key_private_slot = key_no;
+        }
         console_clrscr();
         console_gotoxy(1,5);
         keymanager_display_message("Selected symmetric/private key:\r\n");
@@ -375,6 +1295,12 @@ void keymanager_select_key(void)
       keymanager_export_public_key(key_no,ke);
     if (ch == 'I')
       keymanager_import_public_key(key_no,ke);
+    if (ch == 'R')
+      keymanager_remove_key(key_no,ke);
+    if (ch == 'M')
+      keymanager_import_bundle();
+    if (ch == 'X')
+      keymanager_export_bundle();
     if (ch == 'Z')
     {
       uint8_t secret[32];
@@ -382,32 +1308,183 @@ void keymanager_select_key(void)
       keymanager_compute_secret(secret,&secretlen);
     }
   }
+  memset((void *)&entry, '\000', sizeof(entry));
 }
 
-void keymanager(void)
+int keymanager_mark_recipients(uint8_t recipients[][KEYMANAGER_PUBLICKEY_LEN], int max_recipients)
 {
-  ks = (key_storage *)malloc(sizeof(key_storage));
-  if (ks == NULL) return;
-  keymanager_read_storage();
+  uint8_t marked[(KEY_NUMBER+7)/8];
+  key_entry ke;
+  int key_no = 0;
+  int top_key = 0;
+  memset((void *)marked, '\000', sizeof(marked));
+  for (;;)
+  {
+    int n;
+    console_clrscr();
+    console_puts("Mark recipients:");
+    if (top_key > (KEY_NUMBER-KEYMANAGER_SELECT_DISPLAY))
+      top_key = KEY_NUMBER-KEYMANAGER_SELECT_DISPLAY;
+    if (top_key < 0)
+      top_key = 0;
+    for (n=0;n<KEYMANAGER_SELECT_DISPLAY;n++)
+    {
+      int entno = n + top_key;
+      if (entno == key_no) console_highvideo();
+      console_gotoxy(1,n+3);
+      console_putch((marked[entno/8] & (1 << (entno%8))) ? '*' : ' ');
+      keymanager_load_entry(entno, &ke);
+      keymanager_display_key(entno, &ke);
+      console_lowvideo();
+    }
+    console_gotoxy(1,20);
+    console_puts("Q-quits, S-encrypt for marked keys\r\nUp/Down move, Enter marks public key");
+    int ch = toupper(console_getch());
+    if (ch == 'Q') return -1;
+    if (ch == 'A')
+    {
+      if (key_no > 0) key_no--;
+      if (top_key > key_no) top_key = key_no;
+    }
+    if (ch == 'B')
+    {
+      if (key_no < (KEY_NUMBER-1)) key_no++;
+      if (top_key < (key_no - (KEYMANAGER_SELECT_DISPLAY-1))) top_key = (key_no - (KEYMANAGER_SELECT_DISPLAY-1));
+    }
+    if ((ch == '\r') && (ks_hdr.types[key_no] == KEY_TYPE_ECDH_PUBLIC))
+      marked[key_no/8] ^= (1 << (key_no%8));
+    if (ch == 'S')
+    {
+      int count = 0;
+      for (n=0;n<KEY_NUMBER;n++)
+      {
+        if (!(marked[n/8] & (1 << (n%8)))) continue;
+        if (count == max_recipients)
+        {
+          file_report_error("Too many recipients marked");
+          count = -1;
+          break;
+        }
+        keymanager_load_entry(n, &ke);
+        memcpy((void *)recipients[count++], (void *)ke.ksu.pub.public_key, KEYMANAGER_PUBLICKEY_LEN);
+      }
+      if (count > 0) return count;
+    }
+  }
+}
+
+/* Starts a session with the key manager, reading the header of the store
+   unless it was kept from the last session */
+int keymanager_open_session(aes256_gcm_context *cipher)
+{
+  if (!ks_loaded) keymanager_read_storage();
+  ks_cipher = cipher;
   keyflash_changed = 0;
-  invalidate_passphrase = 0;
+  return 1;
+}
+
+/* Writes back the header if the session changed the store.  The header is
+   kept in memory while the passphrase is known and cleared otherwise, or if
+   it could not be written and so no longer matches the flash. */
+void keymanager_close_session(void)
+{
+  int ok = 1;
+  if (keyflash_changed)
+    ok = keymanager_write_storage();
+  aes256_gcm_clear(ks_cipher);
+  ks_cipher = NULL;
+  if ((!active_key) || (!ok))
+    keymanager_release_cache();
+}
+
+/* Copies the public keys the user marks from the key store, returning the
+   number of keys or -1 if no keys were chosen */
+int keymanager_select_recipients(uint8_t recipients[][KEYMANAGER_PUBLICKEY_LEN], int max_recipients)
+{
+  int count = -1;
+  aes256_gcm_context cipher;
+  if (!keymanager_open_session(&cipher)) return -1;
   if (keymanager_get_passphrase())
+    count = keymanager_mark_recipients(recipients, max_recipients);
+  keymanager_close_session();
+  return count;
+}
+
+/* Finds the public key with a fingerprint in the store, unlocking it if
+   needed.  A private key is given as its public key, which it holds
+   first. */
+int keymanager_find_public_key(const uint8_t *fp, key_entry *ke)
+{
+  int found = 0;
+  aes256_gcm_context cipher;
+  if (!keymanager_open_session(&cipher)) return 0;
+  if ((keymanager_get_passphrase()) && (keymanager_find_fingerprint(fp, ke) >= 0))
   {
-    keymanager_select_key();
-    if (keyflash_changed)
+    if (ke->entry_type == KEY_TYPE_ECDH_PRIVATE)
+    {
+      memset(ke->ksu.priv.private_key, '\000', sizeof(ke->ksu.priv.private_key));
+      ke->entry_type = KEY_TYPE_ECDH_PUBLIC;
+    }
+    found = 1;
+  }
+  keymanager_close_session();
+  return found;
+}
+
+/* Gets the key of the keyring on the card and the counter its header had
+   when it was last closed, unlocking the store if needed.  The key is made
+   when the keyring is first used. */
+int keymanager_keyring_key(uint8_t *key, uint32_t *keyring_counter)
+{
+  int ok = 0;
+  aes256_gcm_context cipher;
+  if (!keymanager_open_session(&cipher)) return 0;
+  if (keymanager_get_passphrase())
+  {
+    if (!ks_keyring_valid)
     {
-      keymanager_recalculate_hashes();
-      keymanager_write_storage();
+      randomness_get_whitened_bits(key, KEYMANAGER_SYMMETRICKEY_LEN);
+      keymanager_keyring_wrap(key, 0);
     }
+    ok = keymanager_keyring_unwrap(key, keyring_counter);
+    if ((!ok) && (ks_keyring_valid)) file_report_error("Keyring key is damaged");
   }
-  memset(ks, '\000', sizeof(key_storage));
-  free(ks);
-  ks = NULL;
+  keymanager_close_session();
+  return ok;
+}
+
+/* Records the counter of the keyring header in the store, so that a copy
+   of the keyring file older than the last one closed is refused */
+int keymanager_keyring_set_counter(uint32_t keyring_counter)
+{
+  uint8_t key[KEYMANAGER_SYMMETRICKEY_LEN];
+  uint32_t old_counter;
+  int ok = 0;
+  aes256_gcm_context cipher;
+  if (!keymanager_open_session(&cipher)) return 0;
+  if ((keymanager_get_passphrase()) && (keymanager_keyring_unwrap(key, &old_counter)))
+  {
+    keymanager_keyring_wrap(key, keyring_counter);
+    ok = 1;
+  }
+  memset(key, '\000', sizeof(key));
+  keymanager_close_session();
+  return ok;
+}
+
+void keymanager(void)
+{
+  aes256_gcm_context cipher;
+  if (!keymanager_open_session(&cipher)) return;
+  invalidate_passphrase = 0;
+  if (keymanager_get_passphrase())
+    keymanager_select_key();
+  keymanager_close_session();
   if (invalidate_passphrase)
   {
-    memset(passphrase_hash,'\000',sizeof(passphrase_hash));
+    keymanager_lock();
     memset((void *)&current_key_private,'\000',sizeof(current_key_private));
-    active_key = 0;
+    keymanager_clear_secret_cache();
   }
 }
 
@@ -21,6 +21,7 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
  */
 
+#include <ff.h>
 #include "cryptotool.h"
 
 #ifdef __cplusplus
@@ -29,6 +30,7 @@ extern "C" {
 
 #define KEY_NUMBER 80
 #define KEY_DESCRIPTION_LEN 30
+#define KEYMANAGER_FINGERPRINT_LEN 8
 #define KEYMANAGER_FLASH_STORAGE_ADDRESS 0x0801E000u
 
 typedef enum
@@ -54,6 +56,23 @@ typedef struct _key_export_public
   uint16_t      crc16;
 } key_export_public;
 
+/* A key bundle is a header block followed by count public key blocks, each
+   the same as an exported public key.  crc32 covers the key blocks in
+   order, so a bundle is checked whole before any of its keys is used. */
+
+#define KEY_BUNDLE_ID 0xAA12
+#define KEY_BUNDLE_VERSION 0x1000
+#define KEY_BUNDLE_MAX_KEYS 1024
+
+typedef struct _key_bundle_header
+{
+  uint16_t      id;
+  uint16_t      vers;
+  uint16_t      count;
+  uint16_t      len;
+  uint32_t      crc32;
+} key_bundle_header;
+
 typedef struct _key_storage_symmetric
 {
   uint8_t symmetric_key[KEYMANAGER_SYMMETRICKEY_LEN];             
@@ -84,24 +103,77 @@ typedef struct _key_entry
   key_storage_union ksu;
 } key_entry;
 
+/* The key store written before keys were encrypted one by one, all of the
+   entries in a single GCM message.  It is read to move its keys into the
+   record store. */
 typedef union _key_entry_union
 {
 	key_entry kes[KEY_NUMBER];
 	uint8_t   filler[PAD_UP_TO_AES_BLOCKLEN(sizeof(key_entry)*KEY_NUMBER)];        /* 64 bytes = 4 AES blocks */
 } key_entry_union;
 
-typedef struct _key_storage
+typedef struct _key_storage_v1
 {
 	uint8_t          salt[KEYMANAGER_KEYBYTES];
   uint8_t          key_entry_iv[AES_BLOCKLEN];
   uint8_t          key_entry_tag[AES_BLOCKLEN];
 	key_entry_union  keu;
+  uint32_t         kdf_iterations;
+} key_storage_v1;
+
+/* The key store holds a record for each slot that has a key, packed in slot
+   order after the header.  A record is the store counter when it was
+   written, the description and key encrypted under the passphrase hash,
+   and the GCM tag.  The nonce is the slot and the counter, and the slot and
+   type are authenticated with the record, so a slot is read or written
+   without touching the others.  check_tag is the tag of an empty message
+   that tells whether a passphrase is right.  In flash the header and each
+   record are kept as items of the key journal. */
+
+#define KEY_STORE_ID 0xAA22
+#define KEY_STORE_VERSION 0x2000
+#define KEY_STORE_SIZE (8192-4)
+#define KEY_STORE_CHECK_SLOT 0xFF
+#define KEY_STORE_KEYRING_SLOT 0xFE
+#define KEY_RECORD_COUNTER_LEN 4
+#define KEY_KEYRING_RECORD_LEN (KEY_RECORD_COUNTER_LEN+KEYMANAGER_SYMMETRICKEY_LEN+KEY_RECORD_COUNTER_LEN+AES_GCM_TAG_LENGTH)
+
+typedef struct _key_storage_header
+{
+  uint16_t         id;
+  uint16_t         vers;
+  uint8_t          salt[KEYMANAGER_KEYBYTES];
+  uint32_t         kdf_iterations;
+  uint32_t         counter;
+  uint8_t          check_tag[AES_GCM_TAG_LENGTH];
+  uint8_t          types[KEY_NUMBER];
+} key_storage_header;
+
+typedef struct _key_storage
+{
+  key_storage_header hdr;
+  uint8_t          records[KEY_STORE_SIZE-sizeof(key_storage_header)];
 } key_storage;
 
 void keymanager(void);
 void keymanager_initialize(void);
 void keymanager_display_key(int entno, key_entry *ke);
 int keymanager_compute_secret(uint8_t *secret, int *secretlen);
+int keymanager_compute_shared_secret(const uint8_t *public_key, uint8_t *secret, int *secretlen);
+int keymanager_select_recipients(uint8_t recipients[][KEYMANAGER_PUBLICKEY_LEN], int max_recipients);
+void keymanager_clear_secret_cache(void);
+uint32_t keymanager_kdf_iterations(void);
+int keymanager_keyring_key(uint8_t *key, uint32_t *keyring_counter);
+int keymanager_keyring_set_counter(uint32_t keyring_counter);
+int keymanager_read_public_key(key_entry *ke);
+int keymanager_open_bundle(FIL *f, key_bundle_header *kbh);
+int keymanager_read_bundle_key(FIL *f, key_entry *ke);
+uint32_t keymanager_get_counter(const uint8_t *rec);
+void keymanager_put_counter(uint8_t *rec, uint32_t counter);
+int keymanager_heap_room(size_t len);
+void *keymanager_malloc(size_t len);
+void keymanager_fingerprint(uint8_t *fp, const uint8_t *public_key);
+int keymanager_find_public_key(const uint8_t *fp, key_entry *ke);
 
 extern key_entry current_key_private;
 extern key_entry current_key_public;
@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "Arduino.h"
+#include <string.h>
+#include <ctype.h>
+#include <ff.h>
+#include "consoleio.h"
+#include "fileop.h"
+#include "keymanager.h"
+#include "keyring.h"
+#include "cryptotool.h"
+#include "random.h"
+#include "mini-printf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KEYRING_SELECT_DISPLAY 16
+
+/* The state of an open keyring, allocated only while it is open */
+typedef struct _keyring_state
+{
+  FIL                 f;
+  aes256_gcm_context *cipher;
+  keyring_header      hdr;
+  uint32_t            stored_counter;
+  uint8_t             changed;
+  int                 count;
+  int                 capacity;
+  keyring_index      *index;
+  uint8_t             used[KEYRING_MAX_ENTRIES/8];
+} keyring_state;
+
+static keyring_state *kr = NULL;
+
+static void keyring_nonce(uint8_t *nonce, uint32_t counter)
+{
+  memcpy(nonce, kr->hdr.file_id, KEYRING_FILE_ID_LEN);
+  nonce[8] = (uint8_t)(counter >> 24);
+  nonce[9] = (uint8_t)(counter >> 16);
+  nonce[10] = (uint8_t)(counter >> 8);
+  nonce[11] = (uint8_t)counter;
+}
+
+static void keyring_header_start(void)
+{
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  keyring_nonce(nonce, kr->hdr.counter);
+  aes256_gcm_setiv(kr->cipher, nonce);
+  aes256_gcm_auth(kr->cipher, &kr->hdr, offsetof(keyring_header, tag));
+}
+
+static FSIZE_t keyring_offset(uint32_t entry)
+{
+  return sizeof(keyring_header) + ((FSIZE_t)entry) * KEYRING_RECORD_LEN;
+}
+
+static int keyring_write_header(void)
+{
+  UINT bw;
+  kr->hdr.counter++;
+  kr->changed = 1;
+  keyring_header_start();
+  aes256_gcm_compute_tag(kr->cipher, kr->hdr.tag);
+  if (f_lseek(&kr->f, 0) != FR_OK) return 0;
+  if ((f_write(&kr->f, &kr->hdr, sizeof(keyring_header), &bw) != FR_OK) || (bw != sizeof(keyring_header))) return 0;
+  return 1;
+}
+
+/* Reads and decrypts an entry, which reads as empty if it fails its tag or
+   its counter is above that of the header.  The counter of the record is
+   returned in counter, or zero if the record is not valid. */
+static int keyring_read_entry(uint32_t entry, keyring_entry *ke, uint32_t *counter)
+{
+  UINT br;
+  uint8_t rec[KEYRING_RECORD_LEN];
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  uint8_t aad[4];
+  int ok = 0;
+  memset((void *)ke, '\000', sizeof(*ke));
+  *counter = 0;
+  if ((f_lseek(&kr->f, keyring_offset(entry)) == FR_OK) &&
+      (f_read(&kr->f, rec, sizeof(rec), &br) == FR_OK) && (br == sizeof(rec)) &&
+      (keymanager_get_counter(rec) <= kr->hdr.counter))
+  {
+    keymanager_put_counter(aad, entry);
+    keyring_nonce(nonce, keymanager_get_counter(rec));
+    aes256_gcm_setiv(kr->cipher, nonce);
+    aes256_gcm_auth(kr->cipher, aad, sizeof(aad));
+    aes256_gcm_decrypt(kr->cipher, ke, &rec[KEY_RECORD_COUNTER_LEN], sizeof(keyring_entry));
+    ok = aes256_gcm_check_tag(kr->cipher, &rec[KEY_RECORD_COUNTER_LEN+sizeof(keyring_entry)]);
+  }
+  if (ok) *counter = keymanager_get_counter(rec);
+  else memset((void *)ke, '\000', sizeof(*ke));
+  memset(rec, '\000', sizeof(rec));
+  return ok;
+}
+
+/* Writes an entry under a new counter.  The header is written first so
+   that a counter is never used twice, even if the record is not written. */
+static int keyring_write_entry(uint32_t entry, const keyring_entry *ke)
+{
+  UINT bw;
+  keyring_entry old;
+  uint8_t rec[KEYRING_RECORD_LEN];
+  uint8_t nonce[AES_GCM_IV_LENGTH];
+  uint8_t aad[4];
+  uint32_t old_counter = 0;
+  if (entry < kr->hdr.entries) keyring_read_entry(entry, &old, &old_counter);
+  memset((void *)&old, '\000', sizeof(old));
+  uint32_t counter = ++kr->hdr.counter;
+  kr->hdr.counter_sum = kr->hdr.counter_sum - old_counter + counter;
+  kr->hdr.last_entry = entry;
+  if (entry >= kr->hdr.entries) kr->hdr.entries = entry + 1;
+  if (!keyring_write_header()) return 0;
+  keymanager_put_counter(aad, entry);
+  keymanager_put_counter(rec, counter);
+  keyring_nonce(nonce, counter);
+  aes256_gcm_setiv(kr->cipher, nonce);
+  aes256_gcm_auth(kr->cipher, aad, sizeof(aad));
+  aes256_gcm_encrypt(kr->cipher, &rec[KEY_RECORD_COUNTER_LEN], ke, sizeof(keyring_entry));
+  aes256_gcm_compute_tag(kr->cipher, &rec[KEY_RECORD_COUNTER_LEN+sizeof(keyring_entry)]);
+  int ok = (f_lseek(&kr->f, keyring_offset(entry)) == FR_OK) &&
+           (f_write(&kr->f, rec, sizeof(rec), &bw) == FR_OK) && (bw == sizeof(rec)) &&
+           (f_sync(&kr->f) == FR_OK);
+  memset(rec, '\000', sizeof(rec));
+  return ok;
+}
+
+static uint16_t keyring_fingerprint(const uint8_t *public_key)
+{
+  uint8_t fp[KEYMANAGER_FINGERPRINT_LEN];
+  keymanager_fingerprint(fp, public_key);
+  return fp[0] | (((uint16_t)fp[1]) << 8);
+}
+
+static void keyring_prefix(char *prefix, const char *name, int len)
+{
+  int i, end = 0;
+  for (i=0;i<KEYRING_PREFIX_LEN;i++)
+  {
+    if ((i >= len) || (name[i] == '\000')) end = 1;
+    prefix[i] = end ? '\000' : toupper(name[i]);
+  }
+}
+
+/* The first index position whose prefix is not before the given one */
+static int keyring_lower_bound(const char *prefix)
+{
+  int lo = 0, hi = kr->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (memcmp(kr->index[mid].prefix, prefix, KEYRING_PREFIX_LEN) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Adds an entry to the index after any with the same prefix, returning its
+   position or -1 if there is no room */
+static int keyring_index_insert(uint32_t entry, const keyring_entry *ke)
+{
+  char prefix[KEYRING_PREFIX_LEN];
+  int pos;
+  if (kr->count >= kr->capacity)
+  {
+    int capacity = kr->capacity + KEYRING_INDEX_GROW;
+    if (capacity > KEYRING_MAX_ENTRIES) capacity = KEYRING_MAX_ENTRIES;
+    if ((capacity <= kr->count) || (!keymanager_heap_room((capacity - kr->capacity) * sizeof(keyring_index)))) return -1;
+    keyring_index *index = (keyring_index *)realloc(kr->index, capacity * sizeof(keyring_index));
+    if (index == NULL) return -1;
+    kr->index = index;
+    kr->capacity = capacity;
+  }
+  keyring_prefix(prefix, ke->description, KEY_DESCRIPTION_LEN);
+  pos = keyring_lower_bound(prefix);
+  while ((pos < kr->count) && (memcmp(kr->index[pos].prefix, prefix, KEYRING_PREFIX_LEN) == 0))
+    pos++;
+  memmove(&kr->index[pos+1], &kr->index[pos], (kr->count - pos) * sizeof(keyring_index));
+  memcpy(kr->index[pos].prefix, prefix, KEYRING_PREFIX_LEN);
+  kr->index[pos].fingerprint = keyring_fingerprint(ke->public_key);
+  kr->index[pos].entry = entry;
+  kr->count++;
+  kr->used[entry/8] |= (1 << (entry%8));
+  return pos;
+}
+
+static void keyring_index_remove(int pos)
+{
+  uint16_t entry = kr->index[pos].entry;
+  kr->used[entry/8] &= ~(1 << (entry%8));
+  kr->count--;
+  memmove(&kr->index[pos], &kr->index[pos+1], (kr->count - pos) * sizeof(keyring_index));
+}
+
+/* Checks the sum of the counters of the records against the header, then
+   indexes the last entry written.  If the sum is short only because the
+   last write was cut short before its record was written, that entry is
+   rewritten as empty instead.  Returns an error or NULL. */
+static const char *keyring_check_sum(uint64_t sum, uint32_t last, uint32_t last_counter, keyring_entry *ke)
+{
+  uint32_t counter;
+  if (sum == kr->hdr.counter_sum)
+  {
+    if ((last < kr->hdr.entries) && keyring_read_entry(last, ke, &counter) &&
+        (ke->entry_type == KEY_TYPE_ECDH_PUBLIC) && (keyring_index_insert(last, ke) < 0))
+      return "Not enough memory for keyring";
+    return NULL;
+  }
+  if ((last < kr->hdr.entries) && (last_counter != (kr->hdr.counter - 1)) &&
+      ((sum - last_counter + (kr->hdr.counter - 1)) == kr->hdr.counter_sum))
+  {
+    kr->hdr.counter_sum = sum;
+    memset((void *)ke, '\000', sizeof(*ke));
+    if (!keyring_write_entry(last, ke)) return "Could not write keyring";
+    file_report_error("The last change to the keyring was not finished");
+    return NULL;
+  }
+  return "Keyring is damaged or an older copy";
+}
+
+/* Reads every entry once to index its public keys, leaving the last entry
+   written until the counters are checked.  Returns an error or NULL. */
+static const char *keyring_build_index(void)
+{
+  keyring_entry ke;
+  uint32_t entry, counter, last_counter = 0;
+  uint32_t last = kr->hdr.last_entry;
+  uint64_t sum = 0;
+  const char *error = NULL;
+  for (entry=0;(entry<kr->hdr.entries) && (error == NULL);entry++)
+  {
+    keyring_read_entry(entry, &ke, &counter);
+    sum += counter;
+    if (entry == last)
+      last_counter = counter;
+    else if ((ke.entry_type == KEY_TYPE_ECDH_PUBLIC) && (keyring_index_insert(entry, &ke) < 0))
+      error = "Not enough memory for keyring";
+  }
+  if (error == NULL) error = keyring_check_sum(sum, last, last_counter, &ke);
+  memset((void *)&ke, '\000', sizeof(ke));
+  return error;
+}
+
+/* Opens the keyring, creating it if it does not exist, and builds its
+   index.  The cipher context is kept by the caller until the keyring is
+   closed. */
+int keyring_open(aes256_gcm_context *cipher)
+{
+  uint8_t key[KEYMANAGER_SYMMETRICKEY_LEN];
+  uint32_t stored_counter;
+  if (kr != NULL) return 1;
+  if (!fs0_mounted)
+  {
+    file_report_error("Ciphertext card is not mounted");
+    return 0;
+  }
+  if (!keymanager_keyring_key(key, &stored_counter)) return 0;
+  kr = (keyring_state *)keymanager_malloc(sizeof(keyring_state));
+  if (kr == NULL)
+  {
+    memset(key, '\000', sizeof(key));
+    file_report_error("Not enough memory for keyring");
+    return 0;
+  }
+  memset((void *)kr, '\000', sizeof(keyring_state));
+  kr->cipher = cipher;
+  kr->stored_counter = stored_counter;
+  aes256_gcm_init(kr->cipher, key);
+  memset(key, '\000', sizeof(key));
+  if (f_open(&kr->f, KEYRING_FILENAME, FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK)
+  {
+    aes256_gcm_clear(kr->cipher);
+    free(kr);
+    kr = NULL;
+    file_report_error("Could not open keyring");
+    return 0;
+  }
+  const char *error = NULL;
+  if (f_size(&kr->f) == 0)
+  {
+    kr->hdr.id = KEYRING_ID;
+    kr->hdr.vers = KEYRING_VERSION;
+    kr->hdr.counter = stored_counter;
+    kr->hdr.last_entry = KEYRING_NO_ENTRY;
+    randomness_get_whitened_bits(kr->hdr.file_id, sizeof(kr->hdr.file_id));
+    if ((!keyring_write_header()) || (f_sync(&kr->f) != FR_OK))
+      error = "Could not write keyring";
+    else if (stored_counter != 0)
+      file_report_error("Keyring was missing, a new one was made");
+  } else
+  {
+    UINT br;
+    if ((f_read(&kr->f, &kr->hdr, sizeof(keyring_header), &br) != FR_OK) || (br != sizeof(keyring_header)) ||
+        (kr->hdr.id != KEYRING_ID) || (kr->hdr.vers != KEYRING_VERSION) || (kr->hdr.entries > KEYRING_MAX_ENTRIES))
+      error = "Keyring is not valid";
+    else
+    {
+      keyring_header_start();
+      if (!aes256_gcm_check_tag(kr->cipher, kr->hdr.tag))
+        error = "Keyring is damaged or not for this key store";
+      else if (kr->hdr.counter < stored_counter)
+        error = "Keyring is an older copy";
+      else if (f_size(&kr->f) < keyring_offset(kr->hdr.entries))
+        error = "Keyring is damaged or cut short";
+      else
+        error = keyring_build_index();
+    }
+  }
+  if (error != NULL)
+  {
+    keyring_close();
+    file_report_error(error);
+    return 0;
+  }
+  return 1;
+}
+
+/* Closes the keyring, recording the counter of its header in the store if
+   it was written */
+void keyring_close(void)
+{
+  uint32_t counter;
+  if (kr == NULL) return;
+  f_close(&kr->f);
+  counter = kr->changed ? kr->hdr.counter : 0;
+  aes256_gcm_clear(kr->cipher);
+  if (kr->index != NULL)
+  {
+    memset((void *)kr->index, '\000', kr->capacity * sizeof(keyring_index));
+    free(kr->index);
+  }
+  memset((void *)kr, '\000', sizeof(keyring_state));
+  free(kr);
+  kr = NULL;
+  if (counter != 0) keymanager_keyring_set_counter(counter);
+}
+
+int keyring_count(void)
+{
+  return (kr == NULL) ? 0 : kr->count;
+}
+
+/* Reads the entry at a position in the index */
+int keyring_load(int pos, keyring_entry *ke)
+{
+  if ((kr == NULL) || (pos < 0) || (pos >= kr->count))
+  {
+    memset((void *)ke, '\000', sizeof(*ke));
+    return 0;
+  }
+  uint32_t counter;
+  return keyring_read_entry(kr->index[pos].entry, ke, &counter);
+}
+
+/* Finds the first entry whose name starts with the given one, ignoring
+   case, or else the position the name would have */
+int keyring_find(const char *name)
+{
+  char prefix[KEYRING_PREFIX_LEN];
+  keyring_entry ke;
+  int len = strlen(name);
+  if (kr == NULL) return -1;
+  keyring_prefix(prefix, name, len);
+  int pos = keyring_lower_bound(prefix);
+  int found = pos;
+  if (len > KEYRING_PREFIX_LEN)
+  {
+    for (;(pos < kr->count) && (memcmp(kr->index[pos].prefix, prefix, KEYRING_PREFIX_LEN) == 0);pos++)
+    {
+      if (keyring_load(pos, &ke) && (strncasecmp(ke.description, name, len) == 0))
+      {
+        found = pos;
+        break;
+      }
+    }
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  return found;
+}
+
+/* Finds the entry holding a public key, or -1 if none does */
+int keyring_find_key(const uint8_t *public_key)
+{
+  keyring_entry ke;
+  int pos, found = -1;
+  if (kr == NULL) return -1;
+  uint16_t fingerprint = keyring_fingerprint(public_key);
+  for (pos=0;pos<kr->count;pos++)
+  {
+    if ((kr->index[pos].fingerprint == fingerprint) && keyring_load(pos, &ke) &&
+        (memcmp(ke.public_key, public_key, KEYMANAGER_PUBLICKEY_LEN) == 0))
+    {
+      found = pos;
+      break;
+    }
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  return found;
+}
+
+/* Adds a public key, reusing the record of a removed entry if there is one.
+   Returns the position of the key or -1. */
+int keyring_add(const char *description, const uint8_t *public_key)
+{
+  keyring_entry ke;
+  uint32_t entry;
+  int pos;
+  if (kr == NULL) return -1;
+  if (keyring_find_key(public_key) >= 0)
+  {
+    file_report_error("Key is already in keyring");
+    return -1;
+  }
+  for (entry=0;(entry<KEYRING_MAX_ENTRIES) && (kr->used[entry/8] & (1 << (entry%8)));entry++);
+  if (entry >= KEYRING_MAX_ENTRIES)
+  {
+    file_report_error("Keyring is full");
+    return -1;
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  ke.entry_type = KEY_TYPE_ECDH_PUBLIC;
+  strncpy(ke.description, description, sizeof(ke.description)-1);
+  memcpy(ke.public_key, public_key, sizeof(ke.public_key));
+  pos = keyring_index_insert(entry, &ke);
+  if (pos < 0)
+    file_report_error("Not enough memory for keyring");
+  else if (!keyring_write_entry(entry, &ke))
+  {
+    keyring_index_remove(pos);
+    file_report_error("Could not write keyring");
+    pos = -1;
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  return pos;
+}
+
+/* Removes the entry at a position, rewriting its record as empty */
+int keyring_remove(int pos)
+{
+  keyring_entry ke;
+  if ((kr == NULL) || (pos < 0) || (pos >= kr->count)) return 0;
+  memset((void *)&ke, '\000', sizeof(ke));
+  if (!keyring_write_entry(kr->index[pos].entry, &ke))
+  {
+    file_report_error("Could not write keyring");
+    return 0;
+  }
+  keyring_index_remove(pos);
+  return 1;
+}
+
+static void keyring_add_key(int *pos, const char *description, const uint8_t *public_key)
+{
+  int n = keyring_add(description, public_key);
+  if (n >= 0) *pos = n;
+}
+
+/* Adds the keys of a bundle the user selects, skipping those already in
+   the keyring */
+static void keyring_import_bundle(int *pos)
+{
+  FIL f;
+  key_entry entry;
+  key_bundle_header kbh;
+  uint16_t imported = 0, duplicates = 0;
+  if (!keymanager_open_bundle(&f, &kbh)) return;
+  for (uint16_t n=0;n<kbh.count;n++)
+  {
+    if (!keymanager_read_bundle_key(&f, &entry)) break;
+    if (keyring_find_key(entry.ksu.pub.public_key) >= 0)
+    {
+      duplicates++;
+      continue;
+    }
+    int added = keyring_add(entry.description, entry.ksu.pub.public_key);
+    if (added < 0) break;
+    *pos = added;
+    imported++;
+  }
+  f_close(&f);
+  memset((void *)&entry, '\000', sizeof(entry));
+  {
+    char s[60];
+    mini_snprintf(s, sizeof(s)-1, "Imported %u of %u, %u already in keyring", imported, kbh.count, duplicates);
+    file_report_error(s);
+  }
+}
+
+void keyring(void)
+{
+  aes256_gcm_context cipher;
+  keyring_entry ke;
+  key_entry entry;
+  char name[KEY_DESCRIPTION_LEN];
+  int pos = 0;
+  int top = 0;
+  if (!keyring_open(&cipher)) return;
+  for (;;)
+  {
+    int n, count = keyring_count();
+    if (pos >= count) pos = count - 1;
+    if (pos < 0) pos = 0;
+    if (top > pos) top = pos;
+    if (top < (pos - (KEYRING_SELECT_DISPLAY-1))) top = (pos - (KEYRING_SELECT_DISPLAY-1));
+    console_clrscr();
+    console_puts("Keyring: ");
+    console_printint(count);
+    console_puts(" public keys");
+    for (n=0;(n<KEYRING_SELECT_DISPLAY) && ((top+n)<count);n++)
+    {
+      keyring_load(top+n, &ke);
+      if ((top+n) == pos) console_highvideo();
+      console_gotoxy(1,n+3);
+      console_printint(top+n+1);
+      console_puts(". ");
+      console_puts(ke.description);
+      console_lowvideo();
+    }
+    console_gotoxy(1,20);
+    console_puts("Q-quits, F-find by name, X-remove key\r\nUp/Down/Enter select public key\r\nI-Import Public Key file, M-Import Key Bundle\r\nS-Save current public key");
+    int ch = toupper(console_getch());
+    if (ch == 'Q') break;
+    if (ch == 'A') pos--;
+    if (ch == 'B') pos++;
+    if ((ch == '\r') && keyring_load(pos, &ke))
+    {
+      memset((void *)&current_key_public, '\000', sizeof(current_key_public));
+      current_key_public.entry_type = KEY_TYPE_ECDH_PUBLIC;
+      memcpy(current_key_public.description, ke.description, sizeof(current_key_public.description));
+      memcpy(current_key_public.ksu.pub.public_key, ke.public_key, sizeof(current_key_public.ksu.pub.public_key));
+      console_clrscr();
+      console_gotoxy(1,5);
+      console_puts("Selected public key:\r\n");
+      keymanager_display_key(-1,&current_key_public);
+      console_press_space();
+    }
+    if (ch == 'F')
+    {
+      console_clrscr();
+      console_puts("Find name:");
+      console_getstring(name, sizeof(name)-1, 3, 1, 40);
+      if (name[0] != '\000') pos = keyring_find(name);
+    }
+    if (ch == 'I')
+    {
+      if (keymanager_read_public_key(&entry))
+        keyring_add_key(&pos, entry.description, entry.ksu.pub.public_key);
+    }
+    if (ch == 'M')
+      keyring_import_bundle(&pos);
+    if ((ch == 'S') && (current_key_public.entry_type == KEY_TYPE_ECDH_PUBLIC))
+      keyring_add_key(&pos, current_key_public.description, current_key_public.ksu.pub.public_key);
+    if ((ch == 'X') && keyring_load(pos, &ke))
+    {
+      console_clrscr();
+      console_gotoxy(1,5);
+      console_puts("Remove this key from the keyring?\r\n");
+      console_puts(ke.description);
+      if (!console_yes(18)) keyring_remove(pos);
+    }
+  }
+  memset((void *)&ke, '\000', sizeof(ke));
+  memset((void *)&entry, '\000', sizeof(entry));
+  keyring_close();
+}
+
+#ifdef __cplusplus
+}
+#endif
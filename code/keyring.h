@@ -0,0 +1,103 @@
+#ifndef _KEYRING_H
+#define _KEYRING_H
+
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "keymanager.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The keyring holds public keys beyond those that fit in the key store, in
+   a file on the ciphertext card encrypted under a key wrapped in the store.
+   Each entry is a record of its own, the record counter, the encrypted
+   entry and its GCM tag, so that an entry is read or written without the
+   others.  The nonce of a record is the file id and the counter, and the
+   entry number is authenticated with it.  The header is authenticated the
+   same way under its own counter.  A removed entry is rewritten as empty.
+
+   The header holds the sum of the counters of the records, and a record
+   whose counter is above that of the header is refused.  A record only
+   ever gets a higher counter, so putting back an older record, or cutting
+   records off the end, leaves the sum short.  The header also names the
+   last entry written, which is taken as removed if a write was cut short
+   before its record was written.  The store keeps the counter of the
+   header when the keyring was last closed, and an older copy of the whole
+   file is refused.
+
+   When the keyring is opened every entry is read once to build an index in
+   memory, sorted by the start of the name, holding a short fingerprint of
+   the public key and the entry number.  Lists, lookups by name and lookups
+   by key use the index and decrypt only the entries they show or match. */
+
+#define KEYRING_FILENAME "0:/KEYRING.PBK"
+#define KEYRING_ID 0xAA44
+#define KEYRING_VERSION 0x1001
+#define KEYRING_MAX_ENTRIES 1024
+#define KEYRING_INDEX_GROW 32
+#define KEYRING_PREFIX_LEN 4
+#define KEYRING_FILE_ID_LEN 8
+#define KEYRING_NO_ENTRY 0xFFFFFFFFu
+
+typedef struct _keyring_header
+{
+  uint16_t      id;
+  uint16_t      vers;
+  uint32_t      entries;
+  uint64_t      counter_sum;
+  uint32_t      counter;
+  uint32_t      last_entry;
+  uint8_t       file_id[KEYRING_FILE_ID_LEN];
+  uint8_t       tag[AES_GCM_TAG_LENGTH];
+} keyring_header;
+
+typedef struct _keyring_entry
+{
+  uint8_t       entry_type;
+  char          description[KEY_DESCRIPTION_LEN];
+  uint8_t       public_key[KEYMANAGER_PUBLICKEY_LEN];
+} keyring_entry;
+
+#define KEYRING_RECORD_LEN (KEY_RECORD_COUNTER_LEN+sizeof(keyring_entry)+AES_GCM_TAG_LENGTH)
+
+typedef struct _keyring_index
+{
+  char          prefix[KEYRING_PREFIX_LEN];
+  uint16_t      fingerprint;
+  uint16_t      entry;
+} keyring_index;
+
+int keyring_open(aes256_gcm_context *cipher);
+void keyring_close(void);
+int keyring_count(void);
+int keyring_load(int pos, keyring_entry *ke);
+int keyring_find(const char *name);
+int keyring_find_key(const uint8_t *public_key);
+int keyring_add(const char *description, const uint8_t *public_key);
+int keyring_remove(int pos);
+void keyring(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _KEYRING_H */
@@ -230,6 +230,39 @@ void BLAKE2s::clear()
     reset();
 }
 
+/**
+ * \brief Saves the internal state of this hash object.
+ *
+ * \param saved Receives a copy of the state.
+ *
+ * The state can be saved after absorbing a key or a prefix that is common to
+ * many messages and then restored with restoreState() before hashing each of
+ * them, so the blocks of the prefix are only compressed once.  Only blocks
+ * that have been followed by more data are compressed, so absorb at least one
+ * byte beyond the last full block of the prefix before saving.
+ *
+ * The saved state is sensitive if the key is; clean() it when done.
+ *
+ * \sa restoreState()
+ */
+void BLAKE2s::saveState(State &saved) const
+{
+    memcpy(&saved, &state, sizeof(state));
+}
+
+/**
+ * \brief Restores the internal state of this hash object from a copy that
+ * was made with saveState().
+ *
+ * \param saved The state to restore.
+ *
+ * \sa saveState()
+ */
+void BLAKE2s::restoreState(const State &saved)
+{
+    memcpy(&state, &saved, sizeof(state));
+}
+
 void BLAKE2s::resetHMAC(const void *key, size_t keyLen)
 {
     formatHMACKey(state.m, key, keyLen, 0x36);
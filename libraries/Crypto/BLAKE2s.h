@@ -46,13 +46,18 @@ public:
     void resetHMAC(const void *key, size_t keyLen);
     void finalizeHMAC(const void *key, size_t keyLen, void *hash, size_t hashLen);
 
-private:
-    struct {
+    struct State {
         uint32_t h[8];
         uint32_t m[16];
         uint64_t length;
         uint8_t chunkSize;
-    } state;
+    };
+
+    void saveState(State &saved) const;
+    void restoreState(const State &saved);
+
+private:
+    State state;
 
     void processChunk(uint32_t f0);
 };
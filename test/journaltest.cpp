@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2020 Daniel Marks
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+ */
+
+/* Runs the key store journal on the emulated flash.  The store is filled
+   with as many private keys as the journal capacity allows, which must be
+   KEY_NUMBER, and then updated a key at a time the way the key manager
+   writes it, each session writing the header, one key and compacting.  It reports the halfwords
+   programmed and the pages erased per update and the wear of the pages
+   for a store of ten keys and a full store, and cuts the power at every
+   halfword of a run of sessions on the full store to check that each key
+   then reads as its last or its new version and that the journal still
+   takes writes.  It also damages the newest record of a key to check that
+   it is refused and that the version before it is read once the journal
+   is mounted again. */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "keymanager.h"
+#include "keyjournal.h"
+#include "flashemu.h"
+
+#define JT_HEADER_LEN offsetof(key_storage_header, types)
+#define JT_PRIVATE_LEN (KEY_RECORD_COUNTER_LEN+KEY_DESCRIPTION_LEN+sizeof(key_storage_private)+AES_GCM_TAG_LENGTH)
+#define JT_KEYRING_ITEM (KEY_NUMBER+1)
+#define JT_UPDATES 2000
+#define JT_CUT_SESSIONS 40
+
+typedef struct _jt_store
+{
+  int      keys;
+  uint32_t version[KEYJOURNAL_ITEMS];
+} jt_store;
+
+static int jt_failures;
+
+static void jt_check(int ok, const char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) jt_failures++;
+}
+
+static int jt_item_len(int item)
+{
+  if (item == 0) return JT_HEADER_LEN;
+  if (item == JT_KEYRING_ITEM) return KEY_KEYRING_RECORD_LEN;
+  return JT_PRIVATE_LEN;
+}
+
+/* The contents of a version of an item, which begin with the version */
+static void jt_fill(int item, uint32_t version, uint8_t *data, int len)
+{
+  int n;
+  memcpy(data, &version, sizeof(version));
+  for (n=sizeof(version);n<len;n++)
+    data[n] = (uint8_t)(item*31 + version*7 + n);
+}
+
+/* Returns the version of an item read from the journal, or 0xFFFFFFFF if
+   it is missing or damaged */
+static uint32_t jt_read(int item)
+{
+  uint8_t data[KEYJOURNAL_MAX_DATA], expect[KEYJOURNAL_MAX_DATA];
+  uint32_t version;
+  int len = jt_item_len(item);
+
+  if (keyjournal_read(item, NULL, data, sizeof(data)) != len) return 0xFFFFFFFFu;
+  memcpy(&version, data, sizeof(version));
+  jt_fill(item, version, expect, len);
+  return memcmp(data, expect, len) ? 0xFFFFFFFFu : version;
+}
+
+static int jt_write(jt_store *st, int item)
+{
+  uint8_t data[KEYJOURNAL_MAX_DATA];
+  jt_fill(item, st->version[item] + 1, data, jt_item_len(item));
+  if (!keyjournal_write(item, KEY_TYPE_ECDH_PRIVATE, data, jt_item_len(item))) return 0;
+  st->version[item]++;
+  return 1;
+}
+
+/* One key update as the key manager writes it.  If the power is cut, item
+   is set to the item whose write was interrupted, or -1. */
+static int jt_session(jt_store *st, int key, int *item)
+{
+  *item = 0;
+  if (!jt_write(st, 0)) return 0;
+  *item = key;
+  if (!jt_write(st, key)) return 0;
+  *item = -1;
+  return keyjournal_compact();
+}
+
+/* Returns the number of items that do not read as expected.  The item
+   whose write was interrupted may read as either version. */
+static int jt_verify(const jt_store *st, int cut_item)
+{
+  int n, bad = 0;
+  uint32_t version;
+
+  for (n=0;n<=st->keys;n++)
+  {
+    version = jt_read(n);
+    if ((version != st->version[n]) && ((n != cut_item) || (version != (st->version[n] + 1))))
+      bad++;
+  }
+  if (jt_read(JT_KEYRING_ITEM) != st->version[JT_KEYRING_ITEM]) bad++;
+  return bad;
+}
+
+static uint32_t jt_total_erases(void)
+{
+  const flashemu_stats *fs = flashemu_get_stats();
+  uint32_t total = 0;
+  int n;
+  for (n=0;n<FLASHEMU_PAGES;n++) total += fs->erases[n];
+  return total;
+}
+
+/* Formats the journal and writes the header, the keyring key and up to
+   keys private keys, as many as fit in its capacity */
+static int jt_fill_store(jt_store *st, int keys)
+{
+  uint32_t size = KEYJOURNAL_RECORD_SIZE(JT_HEADER_LEN) + KEYJOURNAL_RECORD_SIZE(KEY_KEYRING_RECORD_LEN);
+  int n, ok;
+
+  flashemu_reset();
+  memset(st, '\000', sizeof(*st));
+  while ((st->keys < keys) && ((size + KEYJOURNAL_RECORD_SIZE(JT_PRIVATE_LEN)) <= KEYJOURNAL_CAPACITY))
+  {
+    size += KEYJOURNAL_RECORD_SIZE(JT_PRIVATE_LEN);
+    st->keys++;
+  }
+  ok = keyjournal_format() && jt_write(st, 0) && jt_write(st, JT_KEYRING_ITEM);
+  for (n=1;(n<=st->keys) && ok;n++)
+    ok = jt_write(st, n);
+  return ok && keyjournal_compact();
+}
+
+static void jt_test_capacity(jt_store *st)
+{
+  char msg[80];
+  jt_check(jt_fill_store(st, KEY_NUMBER), "store filled to capacity");
+  sprintf(msg, "%d private keys fill %u bytes of capacity", st->keys, (unsigned)KEYJOURNAL_CAPACITY);
+  jt_check(keyjournal_mount() && (jt_verify(st, -1) == 0), msg);
+  jt_check(st->keys == KEY_NUMBER, "every key slot can hold a private key");
+}
+
+/* Updates the keys of a store of keys keys in turn */
+static void jt_test_wear(jt_store *st, int keys)
+{
+  const flashemu_stats *fs = flashemu_get_stats();
+  uint32_t programmed, erases, least = 0xFFFFFFFFu, most = 0;
+  int n, item, ok;
+  char msg[80];
+
+  ok = jt_fill_store(st, keys);
+  programmed = fs->programmed;
+  erases = jt_total_erases();
+  if (ok) ok = jt_session(st, 1, &item);
+  printf("%d keys, one update: %u halfwords programmed, %u pages erased\n", st->keys,
+         (unsigned)(fs->programmed - programmed), (unsigned)(jt_total_erases() - erases));
+  programmed = fs->programmed;
+  erases = jt_total_erases();
+  for (n=0;(n<JT_UPDATES) && ok;n++)
+    ok = jt_session(st, 1 + (n % st->keys), &item);
+  sprintf(msg, "%d keys, %d updates written", st->keys, JT_UPDATES);
+  jt_check(ok, msg);
+  printf("%d keys, per update: %.1f halfwords programmed, %.3f pages erased\n", st->keys,
+         (double)(fs->programmed - programmed) / JT_UPDATES, (double)(jt_total_erases() - erases) / JT_UPDATES);
+  printf("%d keys, page erases:", st->keys);
+  for (n=0;n<FLASHEMU_PAGES;n++)
+  {
+    printf(" %u", (unsigned)fs->erases[n]);
+    if (fs->erases[n] < least) least = fs->erases[n];
+    if (fs->erases[n] > most) most = fs->erases[n];
+  }
+  printf("\n");
+  sprintf(msg, "%d keys, pages within %u erases of each other", st->keys, (unsigned)(most - least));
+  jt_check((most - least) <= (KEYJOURNAL_WEAR_SPREAD + 2), msg);
+  sprintf(msg, "%d keys, every key kept", st->keys);
+  jt_check(keyjournal_mount() && (jt_verify(st, -1) == 0), msg);
+}
+
+/* Cuts the power after each number of halfwords a run of sessions
+   programs, including the compactions in it, then mounts the journal,
+   checks every key and that the journal still takes a session */
+static void jt_test_power_cut(jt_store *st)
+{
+  static uint8_t snapshot[FLASHEMU_SIZE];
+  const flashemu_stats *fs = flashemu_get_stats();
+  jt_store start = *st, cut;
+  uint32_t programmed = fs->programmed, erases = jt_total_erases(), limit, total;
+  int n, item, bad = 0, ok = 1;
+  char msg[80];
+
+  memcpy(snapshot, flashemu_memory(), FLASHEMU_SIZE);
+  for (n=0;(n<JT_CUT_SESSIONS) && ok;n++)
+    ok = jt_session(st, 1 + (n % st->keys), &item);
+  total = fs->programmed - programmed;
+  printf("power cut run: %d sessions, %u halfwords, %u pages erased\n", JT_CUT_SESSIONS,
+         (unsigned)total, (unsigned)(jt_total_erases() - erases));
+  for (limit=0;limit<=total;limit++)
+  {
+    memcpy(flashemu_memory(), snapshot, FLASHEMU_SIZE);
+    cut = start;
+    item = -1;
+    ok = keyjournal_mount();
+    flashemu_power_limit(limit);
+    for (n=0;(n<JT_CUT_SESSIONS) && ok;n++)
+      ok = jt_session(&cut, 1 + (n % cut.keys), &item);
+    flashemu_power_limit(-1);
+    if (ok) item = -1;
+    if ((!keyjournal_mount()) || (jt_verify(&cut, item) != 0))
+    {
+      printf("power cut after %u halfwords: keys lost\n", (unsigned)limit);
+      bad++;
+      continue;
+    }
+    cut.version[0] = jt_read(0);
+    if (item > 0) cut.version[item] = jt_read(item);
+    if ((!jt_session(&cut, 1, &item)) || (!keyjournal_mount()) || (jt_verify(&cut, -1) != 0))
+    {
+      printf("power cut after %u halfwords: journal not writable\n", (unsigned)limit);
+      bad++;
+    }
+  }
+  sprintf(msg, "power cut at each of %u halfwords", (unsigned)(total + 1));
+  jt_check(bad == 0, msg);
+}
+
+/* Flips a bit in the data of a version of an item */
+static int jt_damage(int item, uint32_t version)
+{
+  uint8_t data[KEYJOURNAL_MAX_DATA], *mem = flashemu_memory();
+  int n, len = jt_item_len(item);
+
+  jt_fill(item, version, data, len);
+  for (n=0;n<=(FLASHEMU_SIZE-len);n++)
+    if (!memcmp(&mem[n], data, len))
+    {
+      mem[n + len/2] ^= 0x10;
+      return 1;
+    }
+  return 0;
+}
+
+static void jt_test_damage(jt_store *st)
+{
+  uint8_t data[KEYJOURNAL_MAX_DATA];
+  int ok = jt_fill_store(st, 10) && jt_write(st, 1) && jt_write(st, 1) && jt_damage(1, st->version[1]);
+  jt_check(ok && (keyjournal_read(1, NULL, data, sizeof(data)) < 0), "damaged record refused");
+  st->version[1]--;
+  jt_check(keyjournal_mount() && (jt_verify(st, -1) == 0), "version before a damaged record read");
+}
+
+int main(void)
+{
+  jt_store st;
+  jt_test_capacity(&st);
+  jt_test_wear(&st, 10);
+  jt_test_wear(&st, KEY_NUMBER);
+  jt_test_power_cut(&st);
+  jt_test_damage(&st);
+  printf(jt_failures ? "%d FAILED\n" : "ALL OK\n", jt_failures);
+  return jt_failures != 0;
+}